@@ -0,0 +1,733 @@
+/**
+ * Block device (image file I/O engine) implementation.
+ */
+
+#define _GNU_SOURCE // O_DIRECT
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "bdev.h"
+#include "map.h"
+#include "util.h"
+
+#ifndef MADV_COLD
+#define MADV_COLD 20 // Linux 5.4; older kernels fail with EINVAL
+#endif
+
+/** Position of a block in the image file. */
+static off_t
+blk_off(vsfs_blk_t blk)
+{
+  return (off_t)blk * VSFS_BLOCK_SIZE;
+}
+
+/** Get a pointer to a block in the view. */
+static void*
+blk_addr(bdev* dev, vsfs_blk_t blk)
+{
+  return dev->image + (size_t)blk * VSFS_BLOCK_SIZE;
+}
+
+// mmap engine
+
+static bool
+mmap_open(bdev* dev, const char* path, bool direct)
+{
+  (void)direct; // rejected by vsfs_opt_parse()
+  dev->image = map_file(path, VSFS_BLOCK_SIZE, &dev->size);
+  if (dev->image == NULL) {
+    return false;
+  }
+  dev->nblocks = dev->size / VSFS_BLOCK_SIZE;
+  // File data is spliced between FUSE and this descriptor rather than copied
+  // through the mapping (see inode_read_buf() and inode_write_buf()); I/O
+  // falls back to copying without it. The journal also writes through it.
+  dev->fd = open(path, O_RDWR);
+  dev->cached = false;
+  dev->present = NULL;
+  return true;
+}
+
+static void
+mmap_close(bdev* dev)
+{
+  munmap(dev->image, dev->size);
+  if (dev->fd >= 0) {
+    close(dev->fd);
+  }
+}
+
+static int
+mmap_load(bdev* dev, vsfs_blk_t start, uint32_t n)
+{
+  // Page faults read blocks in
+  (void)dev;
+  (void)start;
+  (void)n;
+  return 0;
+}
+
+static int
+mmap_flush(bdev* dev, vsfs_blk_t start, uint32_t n)
+{
+  // msync() needs a page-aligned address; the mapping itself is aligned
+  uint64_t page = sysconf(_SC_PAGESIZE);
+  uint64_t from = (uint64_t)start * VSFS_BLOCK_SIZE;
+  uint64_t to = from + (uint64_t)n * VSFS_BLOCK_SIZE;
+  from -= from % page;
+
+  if (msync(dev->image + from, to - from, MS_SYNC) < 0) {
+    return -errno;
+  }
+  return 0;
+}
+
+static int
+mmap_write(bdev* dev, const bdev_run* runs, uint32_t count)
+{
+  // Dirty pages are already in the page cache; just get the kernel going
+  if (dev->fd < 0) return 0;
+  for (uint32_t i = 0; i < count; i++) {
+    if (sync_file_range(dev->fd, blk_off(runs[i].start),
+                        (off_t)runs[i].n * VSFS_BLOCK_SIZE,
+                        SYNC_FILE_RANGE_WRITE) < 0) {
+      return -errno;
+    }
+  }
+  return 0;
+}
+
+static int
+mmap_sync(bdev* dev)
+{
+  if (dev->fd < 0) {
+    return (msync(dev->image, dev->size, MS_SYNC) < 0) ? -errno : 0;
+  }
+  return (fdatasync(dev->fd) < 0) ? -errno : 0;
+}
+
+static const bdev_ops mmap_ops = {
+  .name = "mmap",
+  .open = mmap_open,
+  .close = mmap_close,
+  .load = mmap_load,
+  .flush = mmap_flush,
+  .write = mmap_write,
+  .sync = mmap_sync,
+};
+
+// pread engine
+
+static bool
+pread_open(bdev* dev, const char* path, bool direct)
+{
+  dev->fd = open(path, O_RDWR | (direct ? O_DIRECT : 0));
+  if (dev->fd < 0) {
+    perror(path);
+    return false;
+  }
+
+  struct stat s;
+  if (fstat(dev->fd, &s) < 0) {
+    perror("fstat");
+    goto fail;
+  }
+  if (s.st_size == 0) {
+    fprintf(stderr, "Image file is empty\n");
+    goto fail;
+  }
+  if (s.st_size % VSFS_BLOCK_SIZE != 0) {
+    fprintf(stderr, "Image file size is not a multiple of block size\n");
+    goto fail;
+  }
+  dev->size = s.st_size;
+  dev->nblocks = dev->size / VSFS_BLOCK_SIZE;
+
+  // Pages of the view that are never used are never allocated
+  dev->image = mmap(NULL, dev->size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (dev->image == MAP_FAILED) {
+    perror("mmap");
+    goto fail;
+  }
+  dev->present = calloc(div_round_up(dev->nblocks, BDEV_WORD_BITS),
+                        sizeof(bitmap_t));
+  if (dev->present == NULL) {
+    munmap(dev->image, dev->size);
+    goto fail;
+  }
+  dev->cached = true;
+  return true;
+
+fail:
+  close(dev->fd);
+  return false;
+}
+
+static void
+pread_close(bdev* dev)
+{
+  free(dev->present);
+  munmap(dev->image, dev->size);
+  close(dev->fd);
+}
+
+/** Set the present bits of a range of blocks. */
+static void
+set_present(bdev* dev, vsfs_blk_t start, uint32_t n)
+{
+  for (vsfs_blk_t b = start; b < start + n; b++) {
+    __atomic_fetch_or(&dev->present[b / BDEV_WORD_BITS],
+                      (bitmap_t)1 << (b % BDEV_WORD_BITS), __ATOMIC_RELEASE);
+  }
+}
+
+/** Read a run of blocks from the image file into the view. */
+static int
+read_run(bdev* dev, vsfs_blk_t start, uint32_t n)
+{
+  size_t len = (size_t)n * VSFS_BLOCK_SIZE;
+  for (size_t done = 0; done < len;) {
+    ssize_t res = pread(dev->fd, blk_addr(dev, start) + done, len - done,
+                        blk_off(start) + done);
+    if (res < 0 && errno == EINTR) continue;
+    if (res <= 0) {
+      // Don't leave parts of the run behind; it isn't marked present
+      memset(blk_addr(dev, start), 0, len);
+      return (res < 0) ? -errno : -EIO;
+    }
+    done += res;
+  }
+  return 0;
+}
+
+static int
+pread_load(bdev* dev, vsfs_blk_t start, uint32_t n)
+{
+  int err = 0;
+  pthread_mutex_lock(&dev->load_lock);
+  // One read per run of missing blocks
+  for (vsfs_blk_t b = start; b < start + n && err == 0;) {
+    if (bdev_present(dev, b)) {
+      b++;
+      continue;
+    }
+    uint32_t len = 1;
+    while (b + len < start + n && !bdev_present(dev, b + len)) len++;
+    err = read_run(dev, b, len);
+    if (err == 0) {
+      set_present(dev, b, len);
+    }
+    b += len;
+  }
+  pthread_mutex_unlock(&dev->load_lock);
+  return err;
+}
+
+/** Write a run of blocks from the view to the image file. */
+static int
+write_run(bdev* dev, vsfs_blk_t start, uint32_t n)
+{
+  size_t len = (size_t)n * VSFS_BLOCK_SIZE;
+  for (size_t done = 0; done < len;) {
+    ssize_t res = pwrite(dev->fd, blk_addr(dev, start) + done, len - done,
+                         blk_off(start) + done);
+    if (res < 0 && errno == EINTR) continue;
+    if (res < 0) return -errno;
+    done += res;
+  }
+  return 0;
+}
+
+static int
+pread_write(bdev* dev, const bdev_run* runs, uint32_t count)
+{
+  for (uint32_t i = 0; i < count; i++) {
+    int err = write_run(dev, runs[i].start, runs[i].n);
+    if (err < 0) return err;
+  }
+  return 0;
+}
+
+static int
+pread_sync(bdev* dev)
+{
+  return (fdatasync(dev->fd) < 0) ? -errno : 0;
+}
+
+static int
+pread_flush(bdev* dev, vsfs_blk_t start, uint32_t n)
+{
+  // One write per run of present blocks
+  for (vsfs_blk_t b = start; b < start + n;) {
+    if (!bdev_present(dev, b)) {
+      b++;
+      continue;
+    }
+    uint32_t len = 1;
+    while (b + len < start + n && bdev_present(dev, b + len)) len++;
+    int err = write_run(dev, b, len);
+    if (err < 0) return err;
+    b += len;
+  }
+  return pread_sync(dev);
+}
+
+static const bdev_ops pread_ops = {
+  .name = "pread",
+  .open = pread_open,
+  .close = pread_close,
+  .load = pread_load,
+  .flush = pread_flush,
+  .write = pread_write,
+  .sync = pread_sync,
+};
+
+// uring engine: the pread engine, with I/O through io_uring (set up with the
+// raw system calls, so that nothing but the kernel headers is needed)
+
+/** Most blocks moved by a single request. */
+#define URING_CHUNK_BLOCKS 32
+
+/** Size of a ring: the most requests in flight at a time. */
+#define URING_ENTRIES 64
+
+/** Most runs of blocks gathered for one batch of requests. */
+#define URING_BATCH 64
+
+/** An io_uring instance. */
+typedef struct ring
+{
+  int fd;
+  /** Submission queue, shared with the kernel. */
+  unsigned* sq_tail;
+  unsigned sq_mask;
+  unsigned* sq_array;
+  struct io_uring_sqe* sqes;
+  /** Completion queue, shared with the kernel. */
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe* cqes;
+  /** Mappings of the queues. */
+  void* sq_ptr;
+  size_t sq_len;
+  void* cq_ptr;
+  size_t cq_len;
+  size_t sqes_len;
+
+} ring;
+
+/** State of the uring engine (bdev.priv). */
+typedef struct uring_state
+{
+  /** Ring for reading blocks in; used under bdev.load_lock. */
+  ring rd;
+  /**
+   * Ring for writing blocks back; used under wr_lock, so that write-back
+   * doesn't hold up reads.
+   */
+  ring wr;
+  pthread_mutex_t wr_lock;
+
+} uring_state;
+
+static void
+ring_destroy(ring* r)
+{
+  if (r->sqes != MAP_FAILED) {
+    munmap(r->sqes, r->sqes_len);
+  }
+  if (r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr) {
+    munmap(r->cq_ptr, r->cq_len);
+  }
+  if (r->sq_ptr != MAP_FAILED) {
+    munmap(r->sq_ptr, r->sq_len);
+  }
+  close(r->fd);
+}
+
+/**
+ * Set up a ring with the image file registered as fixed file 0. Returns 0 on
+ * success; -errno on failure, with nothing left to clean up.
+ */
+static int
+ring_init(ring* r, int file)
+{
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  r->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+  if (r->fd < 0) {
+    return -errno;
+  }
+
+  r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single && r->cq_len > r->sq_len) {
+    r->sq_len = r->cq_len;
+  }
+  r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  r->cq_ptr = single ? r->sq_ptr
+                     : mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, r->fd,
+                            IORING_OFF_CQ_RING);
+  r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sq_ptr == MAP_FAILED || r->cq_ptr == MAP_FAILED ||
+      r->sqes == MAP_FAILED) {
+    int err = -errno;
+    ring_destroy(r);
+    return err;
+  }
+
+  r->sq_tail = (unsigned*)(r->sq_ptr + p.sq_off.tail);
+  r->sq_mask = *(unsigned*)(r->sq_ptr + p.sq_off.ring_mask);
+  r->sq_array = (unsigned*)(r->sq_ptr + p.sq_off.array);
+  r->cq_head = (unsigned*)(r->cq_ptr + p.cq_off.head);
+  r->cq_tail = (unsigned*)(r->cq_ptr + p.cq_off.tail);
+  r->cq_mask = *(unsigned*)(r->cq_ptr + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe*)(r->cq_ptr + p.cq_off.cqes);
+
+  // Saves looking up the file on every request
+  if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES, &file,
+              1) < 0) {
+    int err = -errno;
+    ring_destroy(r);
+    return err;
+  }
+  return 0;
+}
+
+/**
+ * Finish a request that moved a chunk of blocks: mark read blocks present,
+ * or zero-fill them if they could not be read. Short transfers are retried
+ * with pread() or pwrite().
+ */
+static int
+chunk_done(bdev* dev, bool write, vsfs_blk_t start, uint32_t n, int res)
+{
+  int err = 0;
+  if (res != (int)(n * VSFS_BLOCK_SIZE)) {
+    if (res < 0 && res != -EAGAIN && res != -EINTR) {
+      err = res;
+    } else {
+      err = write ? write_run(dev, start, n) : read_run(dev, start, n);
+    }
+  }
+  if (!write && err == 0) {
+    set_present(dev, start, n);
+  } else if (!write) {
+    memset(blk_addr(dev, start), 0, (size_t)n * VSFS_BLOCK_SIZE);
+  }
+  return err;
+}
+
+/**
+ * Read or write runs of blocks through a ring: the runs are split into
+ * chunks, which are all submitted at once (as many as fit in the ring), and
+ * waited for. Returns the first error; the other chunks are still done.
+ */
+static int
+ring_rw(bdev* dev, ring* r, bool write, const bdev_run* runs, uint32_t count)
+{
+  uint32_t run = 0;
+  vsfs_blk_t next = (count > 0) ? runs[0].start : 0;
+  unsigned queued = 0;
+  unsigned inflight = 0;
+  int err = 0;
+
+  while (run < count || queued > 0 || inflight > 0) {
+    // Queue chunks while the ring has room; with no more than its size in
+    // flight, the completion queue can't overflow either
+    unsigned tail = *r->sq_tail;
+    while (run < count && queued + inflight < URING_ENTRIES) {
+      vsfs_blk_t end = runs[run].start + runs[run].n;
+      uint32_t n = end - next;
+      if (n > URING_CHUNK_BLOCKS) {
+        n = URING_CHUNK_BLOCKS;
+      }
+      unsigned idx = tail & r->sq_mask;
+      struct io_uring_sqe* sqe = &r->sqes[idx];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+      sqe->flags = IOSQE_FIXED_FILE;
+      sqe->fd = 0;
+      sqe->addr = (uintptr_t)blk_addr(dev, next);
+      sqe->len = n * VSFS_BLOCK_SIZE;
+      sqe->off = blk_off(next);
+      sqe->user_data = ((uint64_t)next << 32) | n;
+      r->sq_array[idx] = idx;
+      tail++;
+      queued++;
+
+      next += n;
+      if (next == end && ++run < count) {
+        next = runs[run].start;
+      }
+    }
+    __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+    // Submit what is queued, and wait for at least one request to finish
+    int res = syscall(__NR_io_uring_enter, r->fd, queued, 1,
+                      IORING_ENTER_GETEVENTS, NULL, 0);
+    if (res < 0) {
+      if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+      // Only if the ring itself is broken; nothing more can be waited for
+      return -errno;
+    }
+    queued -= res;
+    inflight += res;
+
+    unsigned head = *r->cq_head;
+    unsigned ctail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != ctail; head++) {
+      struct io_uring_cqe* cqe = &r->cqes[head & r->cq_mask];
+      int e = chunk_done(dev, write, cqe->user_data >> 32,
+                         (uint32_t)cqe->user_data, cqe->res);
+      err = (err == 0) ? e : err;
+      inflight--;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+  }
+  return err;
+}
+
+static bool
+uring_open(bdev* dev, const char* path, bool direct)
+{
+  if (!pread_open(dev, path, direct)) {
+    return false;
+  }
+  uring_state* u = malloc(sizeof(*u));
+  int err = (u == NULL) ? -ENOMEM : ring_init(&u->rd, dev->fd);
+  if (err == 0) {
+    err = ring_init(&u->wr, dev->fd);
+    if (err < 0) {
+      ring_destroy(&u->rd);
+    }
+  }
+  if (err < 0) {
+    fprintf(stderr, "io_uring: %s\n", strerror(-err));
+    free(u);
+    pread_close(dev);
+    return false;
+  }
+  pthread_mutex_init(&u->wr_lock, NULL);
+  dev->priv = u;
+  return true;
+}
+
+static void
+uring_close(bdev* dev)
+{
+  uring_state* u = dev->priv;
+  ring_destroy(&u->rd);
+  ring_destroy(&u->wr);
+  pthread_mutex_destroy(&u->wr_lock);
+  free(u);
+  pread_close(dev);
+}
+
+static int
+uring_load(bdev* dev, vsfs_blk_t start, uint32_t n)
+{
+  uring_state* u = dev->priv;
+  bdev_run batch[URING_BATCH];
+  uint32_t count = 0;
+  int err = 0;
+
+  pthread_mutex_lock(&dev->load_lock);
+  // All runs of missing blocks in flight at once
+  for (vsfs_blk_t b = start; b < start + n;) {
+    if (bdev_present(dev, b)) {
+      b++;
+      continue;
+    }
+    uint32_t len = 1;
+    while (b + len < start + n && !bdev_present(dev, b + len)) len++;
+    batch[count++] = (bdev_run){ .start = b, .n = len };
+    b += len;
+
+    if (count == URING_BATCH) {
+      int e = ring_rw(dev, &u->rd, false, batch, count);
+      err = (err == 0) ? e : err;
+      count = 0;
+    }
+  }
+  if (count > 0) {
+    int e = ring_rw(dev, &u->rd, false, batch, count);
+    err = (err == 0) ? e : err;
+  }
+  pthread_mutex_unlock(&dev->load_lock);
+  return err;
+}
+
+static int
+uring_write(bdev* dev, const bdev_run* runs, uint32_t count)
+{
+  uring_state* u = dev->priv;
+  pthread_mutex_lock(&u->wr_lock);
+  int err = ring_rw(dev, &u->wr, true, runs, count);
+  pthread_mutex_unlock(&u->wr_lock);
+  return err;
+}
+
+static int
+uring_flush(bdev* dev, vsfs_blk_t start, uint32_t n)
+{
+  bdev_run batch[URING_BATCH];
+  uint32_t count = 0;
+
+  // All runs of present blocks in flight at once
+  for (vsfs_blk_t b = start; b < start + n;) {
+    if (!bdev_present(dev, b)) {
+      b++;
+      continue;
+    }
+    uint32_t len = 1;
+    while (b + len < start + n && bdev_present(dev, b + len)) len++;
+    batch[count++] = (bdev_run){ .start = b, .n = len };
+    b += len;
+
+    if (count == URING_BATCH) {
+      int err = uring_write(dev, batch, count);
+      if (err < 0) return err;
+      count = 0;
+    }
+  }
+  int err = (count > 0) ? uring_write(dev, batch, count) : 0;
+  return (err < 0) ? err : pread_sync(dev);
+}
+
+static const bdev_ops uring_ops = {
+  .name = "uring",
+  .open = uring_open,
+  .close = uring_close,
+  .load = uring_load,
+  .flush = uring_flush,
+  .write = uring_write,
+  .sync = pread_sync,
+};
+
+/** I/O engines, indexed by vsfs_io_engine. */
+static const bdev_ops* engines[] = { &mmap_ops, &pread_ops, &uring_ops };
+
+bool
+bdev_open(bdev* dev, const char* path, vsfs_io_engine engine, bool direct)
+{
+  memset(dev, 0, sizeof(*dev));
+  dev->ops = engines[engine];
+  if (!dev->ops->open(dev, path, direct)) {
+    return false;
+  }
+  pthread_mutex_init(&dev->load_lock, NULL);
+  return true;
+}
+
+void
+bdev_close(bdev* dev)
+{
+  dev->ops->close(dev);
+  pthread_mutex_destroy(&dev->load_lock);
+}
+
+int
+bdev_load(bdev* dev, vsfs_blk_t start, uint32_t n)
+{
+  assert(start + n <= dev->nblocks);
+  return dev->ops->load(dev, start, n);
+}
+
+void
+bdev_fill(bdev* dev, vsfs_blk_t start, uint32_t n)
+{
+  assert(start + n <= dev->nblocks);
+  if (dev->present != NULL) {
+    set_present(dev, start, n);
+  }
+}
+
+int
+bdev_flush(bdev* dev, vsfs_blk_t start, uint32_t n)
+{
+  assert(start + n <= dev->nblocks);
+  return dev->ops->flush(dev, start, n);
+}
+
+int
+bdev_write(bdev* dev, const bdev_run* runs, uint32_t count)
+{
+  for (uint32_t i = 0; i < count; i++) {
+    assert(runs[i].start + runs[i].n <= dev->nblocks);
+  }
+  return dev->ops->write(dev, runs, count);
+}
+
+int
+bdev_sync(bdev* dev)
+{
+  return dev->ops->sync(dev);
+}
+
+void
+bdev_discard(bdev* dev, vsfs_blk_t blk)
+{
+  if (dev->present == NULL || sysconf(_SC_PAGESIZE) != VSFS_BLOCK_SIZE) {
+    return;
+  }
+  bitmap_t bit = (bitmap_t)1 << (blk % BDEV_WORD_BITS);
+  __atomic_fetch_and(&dev->present[blk / BDEV_WORD_BITS], ~bit,
+                     __ATOMIC_RELAXED);
+  // The anonymous page is replaced with zeros, freeing its memory
+  madvise(blk_addr(dev, blk), VSFS_BLOCK_SIZE, MADV_DONTNEED);
+}
+
+void
+bdev_advise(bdev* dev, vsfs_blk_t start, uint32_t n, vsfs_hint hint)
+{
+  assert(start + n <= dev->nblocks);
+  if (dev->cached || hint == VSFS_HINT_NONE) return;
+
+  // Pages shared with blocks outside the range must be left alone
+  uint64_t page = sysconf(_SC_PAGESIZE);
+  uint64_t from = (uint64_t)start * VSFS_BLOCK_SIZE;
+  from += (page - from % page) % page;
+  uint64_t to = (uint64_t)(start + n) * VSFS_BLOCK_SIZE;
+  to -= to % page;
+  if (to <= from) return;
+
+  // Hints are best effort; errors (e.g. an old kernel) are ignored
+  void* addr = dev->image + from;
+  switch (hint) {
+    case VSFS_HINT_RANDOM:
+      madvise(addr, to - from, MADV_RANDOM);
+      break;
+    case VSFS_HINT_SEQUENTIAL:
+      madvise(addr, to - from, MADV_SEQUENTIAL);
+      madvise(addr, to - from, MADV_WILLNEED);
+      break;
+    case VSFS_HINT_WILLNEED:
+      madvise(addr, to - from, MADV_WILLNEED);
+      break;
+    case VSFS_HINT_COLD:
+      madvise(addr, to - from, MADV_COLD);
+      break;
+    case VSFS_HINT_DONTNEED:
+      madvise(addr, to - from, MADV_DONTNEED);
+      break;
+    default:
+      break;
+  }
+}
@@ -0,0 +1,249 @@
+/**
+ * Block device (image file I/O engine) header file.
+ *
+ * The rest of vsfs sees the image as one contiguous range of memory (image,
+ * size), and gets at blocks by address. A block device provides that view
+ * and moves blocks between it and the image file. There are three engines
+ * (-o io, see options.h):
+ *
+ *   - mmap: the image file is mapped MAP_SHARED. Every block is always
+ *     present, page faults read blocks in, and the kernel writes dirty pages
+ *     back whenever it decides to (or on flush). How the kernel treats the
+ *     pages of each region can be hinted (bdev_advise()): by default the
+ *     metadata is read in page by page, data streamed by sequential reads
+ *     ahead of them, and the pages of deleted files are reclaimed first.
+ *   - pread: the view is an anonymous mapping of the image size that serves
+ *     as the block cache (see cache.h). Blocks are read in with pread() the
+ *     first time they are used (see bdev_block() and bdev_load()), and
+ *     changed blocks only reach the image file when written back, with
+ *     pwrite(). Blocks can be dropped again (bdev_discard()). The image
+ *     file can be opened with O_DIRECT (-o o_direct), bypassing the page
+ *     cache.
+ *   - uring: the pread engine, but blocks are moved with io_uring instead of
+ *     one blocking system call at a time. The runs of a load or write-back
+ *     are split into chunks of up to 128 KiB that are all in flight at
+ *     once, so a cold read of a large file or a write-back of many runs
+ *     keeps the disk busy instead of waiting for one block after the other.
+ *     Everything said about the pread engine elsewhere holds for it too.
+ *
+ * Blocks are only read in under the lock that protects their contents (the
+ * inode lock of their file, or none for the metadata read at mount), so a
+ * block that is present never gets read in again over newer contents.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "bitmap.h"
+#include "options.h"
+#include "vsfs.h"
+
+typedef struct bdev bdev;
+
+/** A run of consecutive blocks. */
+typedef struct bdev_run
+{
+  vsfs_blk_t start;
+  uint32_t n;
+
+} bdev_run;
+
+/** Operations of an I/O engine. */
+typedef struct bdev_ops
+{
+  /** Engine name, as given with -o io. */
+  const char* name;
+  /**
+   * Open the image file and set up the view; sets all bdev fields but ops.
+   * Returns false on failure, after printing an error message.
+   */
+  bool (*open)(bdev* dev, const char* path, bool direct);
+  /** Release everything set up by open(); nothing is written back. */
+  void (*close)(bdev* dev);
+  /** Read in the blocks of a range that are not present yet. */
+  int (*load)(bdev* dev, vsfs_blk_t start, uint32_t n);
+  /** Write the blocks of a range to the image file and wait for them. */
+  int (*flush)(bdev* dev, vsfs_blk_t start, uint32_t n);
+  /**
+   * Start writing runs of blocks to the image file, as many at a time as
+   * the engine can; don't wait for the disk.
+   */
+  int (*write)(bdev* dev, const bdev_run* runs, uint32_t count);
+  /** Wait for everything written so far to reach the disk. */
+  int (*sync)(bdev* dev);
+
+} bdev_ops;
+
+/** An open image file. */
+struct bdev
+{
+  /** I/O engine. */
+  const bdev_ops* ops;
+  /** Start of the view of the image in memory. */
+  void* image;
+  /** Image size in bytes. */
+  size_t size;
+  /** Image size in blocks. */
+  uint32_t nblocks;
+  /** Descriptor of the image file; -1 if the engine could not open one. */
+  int fd;
+  /**
+   * Whether changes only reach the image file when they are flushed, and
+   * the file may be behind the view; false with the mmap engine.
+   */
+  bool cached;
+  /**
+   * Blocks present in the view, one bit per block, set with atomics; NULL if
+   * all blocks always are (mmap engine).
+   */
+  bitmap_t* present;
+  /** Serializes reading blocks in. */
+  pthread_mutex_t load_lock;
+  /** Engine private state; NULL if none. */
+  void* priv;
+};
+
+/** Number of bits in a word of the present bitmap. */
+#define BDEV_WORD_BITS (sizeof(bitmap_t) * 8)
+
+/**
+ * Open an image file.
+ *
+ * The file size must be a non-zero multiple of the block size.
+ *
+ * @param dev     block device to set up.
+ * @param path    image file path.
+ * @param engine  I/O engine.
+ * @param direct  open the file with O_DIRECT (not with mmap).
+ * @return        true on success; false on failure.
+ */
+bool
+bdev_open(bdev* dev, const char* path, vsfs_io_engine engine, bool direct);
+
+/**
+ * Close an image file. Changes that have not been flushed are lost with the
+ * pread engine.
+ *
+ * @param dev  block device.
+ */
+void
+bdev_close(bdev* dev);
+
+/**
+ * Make the blocks of a range present in the view, reading in the ones that
+ * are not with as few reads as possible.
+ *
+ * @param dev    block device.
+ * @param start  first block number.
+ * @param n      number of blocks.
+ * @return       0 on success; -errno on error (e.g. -EIO).
+ */
+int
+bdev_load(bdev* dev, vsfs_blk_t start, uint32_t n);
+
+/**
+ * Mark the blocks of a range present without reading them in, because the
+ * caller is about to overwrite all of their contents.
+ *
+ * @param dev    block device.
+ * @param start  first block number.
+ * @param n      number of blocks.
+ */
+void
+bdev_fill(bdev* dev, vsfs_blk_t start, uint32_t n);
+
+/**
+ * Write the blocks of a range to the image file and wait for them to reach
+ * the disk. Blocks that are not present are unchanged and skipped.
+ *
+ * @param dev    block device.
+ * @param start  first block number.
+ * @param n      number of blocks.
+ * @return       0 on success; -errno on error.
+ */
+int
+bdev_flush(bdev* dev, vsfs_blk_t start, uint32_t n);
+
+/**
+ * Write runs of blocks from the view to the image file, without waiting
+ * for the disk; see bdev_sync(). All blocks of the runs must be present.
+ * The view has been read when it returns, so the blocks can be dropped.
+ *
+ * @param dev    block device.
+ * @param runs   runs of blocks to write.
+ * @param count  number of runs.
+ * @return       0 on success; -errno on error (some runs may have been
+ *               written).
+ */
+int
+bdev_write(bdev* dev, const bdev_run* runs, uint32_t count);
+
+/**
+ * Wait for all blocks written with bdev_write() to reach the disk.
+ *
+ * @param dev  block device.
+ * @return     0 on success; -errno on error.
+ */
+int
+bdev_sync(bdev* dev);
+
+/**
+ * Drop a block from the view, freeing its memory; it is read in again the
+ * next time it is used. The block must not have unwritten changes, and must
+ * not be in use. Does nothing with the mmap engine, or if the page size is
+ * not the block size.
+ *
+ * @param dev  block device.
+ * @param blk  block number.
+ */
+void
+bdev_discard(bdev* dev, vsfs_blk_t blk);
+
+/**
+ * Tell the kernel how the pages of a range of blocks are going to be used,
+ * with madvise(). Only the pages that lie entirely within the range are
+ * affected. Does nothing with the pread and uring engines, where the view
+ * is the block cache rather than the page cache of the image file.
+ *
+ * Random and sequential hints stay with the pages of the range until they
+ * are replaced, and split the mapping where they start and end.
+ *
+ * @param dev    block device.
+ * @param start  first block number.
+ * @param n      number of blocks.
+ * @param hint   hint; VSFS_HINT_SEQUENTIAL also starts reading the pages
+ *               in, like VSFS_HINT_WILLNEED.
+ */
+void
+bdev_advise(bdev* dev, vsfs_blk_t start, uint32_t n, vsfs_hint hint);
+
+/** Check if a block is present in the view. */
+static inline bool
+bdev_present(bdev* dev, vsfs_blk_t blk)
+{
+  return dev->present == NULL ||
+         (__atomic_load_n(&dev->present[blk / BDEV_WORD_BITS],
+                          __ATOMIC_ACQUIRE) &
+          ((bitmap_t)1 << (blk % BDEV_WORD_BITS)));
+}
+
+/**
+ * Get a pointer to a block in the view, reading it in first if it is not
+ * present. A block that can't be read is left zero-filled; use bdev_load()
+ * first where the error can be returned.
+ *
+ * @param dev  block device.
+ * @param blk  block number.
+ * @return     pointer to the block.
+ */
+static inline void*
+bdev_block(bdev* dev, vsfs_blk_t blk)
+{
+  if (!bdev_present(dev, blk)) {
+    bdev_load(dev, blk, 1);
+  }
+  return dev->image + (size_t)blk * VSFS_BLOCK_SIZE;
+}
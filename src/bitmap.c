@@ -8,6 +8,33 @@
 static const size_t bits_per_word = sizeof(size_t) * CHAR_BIT;
 static const size_t word_all_bits = (size_t)-1;
 
+static_assert(sizeof(size_t) <= sizeof(unsigned long long),
+              "bitmap word does not fit the ctz builtin");
+
+// Index of the lowest set bit in a non-zero word
+static inline uint32_t
+word_ctz(size_t word)
+{
+  assert(word != 0);
+  return (uint32_t)__builtin_ctzll(word);
+}
+
+// Read a word that other threads may be updating atomically. A relaxed load
+// is a plain load on all supported targets, so single-threaded users don't
+// pay for it.
+static inline size_t
+load_word(const size_t* words, uint32_t idx)
+{
+  return __atomic_load_n(&words[idx], __ATOMIC_RELAXED);
+}
+
+// Mask of the n bits starting at bit offset of a word
+static inline size_t
+word_mask(uint32_t offset, uint32_t n)
+{
+  return (n == bits_per_word) ? word_all_bits : (((size_t)1 << n) - 1) << offset;
+}
+
 // Initialize the first nbits bits of bitmap to 0 (meaning available).
 int
 bitmap_init(bitmap_t* b, uint32_t nbits)
@@ -38,28 +65,290 @@ bitmap_init(bitmap_t* b, uint32_t nbits)
 // *index. Returns 0 on success and -1 if all bits are already marked as in-use.
 int
 bitmap_alloc(bitmap_t* b, uint32_t nbits, uint32_t* index)
+{
+  uint32_t hint = 0;
+  return bitmap_alloc_next(b, nbits, &hint, index);
+}
+
+// Find the first unused bit at or after bit *hint, wrapping around to the
+// start of the bitmap, mark it as in-use and return its index in *index.
+// *hint is moved past the allocated bit, so that repeated calls allocate
+// bits in next-fit order. Returns 0 on success and -1 if all bits are
+// already marked as in-use.
+int
+bitmap_alloc_next(bitmap_t* b, uint32_t nbits, uint32_t* hint, uint32_t* index)
 {
   uint32_t max_idx = div_round_up(nbits, bits_per_word);
   size_t* words = (size_t*)b;
+  uint32_t start = (*hint < nbits) ? *hint : 0;
+  uint32_t idx = start / bits_per_word;
+
+  // Treat the bits before the hint in its word as in-use for the first pass;
+  // they are checked again after wrapping around.
+  size_t used = words[idx] | (((size_t)1 << (start % bits_per_word)) - 1);
+
+  for (uint32_t n = 0; n <= max_idx; ++n) {
+    if (used != word_all_bits) {
+      uint32_t offset = word_ctz(~used);
+
+      words[idx] |= (size_t)1 << offset;
+      *index = (idx * bits_per_word) + offset;
+      assert(*index < nbits);
+      *hint = *index + 1;
+      return 0;
+    }
+    idx = (idx + 1 < max_idx) ? idx + 1 : 0;
+    used = words[idx];
+  }
+  return -1;
+}
+
+// Index of the first bit at or after from that is equal to val, or nbits if
+// there is none. Whole words that can't contain such a bit are skipped.
+static uint32_t
+find_next(const size_t* words, uint32_t nbits, uint32_t from, bool val)
+{
+  if (from >= nbits) {
+    return nbits;
+  }
+
+  uint32_t idx = from / bits_per_word;
+  size_t flip = val ? 0 : word_all_bits;
+  // Bits that are equal to val are 1 in w; ignore the ones before from
+  size_t w = (load_word(words, idx) ^ flip) &
+             ~(((size_t)1 << (from % bits_per_word)) - 1);
+
+  while (w == 0) {
+    if (++idx >= div_round_up(nbits, bits_per_word)) {
+      return nbits;
+    }
+    w = load_word(words, idx) ^ flip;
+  }
+
+  uint32_t index = idx * bits_per_word + word_ctz(w);
+  return (index < nbits) ? index : nbits;
+}
+
+// Mark count bits starting at start as in-use, a word at a time
+static void
+set_range(size_t* words, uint32_t start, uint32_t count)
+{
+  while (count > 0) {
+    uint32_t idx = start / bits_per_word;
+    uint32_t offset = start % bits_per_word;
+    uint32_t n = bits_per_word - offset;
+    if (n > count) {
+      n = count;
+    }
+
+    size_t mask = word_mask(offset, n);
+    assert((words[idx] & mask) == 0);
+    words[idx] |= mask;
+    start += n;
+    count -= n;
+  }
+}
+
+// Find the first run of count consecutive unused bits in bitmap b, mark them
+// all as in-use and return the index of the first bit of the run in *start.
+// Returns 0 on success and -1 if there is no such run.
+int
+bitmap_alloc_range(bitmap_t* b, uint32_t nbits, uint32_t count, uint32_t* start)
+{
+  assert(count > 0);
+  size_t* words = (size_t*)b;
+  uint32_t pos = 0;
+
+  while (pos < nbits) {
+    // Start of the next free run
+    uint32_t run = find_next(words, nbits, pos, false);
+    if (nbits - run < count) {
+      return -1;
+    }
+
+    // End of the run; no need to look past the number of bits we want
+    uint32_t end = find_next(words, run + count, run, true);
+    if (end - run >= count) {
+      set_range(words, run, count);
+      *start = run;
+      return 0;
+    }
+    pos = end;
+  }
+  return -1;
+}
+
+// Same as bitmap_alloc_next(), but safe to call concurrently.
+int
+bitmap_alloc_atomic(bitmap_t* b, uint32_t nbits, uint32_t* hint,
+                    uint32_t* index)
+{
+  uint32_t max_idx = div_round_up(nbits, bits_per_word);
+  size_t* words = (size_t*)b;
+  uint32_t start = __atomic_load_n(hint, __ATOMIC_RELAXED);
+  if (start >= nbits) {
+    start = 0;
+  }
+  uint32_t idx = start / bits_per_word;
+
+  // Bits before the hint in its word are skipped on the first pass only
+  size_t skip = ((size_t)1 << (start % bits_per_word)) - 1;
 
-  for (uint32_t idx = 0; idx < max_idx; ++idx) {
-    if (words[idx] != word_all_bits) {
-      for (uint32_t offset = 0; offset < bits_per_word; ++offset) {
-        size_t mask = (size_t)1 << offset;
-
-        if ((words[idx] & mask) == 0) {
-          words[idx] |= mask;
-          *index = (idx * bits_per_word) + offset;
-          assert(*index < nbits);
-          return 0;
-        }
+  for (uint32_t n = 0; n <= max_idx; ++n) {
+    size_t word = load_word(words, idx);
+    while ((word | skip) != word_all_bits) {
+      size_t bit = (size_t)1 << word_ctz(~(word | skip));
+
+      // fetch-or returns the word as it was; if the bit was already set,
+      // another thread won it and we retry with the fresh value.
+      word = __atomic_fetch_or(&words[idx], bit, __ATOMIC_ACQ_REL);
+      if ((word & bit) == 0) {
+        *index = (idx * bits_per_word) + word_ctz(bit);
+        assert(*index < nbits);
+        __atomic_store_n(hint, *index + 1, __ATOMIC_RELAXED);
+        return 0;
       }
-      assert(false);
     }
+    skip = 0;
+    idx = (idx + 1 < max_idx) ? idx + 1 : 0;
   }
   return -1;
 }
 
+// Release count bits starting at start with atomic fetch-and
+static void
+release_range(size_t* words, uint32_t start, uint32_t count)
+{
+  while (count > 0) {
+    uint32_t idx = start / bits_per_word;
+    uint32_t offset = start % bits_per_word;
+    uint32_t n = bits_per_word - offset;
+    if (n > count) {
+      n = count;
+    }
+
+    size_t mask = word_mask(offset, n);
+    size_t old = __atomic_fetch_and(&words[idx], ~mask, __ATOMIC_RELEASE);
+    assert((old & mask) == mask); // Don't free something not allocated.
+    (void)old;
+    start += n;
+    count -= n;
+  }
+}
+
+// Claim count bits starting at start, a word at a time with compare-and-swap.
+// If one of them is found in use, everything claimed so far is released, the
+// index of the bit in use is returned in *busy and false is returned.
+static bool
+claim_range(size_t* words, uint32_t start, uint32_t count, uint32_t* busy)
+{
+  uint32_t pos = start;
+  uint32_t left = count;
+
+  while (left > 0) {
+    uint32_t idx = pos / bits_per_word;
+    uint32_t offset = pos % bits_per_word;
+    uint32_t n = bits_per_word - offset;
+    if (n > left) {
+      n = left;
+    }
+
+    size_t mask = word_mask(offset, n);
+    size_t old = load_word(words, idx);
+    do {
+      if ((old & mask) != 0) {
+        *busy = idx * bits_per_word + word_ctz(old & mask);
+        release_range(words, start, pos - start);
+        return false;
+      }
+    } while (!__atomic_compare_exchange_n(&words[idx], &old, old | mask, true,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+    pos += n;
+    left -= n;
+  }
+  return true;
+}
+
+// Search [pos, nbits) for a free run of count bits and claim it
+static int
+alloc_range_from(size_t* words, uint32_t nbits, uint32_t pos, uint32_t count,
+                 uint32_t* start)
+{
+  while (pos < nbits) {
+    uint32_t run = find_next(words, nbits, pos, false);
+    if (nbits - run < count) {
+      return -1;
+    }
+
+    uint32_t end = find_next(words, run + count, run, true);
+    if (end - run < count) {
+      pos = end;
+      continue;
+    }
+
+    // The run looked free; it may have been taken since
+    uint32_t busy;
+    if (claim_range(words, run, count, &busy)) {
+      *start = run;
+      return 0;
+    }
+    pos = busy;
+  }
+  return -1;
+}
+
+int
+bitmap_alloc_range_atomic(bitmap_t* b, uint32_t nbits, uint32_t count,
+                          uint32_t* hint, uint32_t* start)
+{
+  assert(count > 0);
+  size_t* words = (size_t*)b;
+  uint32_t from = __atomic_load_n(hint, __ATOMIC_RELAXED);
+  if (from >= nbits) {
+    from = 0;
+  }
+
+  if (alloc_range_from(words, nbits, from, count, start) < 0 &&
+      (from == 0 || alloc_range_from(words, nbits, 0, count, start) < 0)) {
+    return -1;
+  }
+  __atomic_store_n(hint, *start + count, __ATOMIC_RELAXED);
+  return 0;
+}
+
+// Same as bitmap_free(), but safe to call concurrently.
+void
+bitmap_free_atomic(bitmap_t* b, uint32_t nbits, uint32_t index)
+{
+  assert(index < nbits);
+  bitmap_free_range_atomic(b, nbits, index, 1);
+}
+
+void
+bitmap_free_range_atomic(bitmap_t* b, uint32_t nbits, uint32_t start,
+                         uint32_t count)
+{
+  assert(start < nbits && count <= nbits - start);
+  (void)nbits;
+  release_range((size_t*)b, start, count);
+}
+
+// Same as bitmap_set(), but safe to call concurrently.
+void
+bitmap_set_atomic(bitmap_t* b, uint32_t nbits, uint32_t index, bool val)
+{
+  assert(index < nbits);
+  uint32_t idx = index / bits_per_word;
+  size_t mask = (size_t)1 << (index % bits_per_word);
+  size_t* words = (size_t*)b;
+
+  if (val) {
+    __atomic_fetch_or(&words[idx], mask, __ATOMIC_ACQ_REL);
+  } else {
+    __atomic_fetch_and(&words[idx], ~mask, __ATOMIC_RELEASE);
+  }
+}
+
 // Marks the bit at the given index as available (0).
 // The supplied index must be less than the number of bits in the bitmap.
 // The bitmap at the supplied index must be marked allocated.
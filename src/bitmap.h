@@ -23,12 +23,61 @@ bitmap_init(bitmap_t* b, uint32_t nbits);
 int
 bitmap_alloc(bitmap_t* b, uint32_t nbits, uint32_t* index);
 
+// Find the first unused bit at or after bit *hint, wrapping around to the
+// start of the bitmap, mark it as in-use and return its index in *index.
+// *hint is moved past the allocated bit, so that repeated calls allocate
+// bits in next-fit order. Returns 0 on success and -1 if all bits are
+// already marked as in-use.
+int
+bitmap_alloc_next(bitmap_t* b, uint32_t nbits, uint32_t* hint, uint32_t* index);
+
+// Find the first run of count consecutive unused bits in bitmap b, mark them
+// all as in-use and return the index of the first bit of the run in *start.
+// Returns 0 on success and -1 if there is no such run.
+int
+bitmap_alloc_range(bitmap_t* b, uint32_t nbits, uint32_t count, uint32_t* start);
+
 // Marks the bit at the given index as available (0).
 // The supplied index must be less than the number of bits in the bitmap.
 // The bitmap at the supplied index must be marked allocated.
 void
 bitmap_free(bitmap_t* b, uint32_t nbits, uint32_t index);
 
+// Concurrent variants. These may be called from several threads at once on
+// the same bitmap without a lock: bits are claimed with atomic fetch-or and
+// compare-and-swap, and released with atomic fetch-and. The *hint cursors
+// are read and written with relaxed atomics, so threads may share one, but
+// each thread should have its own to avoid contending on the same words.
+
+// Same as bitmap_alloc_next(), but safe to call concurrently.
+int
+bitmap_alloc_atomic(bitmap_t* b, uint32_t nbits, uint32_t* hint,
+                    uint32_t* index);
+
+// Find a run of count consecutive unused bits at or after bit *hint, wrapping
+// around to the start of the bitmap, mark them all as in-use and return the
+// index of the first bit of the run in *start. *hint is moved past the run.
+// Bits of a candidate run are claimed a word at a time; if another thread
+// claims one of them first, the words claimed so far are released and the
+// search continues. Returns 0 on success and -1 if there is no such run.
+int
+bitmap_alloc_range_atomic(bitmap_t* b, uint32_t nbits, uint32_t count,
+                          uint32_t* hint, uint32_t* start);
+
+// Same as bitmap_free(), but safe to call concurrently.
+void
+bitmap_free_atomic(bitmap_t* b, uint32_t nbits, uint32_t index);
+
+// Mark count bits starting at start as available, a word at a time.
+// All of them must be marked allocated. Safe to call concurrently.
+void
+bitmap_free_range_atomic(bitmap_t* b, uint32_t nbits, uint32_t start,
+                         uint32_t count);
+
+// Same as bitmap_set(), but safe to call concurrently.
+void
+bitmap_set_atomic(bitmap_t* b, uint32_t nbits, uint32_t index, bool val);
+
 // Set the bit at index to 0 if val==false, or 1 if val == true
 void
 bitmap_set(bitmap_t* b, uint32_t nbits, uint32_t index, bool val);
@@ -0,0 +1,389 @@
+/**
+ * Block cache of the pread I/O engine implementation.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "util.h"
+#include "writeback.h"
+
+// Queue of a block in fs_cache.state; CACHE_A1OUT blocks are not present
+#define CACHE_NONE 0
+#define CACHE_A1IN 1
+#define CACHE_AM 2
+#define CACHE_A1OUT 3
+#define CACHE_QUEUE 3
+// CLOCK reference bit
+#define CACHE_REF 4
+
+/** Size of a transparent huge page. */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+static bool
+queue_init(cache_queue* q, uint32_t size)
+{
+  q->blocks = malloc(size * sizeof(vsfs_blk_t));
+  q->size = size;
+  q->head = 0;
+  q->count = 0;
+  return q->blocks != NULL;
+}
+
+static void
+queue_push(cache_queue* q, vsfs_blk_t blk)
+{
+  assert(q->count < q->size);
+  q->blocks[(q->head + q->count) % q->size] = blk;
+  q->count++;
+}
+
+static vsfs_blk_t
+queue_pop(cache_queue* q)
+{
+  assert(q->count > 0);
+  vsfs_blk_t blk = q->blocks[q->head];
+  q->head = (q->head + 1) % q->size;
+  q->count--;
+  return blk;
+}
+
+static uint8_t
+get_state(fs_cache* c, vsfs_blk_t blk)
+{
+  return __atomic_load_n(&c->state[blk], __ATOMIC_RELAXED);
+}
+
+static void
+set_state(fs_cache* c, vsfs_blk_t blk, uint8_t state)
+{
+  __atomic_store_n(&c->state[blk], state, __ATOMIC_RELAXED);
+}
+
+/** Check a bit of a bitmap that is changed with atomics. */
+static bool
+test_bit(bitmap_t* bm, vsfs_blk_t blk)
+{
+  return __atomic_load_n(&bm[blk / BDEV_WORD_BITS], __ATOMIC_RELAXED) &
+         ((bitmap_t)1 << (blk % BDEV_WORD_BITS));
+}
+
+bool
+cache_init(fs_ctx* fs)
+{
+  fs_cache* c = &fs->cache;
+  memset(c, 0, sizeof(*c));
+  if (!fs->dev.cached) return true;
+
+  c->enabled = true;
+  pthread_mutex_init(&c->lock, NULL);
+
+  c->pinned = fs->sb->data_region;
+  c->capacity = fs->cache_blocks;
+  if (c->capacity > 0 && c->capacity < VSFS_CACHE_MIN_BLOCKS) {
+    c->capacity = VSFS_CACHE_MIN_BLOCKS;
+  }
+  // Blocks can only be dropped one by one if they are pages of their own
+  if (sysconf(_SC_PAGESIZE) != VSFS_BLOCK_SIZE) {
+    c->capacity = 0;
+  }
+
+  uint32_t nblocks = fs->dev.nblocks;
+  c->owner = malloc(nblocks * sizeof(vsfs_ino_t));
+  c->state = calloc(nblocks, sizeof(uint8_t));
+  if (c->owner == NULL || c->state == NULL) {
+    return false;
+  }
+  for (vsfs_blk_t b = 0; b < nblocks; b++) {
+    c->owner[b] = VSFS_INO_MAX;
+  }
+
+  // Every unpinned block fits in a1in or am at the same time, even when
+  // eviction falls behind
+  if (c->capacity > 0) {
+    uint32_t size = nblocks - c->pinned;
+    if (!queue_init(&c->a1in, size) || !queue_init(&c->am, size) ||
+        !queue_init(&c->a1out, size)) {
+      return false;
+    }
+  }
+
+  // The pinned blocks are used all the time and never dropped, so they can
+  // be backed by huge pages (collapsed by khugepaged, since they are already
+  // read in) to save TLB misses. The rest of the view is dropped block by
+  // block, which huge pages would only get in the way of.
+  size_t huge = (size_t)c->pinned * VSFS_BLOCK_SIZE;
+  huge -= huge % HUGE_PAGE_SIZE;
+  if (huge > 0) {
+    madvise(fs->image, huge, MADV_HUGEPAGE);
+  }
+  return true;
+}
+
+void
+cache_destroy(fs_ctx* fs)
+{
+  fs_cache* c = &fs->cache;
+  if (!c->enabled) return;
+
+  free(c->owner);
+  free(c->state);
+  free(c->a1in.blocks);
+  free(c->am.blocks);
+  free(c->a1out.blocks);
+  pthread_mutex_destroy(&c->lock);
+  memset(c, 0, sizeof(*c));
+}
+
+void
+cache_hit(fs_ctx* fs, vsfs_blk_t blk)
+{
+  uint8_t* state = &fs->cache.state[blk];
+  // Blocks are usually hit many times in a row; don't write the byte
+  if (!(__atomic_load_n(state, __ATOMIC_RELAXED) & CACHE_REF)) {
+    __atomic_fetch_or(state, CACHE_REF, __ATOMIC_RELAXED);
+  }
+  __atomic_fetch_add(&fs_ctx_slot(fs)->cache_hits, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Record a present block as used by an inode, and put it in a queue if it
+ * isn't in one yet. The cache lock must be held.
+ */
+static void
+admit(fs_ctx* fs, vsfs_ino_t ino, vsfs_blk_t blk)
+{
+  fs_cache* c = &fs->cache;
+  __atomic_store_n(&c->owner[blk], ino, __ATOMIC_RELAXED);
+
+  uint8_t queue = get_state(c, blk) & CACHE_QUEUE;
+  if (queue == CACHE_A1IN || queue == CACHE_AM) {
+    __atomic_fetch_or(&c->state[blk], CACHE_REF, __ATOMIC_RELAXED);
+    return;
+  }
+  c->nresident++;
+  if (c->capacity == 0) {
+    // Nothing is ever evicted; no need for the queues
+    set_state(c, blk, CACHE_AM);
+  } else if (queue == CACHE_A1OUT) {
+    // Evicted from a1in not long ago and wanted again: a hot block
+    queue_push(&c->am, blk);
+    set_state(c, blk, CACHE_AM);
+  } else {
+    queue_push(&c->a1in, blk);
+    set_state(c, blk, CACHE_A1IN);
+  }
+}
+
+/**
+ * Check if a block has changes that are not written back yet, or is being
+ * written back.
+ */
+static bool
+is_dirty(fs_ctx* fs, vsfs_blk_t blk)
+{
+  fs_journal* j = &fs->journal;
+  if (j->enabled) {
+    return test_bit(j->dirty_meta, blk) || test_bit(j->dirty_data, blk);
+  }
+  return writeback_busy(fs, blk);
+}
+
+/**
+ * Drop a block from the view, unless it is in use or dirty. The cache lock
+ * and, with a journal, the commit lock must be held.
+ */
+static bool
+drop(fs_ctx* fs, vsfs_blk_t blk)
+{
+  vsfs_ino_t owner = fs->cache.owner[blk];
+  if (owner == VSFS_INO_MAX ||
+      pthread_rwlock_trywrlock(&fs->ilocks[owner]) != 0) {
+    return false;
+  }
+  // Checked under the owner lock: changes are recorded before it is released
+  bool dirty = is_dirty(fs, blk);
+  if (!dirty) {
+    bdev_discard(&fs->dev, blk);
+  }
+  pthread_rwlock_unlock(&fs->ilocks[owner]);
+  return !dirty;
+}
+
+/** Remember a block evicted from a1in. The cache lock must be held. */
+static void
+remember(fs_cache* c, vsfs_blk_t blk)
+{
+  if (c->a1out.count >= c->capacity / 2) {
+    // The queue may also hold blocks that have since been read in again
+    vsfs_blk_t old = queue_pop(&c->a1out);
+    if (get_state(c, old) == CACHE_A1OUT) {
+      set_state(c, old, CACHE_NONE);
+    }
+  }
+  queue_push(&c->a1out, blk);
+  set_state(c, blk, CACHE_A1OUT);
+}
+
+/**
+ * Evict blocks until the cache is within its capacity again, or every block
+ * has been looked at. Blocks that are in use or dirty are skipped and stay
+ * in their queues, so the cache may stay above capacity for a while. The
+ * cache lock must be held.
+ */
+static void
+evict(fs_ctx* fs)
+{
+  fs_cache* c = &fs->cache;
+  fs_journal* j = &fs->journal;
+  if (c->capacity == 0 || c->nresident <= c->capacity) return;
+
+  // Blocks must not be dropped while a commit writes them back
+  if (j->enabled && pthread_mutex_trylock(&j->commit_lock) != 0) return;
+
+  uint32_t kin = c->capacity / 4;
+  // Referenced blocks in am get a second chance, so they are seen twice
+  uint32_t tries = c->a1in.count + 2 * c->am.count;
+  while (c->nresident > c->capacity && tries-- > 0) {
+    bool from_a1in = c->a1in.count > kin || c->am.count == 0;
+    cache_queue* q = from_a1in ? &c->a1in : &c->am;
+    vsfs_blk_t blk = queue_pop(q);
+
+    if (!from_a1in && (get_state(c, blk) & CACHE_REF)) {
+      __atomic_fetch_and(&c->state[blk], ~CACHE_REF, __ATOMIC_RELAXED);
+      queue_push(q, blk);
+      continue;
+    }
+    if (!drop(fs, blk)) {
+      queue_push(q, blk);
+      continue;
+    }
+    c->nresident--;
+    c->evictions++;
+    if (from_a1in) {
+      remember(c, blk);
+    } else {
+      set_state(c, blk, CACHE_NONE);
+    }
+  }
+
+  if (j->enabled) {
+    pthread_mutex_unlock(&j->commit_lock);
+  }
+
+  // Most likely too many blocks are dirty; get them written back
+  if (c->nresident > c->capacity && !j->enabled) {
+    writeback_kick(fs);
+  }
+}
+
+/** Leave out the pinned blocks at the start of a range. */
+static void
+skip_pinned(fs_cache* c, vsfs_blk_t* start, uint32_t* n)
+{
+  if (*start < c->pinned) {
+    uint32_t skip = (c->pinned - *start < *n) ? c->pinned - *start : *n;
+    *start += skip;
+    *n -= skip;
+  }
+}
+
+int
+cache_load(fs_ctx* fs, vsfs_ino_t ino, vsfs_blk_t start, uint32_t n)
+{
+  fs_cache* c = &fs->cache;
+  if (!c->enabled) return bdev_load(&fs->dev, start, n);
+  skip_pinned(c, &start, &n);
+  if (n == 0) return 0;
+
+  // Blocks of our own that are present stay so while we hold the lock
+  uint32_t i = 0;
+  while (i < n && bdev_present(&fs->dev, start + i) &&
+         __atomic_load_n(&c->owner[start + i], __ATOMIC_RELAXED) == ino) {
+    i++;
+  }
+  if (i == n) {
+    for (i = 0; i < n; i++) {
+      cache_hit(fs, start + i);
+    }
+    return 0;
+  }
+
+  pthread_mutex_lock(&c->lock);
+  uint32_t missing = 0;
+  for (i = 0; i < n; i++) {
+    missing += !bdev_present(&fs->dev, start + i);
+  }
+  int err = bdev_load(&fs->dev, start, n);
+  for (i = 0; i < n; i++) {
+    if (bdev_present(&fs->dev, start + i)) {
+      admit(fs, ino, start + i);
+    }
+  }
+  evict(fs);
+  pthread_mutex_unlock(&c->lock);
+
+  fs_slot* slot = fs_ctx_slot(fs);
+  __atomic_fetch_add(&slot->cache_misses, missing, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&slot->cache_hits, n - missing, __ATOMIC_RELAXED);
+  return err;
+}
+
+void
+cache_fill(fs_ctx* fs, vsfs_ino_t ino, vsfs_blk_t start, uint32_t n)
+{
+  fs_cache* c = &fs->cache;
+  if (!c->enabled) {
+    bdev_fill(&fs->dev, start, n);
+    return;
+  }
+  skip_pinned(c, &start, &n);
+  if (n == 0) return;
+
+  pthread_mutex_lock(&c->lock);
+  bdev_fill(&fs->dev, start, n);
+  for (uint32_t i = 0; i < n; i++) {
+    admit(fs, ino, start + i);
+  }
+  evict(fs);
+  pthread_mutex_unlock(&c->lock);
+}
+
+ssize_t
+cache_getxattr(fs_ctx* fs, const char* name, char* value, size_t size)
+{
+  fs_cache* c = &fs->cache;
+  size_t prefix = strlen(VSFS_CACHE_XATTR_PREFIX);
+  if (!c->enabled || strncmp(name, VSFS_CACHE_XATTR_PREFIX, prefix) != 0) {
+    return -ENODATA;
+  }
+  name += prefix;
+
+  uint64_t v = 0;
+  if (strcmp(name, "hits") == 0 || strcmp(name, "misses") == 0) {
+    bool hits = (name[0] == 'h');
+    for (uint32_t i = 0; i < VSFS_NSLOTS; ++i) {
+      v += __atomic_load_n(hits ? &fs->slots[i].cache_hits
+                                : &fs->slots[i].cache_misses,
+                           __ATOMIC_RELAXED);
+    }
+  } else if (strcmp(name, "evictions") == 0) {
+    pthread_mutex_lock(&c->lock);
+    v = c->evictions;
+    pthread_mutex_unlock(&c->lock);
+  } else if (strcmp(name, "resident") == 0) {
+    pthread_mutex_lock(&c->lock);
+    v = c->nresident;
+    pthread_mutex_unlock(&c->lock);
+  } else if (strcmp(name, "capacity") == 0) {
+    v = c->capacity;
+  } else {
+    return -ENODATA;
+  }
+
+  return format_xattr(v, value, size);
+}
@@ -0,0 +1,138 @@
+/**
+ * Block cache of the pread I/O engine header file.
+ *
+ * With the pread engine (see bdev.h) the view of the image is the block
+ * cache: blocks are read into it on first use and stay there. Without a
+ * limit (-o cache_size, see options.h) every block that was ever used stays
+ * present until unmount. With a limit, blocks are evicted with 2Q (see
+ * fs_cache): blocks that are used only once pass through a small FIFO
+ * without pushing out the blocks that are used again and again.
+ *
+ * Blocks before the data region (superblock, bitmaps, inode table, journal)
+ * are pinned: they are read in at mount and never evicted. They are used all
+ * the time, and nothing would protect their contents from eviction.
+ *
+ * A data block can only be dropped while nobody uses it. Every unpinned block
+ * is owned by the inode whose lock is held while using it (a file's data,
+ * indirect and extent blocks, a directory's entries), so the evictor only
+ * drops a block after taking that lock with trywrlock, and skips it if it
+ * can't. Blocks that have changed since they were last written back are not
+ * dropped either (see writeback.h); with a journal, neither are blocks that
+ * are being committed. When too many blocks can't be dropped, the
+ * write-back thread is woken up.
+ *
+ * Hits and misses are counted per thread slot (see fs_slot), and are exposed
+ * with the other counters as extended attributes of the root directory (see
+ * cache_getxattr()).
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "bdev.h"
+#include "fs_ctx.h"
+
+/** Smallest cache capacity in blocks with a limit. */
+#define VSFS_CACHE_MIN_BLOCKS 64
+
+/** Prefix of the names of the cache counter extended attributes. */
+#define VSFS_CACHE_XATTR_PREFIX "user.vsfs.cache_"
+
+/**
+ * Set up the block cache. Does nothing unless the image is not mapped (the
+ * pread engine). Called by fs_ctx_init() once the metadata has been read
+ * in.
+ *
+ * @param fs  file system context; sb, dev and cache_blocks must be set.
+ * @return    true on success; false on failure (out of memory).
+ */
+bool
+cache_init(fs_ctx* fs);
+
+/**
+ * Release the block cache. Changes that have not been written back are
+ * lost; see writeback_flush(). Called by fs_ctx_destroy().
+ *
+ * @param fs  file system context.
+ */
+void
+cache_destroy(fs_ctx* fs);
+
+/**
+ * Make the blocks of a range present, reading in the ones that are not,
+ * and record them as used by an inode. The caller must hold the lock of
+ * that inode, and keeps the blocks from being evicted for as long as it
+ * does. Pinned blocks are always present.
+ *
+ * @param fs     file system context.
+ * @param ino    inode number of the owner of the blocks.
+ * @param start  first block number.
+ * @param n      number of blocks.
+ * @return       0 on success; -errno on error (e.g. -EIO).
+ */
+int
+cache_load(fs_ctx* fs, vsfs_ino_t ino, vsfs_blk_t start, uint32_t n);
+
+/**
+ * Same as cache_load(), but without reading the blocks in, because the
+ * caller is about to overwrite all of their contents (see bdev_fill()).
+ *
+ * @param fs     file system context.
+ * @param ino    inode number of the owner of the blocks.
+ * @param start  first block number.
+ * @param n      number of blocks.
+ */
+void
+cache_fill(fs_ctx* fs, vsfs_ino_t ino, vsfs_blk_t start, uint32_t n);
+
+/**
+ * Get the value of a cache counter extended attribute of the root
+ * directory, with getxattr(2) semantics. The names are
+ * VSFS_CACHE_XATTR_PREFIX followed by hits, misses, evictions, resident
+ * (unpinned blocks present) or capacity (in blocks; 0 for no limit); the
+ * values are decimal numbers.
+ *
+ * @param fs     file system context.
+ * @param name   attribute name.
+ * @param value  buffer for the value (not null-terminated).
+ * @param size   buffer size; 0 to only get the length of the value.
+ * @return       length of the value on success; -ENODATA if there is no
+ *               such attribute or no cache; -ERANGE if size is too small.
+ */
+ssize_t
+cache_getxattr(fs_ctx* fs, const char* name, char* value, size_t size);
+
+/** Count a cache hit on an unpinned block, and mark it referenced. */
+void
+cache_hit(fs_ctx* fs, vsfs_blk_t blk);
+
+/**
+ * Get a pointer to a block used by an inode, reading it in first if it is
+ * not present; see cache_load(). A block that can't be read is left
+ * zero-filled; use cache_load() first where the error can be returned.
+ *
+ * @param fs   file system context.
+ * @param ino  inode number of the owner of the block.
+ * @param blk  block number.
+ * @return     pointer to the block.
+ */
+static inline void*
+cache_block(fs_ctx* fs, vsfs_ino_t ino, vsfs_blk_t blk)
+{
+  fs_cache* c = &fs->cache;
+  if (!c->enabled || blk < c->pinned) {
+    return bdev_block(&fs->dev, blk);
+  }
+  // A present block of ours can't be evicted while we hold the inode lock
+  if (bdev_present(&fs->dev, blk) &&
+      __atomic_load_n(&c->owner[blk], __ATOMIC_RELAXED) == ino) {
+    cache_hit(fs, blk);
+  } else {
+    cache_load(fs, ino, blk, 1);
+  }
+  return fs->image + (size_t)blk * VSFS_BLOCK_SIZE;
+}
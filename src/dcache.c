@@ -0,0 +1,183 @@
+/**
+ * Path to inode number cache ("dentry cache") implementation.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dcache.h"
+#include "dir_index.h"
+
+bool
+dcache_init(dcache* dc, uint32_t nentries)
+{
+  assert(nentries > 0);
+
+  dc->nbuckets = 1;
+  while (dc->nbuckets < nentries) {
+    dc->nbuckets *= 2;
+  }
+  dc->nentries = nentries;
+  dc->hand = 0;
+  pthread_mutex_init(&dc->lock, NULL);
+  dc->entries = calloc(nentries, sizeof(dcache_entry));
+  dc->buckets = malloc(dc->nbuckets * sizeof(int32_t));
+  if (dc->entries == NULL || dc->buckets == NULL) {
+    dcache_destroy(dc);
+    return false;
+  }
+
+  dcache_clear(dc);
+  return true;
+}
+
+void
+dcache_destroy(dcache* dc)
+{
+  free(dc->entries);
+  free(dc->buckets);
+  dc->entries = NULL;
+  dc->buckets = NULL;
+  pthread_mutex_destroy(&dc->lock);
+}
+
+void
+dcache_clear(dcache* dc)
+{
+  pthread_mutex_lock(&dc->lock);
+  for (uint32_t i = 0; i < dc->nbuckets; ++i) {
+    dc->buckets[i] = -1;
+  }
+  for (uint32_t i = 0; i < dc->nentries; ++i) {
+    dc->entries[i].path[0] = '\0';
+    dc->entries[i].next = -1;
+    dc->entries[i].ref = false;
+  }
+  dc->hand = 0;
+  pthread_mutex_unlock(&dc->lock);
+}
+
+// Find the entry for path; also returns the link that points to it
+static int32_t
+find(dcache* dc, const char* path, uint32_t hash, int32_t** link)
+{
+  int32_t* l = &dc->buckets[hash & (dc->nbuckets - 1)];
+
+  while (*l != -1) {
+    dcache_entry* e = &dc->entries[*l];
+    if (e->hash == hash && strcmp(e->path, path) == 0) {
+      break;
+    }
+    l = &e->next;
+  }
+  if (link != NULL) {
+    *link = l;
+  }
+  return *l;
+}
+
+// Unlink entry i from its hash chain and mark it unused
+static void
+evict(dcache* dc, int32_t i)
+{
+  dcache_entry* e = &dc->entries[i];
+  int32_t* link;
+
+  find(dc, e->path, e->hash, &link);
+  assert(*link == i);
+  *link = e->next;
+  e->path[0] = '\0';
+  e->next = -1;
+  e->ref = false;
+}
+
+bool
+dcache_lookup(dcache* dc, const char* path, vsfs_ino_t* ino)
+{
+  uint32_t hash = dir_index_hash(path, strlen(path));
+  bool hit = false;
+
+  pthread_mutex_lock(&dc->lock);
+  int32_t i = find(dc, path, hash, NULL);
+  if (i != -1) {
+    dc->entries[i].ref = true;
+    *ino = dc->entries[i].ino;
+    hit = true;
+  }
+  pthread_mutex_unlock(&dc->lock);
+  return hit;
+}
+
+void
+dcache_insert(dcache* dc, const char* path, vsfs_ino_t ino)
+{
+  size_t len = strlen(path);
+  if (len == 0 || len >= VSFS_PATH_MAX) {
+    return;
+  }
+
+  uint32_t hash = dir_index_hash(path, len);
+  pthread_mutex_lock(&dc->lock);
+  int32_t i = find(dc, path, hash, NULL);
+  if (i != -1) {
+    dc->entries[i].ino = ino;
+    dc->entries[i].ref = true;
+    pthread_mutex_unlock(&dc->lock);
+    return;
+  }
+
+  // CLOCK: skip (and clear) recently referenced entries
+  for (;;) {
+    dcache_entry* e = &dc->entries[dc->hand];
+    if (e->path[0] == '\0' || !e->ref) {
+      break;
+    }
+    e->ref = false;
+    dc->hand = (dc->hand + 1) % dc->nentries;
+  }
+
+  i = dc->hand;
+  dc->hand = (dc->hand + 1) % dc->nentries;
+  if (dc->entries[i].path[0] != '\0') {
+    evict(dc, i);
+  }
+
+  dcache_entry* e = &dc->entries[i];
+  int32_t* bucket = &dc->buckets[hash & (dc->nbuckets - 1)];
+  memcpy(e->path, path, len + 1);
+  e->hash = hash;
+  e->ino = ino;
+  e->ref = false;
+  e->next = *bucket;
+  *bucket = i;
+  pthread_mutex_unlock(&dc->lock);
+}
+
+void
+dcache_invalidate(dcache* dc, const char* path)
+{
+  uint32_t hash = dir_index_hash(path, strlen(path));
+  pthread_mutex_lock(&dc->lock);
+  int32_t i = find(dc, path, hash, NULL);
+  if (i != -1) {
+    evict(dc, i);
+  }
+  pthread_mutex_unlock(&dc->lock);
+}
+
+void
+dcache_invalidate_prefix(dcache* dc, const char* prefix)
+{
+  size_t len = strlen(prefix);
+
+  pthread_mutex_lock(&dc->lock);
+  for (uint32_t i = 0; i < dc->nentries; ++i) {
+    const char* path = dc->entries[i].path;
+    if (path[0] != '\0' && strncmp(path, prefix, len) == 0 &&
+        (path[len] == '\0' || path[len] == '/')) {
+      evict(dc, i);
+    }
+  }
+  pthread_mutex_unlock(&dc->lock);
+}
@@ -0,0 +1,122 @@
+/**
+ * Path to inode number cache ("dentry cache") header file.
+ *
+ * Caches the result of resolving a full path, including negative entries for
+ * paths that don't exist. The cache has a fixed number of entries; when it is
+ * full, entries are replaced using the CLOCK (second chance) algorithm.
+ *
+ * All functions are thread-safe; the cache is protected by a single mutex.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "vsfs.h"
+
+/** Inode number stored in negative entries (path doesn't exist). */
+#define DCACHE_NEGATIVE VSFS_INO_MAX
+
+/** A single cached path. */
+typedef struct dcache_entry
+{
+  /** Full path. Empty string if the entry is unused. */
+  char path[VSFS_PATH_MAX];
+  /** Hash of the path. */
+  uint32_t hash;
+  /** Inode number the path resolves to, or DCACHE_NEGATIVE. */
+  vsfs_ino_t ino;
+  /** Next entry in the same hash bucket; -1 terminates the chain. */
+  int32_t next;
+  /** CLOCK reference bit; set on every hit. */
+  bool ref;
+
+} dcache_entry;
+
+/** Dentry cache. */
+typedef struct dcache
+{
+  /** Fixed array of entries. */
+  dcache_entry* entries;
+  /** Number of entries. */
+  uint32_t nentries;
+  /** Hash buckets; each holds the index of the first entry or -1. */
+  int32_t* buckets;
+  /** Number of buckets (a power of 2). */
+  uint32_t nbuckets;
+  /** CLOCK hand: next entry considered for replacement. */
+  uint32_t hand;
+  /** Protects everything above. */
+  pthread_mutex_t lock;
+
+} dcache;
+
+/**
+ * Initialize an empty dentry cache.
+ *
+ * @param dc        pointer to the cache to initialize.
+ * @param nentries  maximum number of cached paths.
+ * @return          true on success; false if out of memory.
+ */
+bool
+dcache_init(dcache* dc, uint32_t nentries);
+
+/**
+ * Destroy a dentry cache and release its memory.
+ *
+ * @param dc  pointer to the cache to destroy.
+ */
+void
+dcache_destroy(dcache* dc);
+
+/**
+ * Look up a path in the cache.
+ *
+ * @param dc    pointer to the cache.
+ * @param path  full path.
+ * @param ino   pointer to the variable that receives the inode number, which
+ *              is DCACHE_NEGATIVE if the path is known not to exist.
+ * @return      true on a cache hit; false on a miss.
+ */
+bool
+dcache_lookup(dcache* dc, const char* path, vsfs_ino_t* ino);
+
+/**
+ * Add a path to the cache, replacing an existing entry for the same path.
+ * Paths that don't fit into an entry are silently not cached.
+ *
+ * @param dc    pointer to the cache.
+ * @param path  full path.
+ * @param ino   inode number the path resolves to, or DCACHE_NEGATIVE.
+ */
+void
+dcache_insert(dcache* dc, const char* path, vsfs_ino_t ino);
+
+/**
+ * Remove a path from the cache, if present.
+ *
+ * @param dc    pointer to the cache.
+ * @param path  full path.
+ */
+void
+dcache_invalidate(dcache* dc, const char* path);
+
+/**
+ * Remove a path and every path below it (e.g. "/a" and "/a/b", but not
+ * "/ab") from the cache.
+ *
+ * @param dc      pointer to the cache.
+ * @param prefix  full path of the top-most entry to remove.
+ */
+void
+dcache_invalidate_prefix(dcache* dc, const char* prefix);
+
+/**
+ * Remove all entries from the cache.
+ *
+ * @param dc  pointer to the cache.
+ */
+void
+dcache_clear(dcache* dc);
@@ -0,0 +1,308 @@
+/**
+ * Directory operations implementation.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "dir.h"
+#include "inode.h"
+#include "journal.h"
+
+vsfs_dentry*
+dir_get_entry(fs_ctx* fs, vsfs_inode* dir, uint32_t i)
+{
+  return inode_get_address(fs, dir, (uint64_t)i * sizeof(vsfs_dentry));
+}
+
+/**
+ * Get the hashed index of a directory, building it on first use.
+ *
+ * The caller must hold the directory lock, but a read lock is enough: the
+ * index is built off to the side under dindex_lock and published by storing
+ * its table pointer last, so concurrent readers see either no index or a
+ * complete one.
+ *
+ * @param fs       file system context.
+ * @param dir_ino  inode number of the directory.
+ * @return         pointer to the index; NULL if out of memory.
+ */
+static dir_index*
+dir_get_index(fs_ctx* fs, vsfs_ino_t dir_ino)
+{
+  dir_index* idx = &fs->dindex[dir_ino];
+  if (__atomic_load_n(&idx->table, __ATOMIC_ACQUIRE) != NULL) {
+    return idx;
+  }
+
+  pthread_mutex_lock(&fs->dindex_lock);
+  if (dir_index_built(idx)) {
+    pthread_mutex_unlock(&fs->dindex_lock);
+    return idx;
+  }
+
+  vsfs_inode* dir = &fs->itable[dir_ino];
+  uint32_t n = dir_nentries(dir);
+  dir_index tmp;
+  if (!dir_index_init(&tmp, n)) {
+    pthread_mutex_unlock(&fs->dindex_lock);
+    return NULL;
+  }
+
+  tmp.free_hint = n;
+  for (uint32_t i = 0; i < n; i++) {
+    vsfs_dentry* d = dir_get_entry(fs, dir, i);
+    if (d->ino == VSFS_INO_MAX) {
+      if (i < tmp.free_hint) tmp.free_hint = i;
+      continue;
+    }
+    if (!dir_index_insert(&tmp, dir_index_hash(d->name, strlen(d->name)), i)) {
+      dir_index_destroy(&tmp);
+      pthread_mutex_unlock(&fs->dindex_lock);
+      return NULL;
+    }
+  }
+
+  idx->capacity = tmp.capacity;
+  idx->count = tmp.count;
+  idx->free_hint = tmp.free_hint;
+  __atomic_store_n(&idx->table, tmp.table, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&fs->dindex_lock);
+  return idx;
+}
+
+int
+dir_lookup(fs_ctx* fs, vsfs_ino_t dir_ino, const char* name, size_t len,
+           vsfs_ino_t* ino, uint32_t* pos)
+{
+  dir_index* idx = dir_get_index(fs, dir_ino);
+  if (idx == NULL) return -ENOMEM;
+
+  vsfs_inode* dir = &fs->itable[dir_ino];
+  dir_index_iter it;
+  uint32_t i;
+
+  dir_index_iter_init(idx, &it, dir_index_hash(name, len));
+  while (dir_index_iter_next(idx, &it, &i)) {
+    vsfs_dentry* d = dir_get_entry(fs, dir, i);
+    if (strncmp(d->name, name, len) == 0 && d->name[len] == '\0') {
+      *ino = d->ino;
+      if (pos != NULL) *pos = i;
+      return 0;
+    }
+  }
+  return -ENOENT;
+}
+
+/**
+ * Add an entry to a directory. Reuses a free dentry if there is one,
+ * otherwise grows the directory by one block. The caller must hold the
+ * directory write lock.
+ *
+ * @param fs       file system context.
+ * @param dir_ino  inode number of the directory.
+ * @param name     entry name (doesn't need to be null-terminated).
+ * @param len      name length in bytes; less than VSFS_NAME_MAX.
+ * @param ino      inode number of the entry.
+ * @return         0 on success; -errno on error.
+ */
+static int
+dir_add_entry(fs_ctx* fs, vsfs_ino_t dir_ino, const char* name, size_t len,
+              vsfs_ino_t ino)
+{
+  dir_index* idx = dir_get_index(fs, dir_ino);
+  if (idx == NULL) return -ENOMEM;
+
+  vsfs_inode* dir = &fs->itable[dir_ino];
+  uint32_t n = dir_nentries(dir);
+  uint32_t pos = idx->free_hint;
+  while (pos < n && dir_get_entry(fs, dir, pos)->ino != VSFS_INO_MAX) pos++;
+
+  if (pos == n) {
+    // Directory is full; add another block of free dentries
+    int err = inode_add_blocks(fs, dir, 1);
+    if (err < 0) return (err == -EFBIG) ? -ENOSPC : err;
+
+    vsfs_dentry* entries = inode_get_address(fs, dir, dir->i_size);
+    for (uint32_t i = 0; i < VSFS_BLOCK_SIZE / sizeof(vsfs_dentry); i++) {
+      entries[i].ino = VSFS_INO_MAX;
+    }
+    journal_dirty_meta(fs, entries, VSFS_BLOCK_SIZE);
+    dir->i_size += VSFS_BLOCK_SIZE;
+  }
+
+  if (!dir_index_insert(idx, dir_index_hash(name, len), pos)) {
+    return -ENOMEM;
+  }
+  idx->free_hint = pos + 1;
+
+  vsfs_dentry* d = dir_get_entry(fs, dir, pos);
+  d->ino = ino;
+  memcpy(d->name, name, len);
+  d->name[len] = '\0';
+  clock_gettime(CLOCK_REALTIME, &(dir->i_mtime));
+  journal_dirty_meta(fs, d, sizeof(*d));
+  journal_dirty_meta(fs, dir, sizeof(*dir));
+  return 0;
+}
+
+/**
+ * Remove an entry from a directory. The caller must hold the directory write
+ * lock.
+ *
+ * @param fs       file system context.
+ * @param dir_ino  inode number of the directory.
+ * @param name     entry name (doesn't need to be null-terminated).
+ * @param len      name length in bytes.
+ * @return         0 on success; -errno on error.
+ */
+static int
+dir_remove_entry(fs_ctx* fs, vsfs_ino_t dir_ino, const char* name, size_t len)
+{
+  vsfs_ino_t ino;
+  uint32_t pos;
+  int err = dir_lookup(fs, dir_ino, name, len, &ino, &pos);
+  if (err < 0) return err;
+
+  vsfs_inode* dir = &fs->itable[dir_ino];
+  vsfs_dentry* d = dir_get_entry(fs, dir, pos);
+  dir_index_remove(&fs->dindex[dir_ino], dir_index_hash(name, len), pos);
+  memset(d->name, 0, len);
+  d->ino = VSFS_INO_MAX;
+  clock_gettime(CLOCK_REALTIME, &(dir->i_mtime));
+  journal_dirty_meta(fs, d, sizeof(*d));
+  journal_dirty_meta(fs, dir, sizeof(*dir));
+  return 0;
+}
+
+// Check that there is no entry with the given name in a directory
+static int
+dir_check_absent(fs_ctx* fs, vsfs_ino_t dir_ino, const char* name, size_t len)
+{
+  vsfs_ino_t ino;
+  int err = dir_lookup(fs, dir_ino, name, len, &ino, NULL);
+  if (err == 0) return -EEXIST;
+  return (err == -ENOENT) ? 0 : err;
+}
+
+int
+dir_mkdir(fs_ctx* fs, vsfs_ino_t parent, const char* name, size_t len,
+          mode_t mode, vsfs_ino_t* ino)
+{
+  int err = dir_check_absent(fs, parent, name, len);
+  if (err < 0) return err;
+
+  vsfs_ino_t new_ino;
+  err = inode_alloc(fs, mode | S_IFDIR, &new_ino);
+  if (err < 0) return err;
+
+  // A new directory has one block holding "." and "..". Nobody else can use
+  // the directory yet, but its lock keeps the block from being evicted.
+  vsfs_inode* dir = &fs->itable[new_ino];
+  pthread_rwlock_wrlock(&fs->ilocks[new_ino]);
+  err = inode_add_blocks(fs, dir, 1);
+  if (err < 0) {
+    inode_free(fs, new_ino);
+    pthread_rwlock_unlock(&fs->ilocks[new_ino]);
+    return err;
+  }
+
+  vsfs_dentry* entries = inode_get_address(fs, dir, 0);
+  for (uint32_t i = 0; i < VSFS_BLOCK_SIZE / sizeof(vsfs_dentry); i++) {
+    entries[i].ino = VSFS_INO_MAX;
+  }
+  entries[0].ino = new_ino;
+  strcpy(entries[0].name, ".");
+  entries[1].ino = parent;
+  strcpy(entries[1].name, "..");
+  dir->i_size = VSFS_BLOCK_SIZE;
+  dir->i_nlink = 2;
+  journal_dirty_meta(fs, entries, VSFS_BLOCK_SIZE);
+  journal_dirty_meta(fs, dir, sizeof(*dir));
+
+  err = dir_add_entry(fs, parent, name, len, new_ino);
+  if (err < 0) {
+    inode_free(fs, new_ino);
+    pthread_rwlock_unlock(&fs->ilocks[new_ino]);
+    return err;
+  }
+  pthread_rwlock_unlock(&fs->ilocks[new_ino]);
+  fs->itable[parent].i_nlink++;
+  journal_dirty_meta(fs, &fs->itable[parent], sizeof(vsfs_inode));
+  *ino = new_ino;
+  return 0;
+}
+
+int
+dir_create(fs_ctx* fs, vsfs_ino_t parent, const char* name, size_t len,
+           mode_t mode, vsfs_ino_t* ino)
+{
+  int err = dir_check_absent(fs, parent, name, len);
+  if (err < 0) return err;
+
+  // Find available inode
+  vsfs_ino_t new_ino;
+  err = inode_alloc(fs, mode, &new_ino);
+  if (err < 0) return err;
+
+  // Add inode to parent dentry
+  err = dir_add_entry(fs, parent, name, len, new_ino);
+  if (err < 0) {
+    inode_free(fs, new_ino);
+    return err;
+  }
+  *ino = new_ino;
+  return 0;
+}
+
+int
+dir_unlink(fs_ctx* fs, vsfs_ino_t parent, const char* name, size_t len)
+{
+  // Get file inode from its parent directory
+  vsfs_ino_t ino;
+  int err = dir_lookup(fs, parent, name, len, &ino, NULL);
+  if (err < 0) return err;
+  if (S_ISDIR(fs->itable[ino].i_mode)) return -EISDIR;
+
+  // Find the dir entry, set its ino to max and name to nothing
+  err = dir_remove_entry(fs, parent, name, len);
+  if (err < 0) return err;
+
+  // Free the inode and its blocks once the last link is gone
+  pthread_rwlock_wrlock(&fs->ilocks[ino]);
+  fs->itable[ino].i_nlink--;
+  journal_dirty_meta(fs, &fs->itable[ino], sizeof(vsfs_inode));
+  inode_release(fs, ino);
+  pthread_rwlock_unlock(&fs->ilocks[ino]);
+  return 0;
+}
+
+int
+dir_rmdir(fs_ctx* fs, vsfs_ino_t parent, const char* name, size_t len)
+{
+  vsfs_ino_t ino;
+  int err = dir_lookup(fs, parent, name, len, &ino, NULL);
+  if (err < 0) return err;
+  if (!S_ISDIR(fs->itable[ino].i_mode)) return -ENOTDIR;
+
+  pthread_rwlock_wrlock(&fs->ilocks[ino]);
+  // Only "." and ".." may be left
+  dir_index* idx = dir_get_index(fs, ino);
+  if (idx == NULL) {
+    err = -ENOMEM;
+  } else if (idx->count > 2) {
+    err = -ENOTEMPTY;
+  } else {
+    err = dir_remove_entry(fs, parent, name, len);
+  }
+  if (err == 0) {
+    fs->itable[parent].i_nlink--;
+    fs->itable[ino].i_nlink = 0;
+    journal_dirty_meta(fs, &fs->itable[parent], sizeof(vsfs_inode));
+    journal_dirty_meta(fs, &fs->itable[ino], sizeof(vsfs_inode));
+    inode_release(fs, ino);
+  }
+  pthread_rwlock_unlock(&fs->ilocks[ino]);
+  return err;
+}
@@ -0,0 +1,115 @@
+/**
+ * Directory operations header file.
+ *
+ * Directories are arrays of fixed size vsfs_dentry slots; a free slot has
+ * ino == VSFS_INO_MAX. Lookups go through the hashed directory index (see
+ * dir_index.h), which is built on the first lookup in a directory.
+ *
+ * These functions are shared by the path-based and the inode-based FUSE
+ * backends. The caller must hold the lock of the directory that is searched
+ * or changed (see fs_ctx.h): a read lock for dir_lookup(), a write lock for
+ * everything that adds or removes entries. Locks of the inodes being
+ * removed are taken internally.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "fs_ctx.h"
+#include "vsfs.h"
+
+/** Number of dentry slots (used or free) in a directory. */
+static inline uint32_t
+dir_nentries(const vsfs_inode* dir)
+{
+  return dir->i_size / sizeof(vsfs_dentry);
+}
+
+/**
+ * Get a dentry slot of a directory.
+ *
+ * @param fs   file system context.
+ * @param dir  pointer to the inode of the directory.
+ * @param i    slot number; less than dir_nentries(dir).
+ * @return     pointer to the dentry in the mapped image.
+ */
+vsfs_dentry*
+dir_get_entry(fs_ctx* fs, vsfs_inode* dir, uint32_t i);
+
+/**
+ * Find an entry in a directory by name.
+ *
+ * @param fs       file system context.
+ * @param dir_ino  inode number of the directory to search.
+ * @param name     entry name (doesn't need to be null-terminated).
+ * @param len      name length in bytes.
+ * @param ino      pointer to the variable that receives the inode number.
+ * @param pos      pointer to the variable that receives the dentry position;
+ *                 can be NULL.
+ * @return         0 on success; -ENOENT if not found; -ENOMEM if the
+ *                 directory index could not be built.
+ */
+int
+dir_lookup(fs_ctx* fs, vsfs_ino_t dir_ino, const char* name, size_t len,
+           vsfs_ino_t* ino, uint32_t* pos);
+
+/**
+ * Create a directory with "." and ".." entries and add it to parent.
+ *
+ * @param fs      file system context.
+ * @param parent  inode number of the parent directory.
+ * @param name    entry name (doesn't need to be null-terminated).
+ * @param len     name length in bytes; less than VSFS_NAME_MAX.
+ * @param mode    file mode bits.
+ * @param ino     pointer to the variable that receives the new inode number.
+ * @return        0 on success; -EEXIST if the name is taken; -ENOSPC if out
+ *                of free inodes or blocks; -ENOMEM if out of memory.
+ */
+int
+dir_mkdir(fs_ctx* fs, vsfs_ino_t parent, const char* name, size_t len,
+          mode_t mode, vsfs_ino_t* ino);
+
+/**
+ * Create an empty regular file and add it to parent.
+ *
+ * @param fs      file system context.
+ * @param parent  inode number of the parent directory.
+ * @param name    entry name (doesn't need to be null-terminated).
+ * @param len     name length in bytes; less than VSFS_NAME_MAX.
+ * @param mode    file mode, including the file type.
+ * @param ino     pointer to the variable that receives the new inode number.
+ * @return        0 on success; -errno on error (see dir_mkdir()).
+ */
+int
+dir_create(fs_ctx* fs, vsfs_ino_t parent, const char* name, size_t len,
+           mode_t mode, vsfs_ino_t* ino);
+
+/**
+ * Remove a file from parent. The inode is released (see inode_release())
+ * once its last link is gone.
+ *
+ * @param fs      file system context.
+ * @param parent  inode number of the parent directory.
+ * @param name    entry name (doesn't need to be null-terminated).
+ * @param len     name length in bytes.
+ * @return        0 on success; -ENOENT if not found; -EISDIR if the entry
+ *                is a directory; -ENOMEM if out of memory.
+ */
+int
+dir_unlink(fs_ctx* fs, vsfs_ino_t parent, const char* name, size_t len);
+
+/**
+ * Remove an empty directory from parent and release its inode.
+ *
+ * @param fs      file system context.
+ * @param parent  inode number of the parent directory.
+ * @param name    entry name (doesn't need to be null-terminated).
+ * @param len     name length in bytes.
+ * @return        0 on success; -ENOENT if not found; -ENOTDIR if the entry
+ *                is not a directory; -ENOTEMPTY if it is not empty; -ENOMEM
+ *                if out of memory.
+ */
+int
+dir_rmdir(fs_ctx* fs, vsfs_ino_t parent, const char* name, size_t len);
@@ -0,0 +1,161 @@
+/**
+ * In-memory hashed directory index implementation.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include "dir_index.h"
+
+/** Smallest table that is ever allocated. */
+static const uint32_t min_capacity = 16;
+
+// FNV-1a; good enough for file names and cheap to compute.
+uint32_t
+dir_index_hash(const char* name, size_t len)
+{
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; ++i) {
+    h ^= (unsigned char)name[i];
+    h *= 16777619u;
+  }
+  // 0 is reserved for empty slots
+  return (h != 0) ? h : 1;
+}
+
+// Table size that keeps the load factor of nentries at or below 1/2
+static uint32_t
+capacity_for(uint32_t nentries)
+{
+  uint32_t cap = min_capacity;
+  while (cap / 2 < nentries) {
+    cap *= 2;
+  }
+  return cap;
+}
+
+// Insert into a table that is known to have a free slot
+static void
+table_put(dir_index_entry* table, uint32_t capacity, uint32_t hash, uint32_t pos)
+{
+  uint32_t mask = capacity - 1;
+  uint32_t slot = hash & mask;
+
+  while (table[slot].hash != 0) {
+    slot = (slot + 1) & mask;
+  }
+  table[slot].hash = hash;
+  table[slot].pos = pos;
+}
+
+bool
+dir_index_init(dir_index* idx, uint32_t nentries)
+{
+  idx->capacity = capacity_for(nentries);
+  idx->table = calloc(idx->capacity, sizeof(dir_index_entry));
+  idx->count = 0;
+  idx->free_hint = 0;
+  return idx->table != NULL;
+}
+
+void
+dir_index_destroy(dir_index* idx)
+{
+  free(idx->table);
+  idx->table = NULL;
+  idx->capacity = 0;
+  idx->count = 0;
+  idx->free_hint = 0;
+}
+
+// Double the table size and rehash all entries
+static bool
+grow(dir_index* idx)
+{
+  uint32_t capacity = idx->capacity * 2;
+  dir_index_entry* table = calloc(capacity, sizeof(dir_index_entry));
+  if (table == NULL) {
+    return false;
+  }
+
+  for (uint32_t i = 0; i < idx->capacity; ++i) {
+    if (idx->table[i].hash != 0) {
+      table_put(table, capacity, idx->table[i].hash, idx->table[i].pos);
+    }
+  }
+  free(idx->table);
+  idx->table = table;
+  idx->capacity = capacity;
+  return true;
+}
+
+bool
+dir_index_insert(dir_index* idx, uint32_t hash, uint32_t pos)
+{
+  assert(dir_index_built(idx));
+  assert(hash != 0);
+
+  // Keep the load factor at or below 3/4 so that probe sequences stay short
+  if ((idx->count + 1) * 4 > idx->capacity * 3 && !grow(idx)) {
+    return false;
+  }
+  table_put(idx->table, idx->capacity, hash, pos);
+  idx->count++;
+  return true;
+}
+
+void
+dir_index_remove(dir_index* idx, uint32_t hash, uint32_t pos)
+{
+  assert(dir_index_built(idx));
+  uint32_t mask = idx->capacity - 1;
+  uint32_t slot = hash & mask;
+
+  while (idx->table[slot].hash != hash || idx->table[slot].pos != pos) {
+    assert(idx->table[slot].hash != 0); // Don't remove something not present.
+    slot = (slot + 1) & mask;
+  }
+
+  // Backward shift deletion: move any entry of the following probe run that
+  // would no longer be reachable into the hole, so no tombstones are needed.
+  uint32_t hole = slot;
+  for (uint32_t next = (hole + 1) & mask; idx->table[next].hash != 0;
+       next = (next + 1) & mask) {
+    uint32_t home = idx->table[next].hash & mask;
+    // Entry can fill the hole only if its home slot is not in (hole, next]
+    if (((next - home) & mask) >= ((next - hole) & mask)) {
+      idx->table[hole] = idx->table[next];
+      hole = next;
+    }
+  }
+  idx->table[hole].hash = 0;
+  idx->count--;
+
+  if (pos < idx->free_hint) {
+    idx->free_hint = pos;
+  }
+}
+
+void
+dir_index_iter_init(const dir_index* idx, dir_index_iter* it, uint32_t hash)
+{
+  assert(dir_index_built(idx));
+  it->hash = hash;
+  it->slot = hash & (idx->capacity - 1);
+}
+
+bool
+dir_index_iter_next(const dir_index* idx, dir_index_iter* it, uint32_t* pos)
+{
+  uint32_t mask = idx->capacity - 1;
+
+  while (idx->table[it->slot].hash != 0) {
+    const dir_index_entry* e = &idx->table[it->slot];
+    it->slot = (it->slot + 1) & mask;
+    if (e->hash == it->hash) {
+      *pos = e->pos;
+      return true;
+    }
+  }
+  return false;
+}
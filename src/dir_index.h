@@ -0,0 +1,125 @@
+/**
+ * In-memory hashed directory index header file.
+ *
+ * A directory index maps the hash of an entry name to the position of the
+ * vsfs_dentry that holds it, so that a name can be found in a directory
+ * without scanning all of its entries. The index does not store the names
+ * themselves: the caller compares the candidate dentries returned for a hash
+ * against the name it is looking for.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** A single slot of the index hash table. */
+typedef struct dir_index_entry
+{
+  /** Name hash; 0 marks an empty slot. */
+  uint32_t hash;
+  /** Position (dentry number) of the entry in the directory. */
+  uint32_t pos;
+
+} dir_index_entry;
+
+/** Hashed index of a single directory. */
+typedef struct dir_index
+{
+  /** Open addressing hash table; NULL if the index has not been built. */
+  dir_index_entry* table;
+  /** Number of slots in the table (a power of 2). */
+  uint32_t capacity;
+  /** Number of used slots in the table. */
+  uint32_t count;
+  /** No dentry before this position is free. */
+  uint32_t free_hint;
+
+} dir_index;
+
+/** Iterator over the index entries that match a name hash. */
+typedef struct dir_index_iter
+{
+  uint32_t hash;
+  uint32_t slot;
+
+} dir_index_iter;
+
+/**
+ * Compute the hash of a name. Never returns 0.
+ *
+ * @param name  name (doesn't need to be null-terminated).
+ * @param len   name length in bytes.
+ * @return      name hash.
+ */
+uint32_t
+dir_index_hash(const char* name, size_t len);
+
+/**
+ * Initialize an empty index sized for the given number of entries.
+ *
+ * @param idx       pointer to the index to initialize.
+ * @param nentries  expected number of entries.
+ * @return          true on success; false if out of memory.
+ */
+bool
+dir_index_init(dir_index* idx, uint32_t nentries);
+
+/**
+ * Destroy an index and release its memory. Safe to call on an index that has
+ * not been built.
+ *
+ * @param idx  pointer to the index to destroy.
+ */
+void
+dir_index_destroy(dir_index* idx);
+
+/** Check if the index has been built. */
+static inline bool
+dir_index_built(const dir_index* idx)
+{
+  return idx->table != NULL;
+}
+
+/**
+ * Add an entry to the index. Grows the table as needed.
+ *
+ * @param idx   pointer to the index.
+ * @param hash  name hash of the entry.
+ * @param pos   position of the entry in the directory.
+ * @return      true on success; false if out of memory.
+ */
+bool
+dir_index_insert(dir_index* idx, uint32_t hash, uint32_t pos);
+
+/**
+ * Remove an entry from the index. The entry must be present.
+ *
+ * @param idx   pointer to the index.
+ * @param hash  name hash of the entry.
+ * @param pos   position of the entry in the directory.
+ */
+void
+dir_index_remove(dir_index* idx, uint32_t hash, uint32_t pos);
+
+/**
+ * Start iterating over the entries that match a name hash.
+ *
+ * @param idx   pointer to the index.
+ * @param it    pointer to the iterator to initialize.
+ * @param hash  name hash to look for.
+ */
+void
+dir_index_iter_init(const dir_index* idx, dir_index_iter* it, uint32_t hash);
+
+/**
+ * Get the next entry that matches the iterator's hash.
+ *
+ * @param idx  pointer to the index.
+ * @param it   pointer to the iterator.
+ * @param pos  pointer to the variable that receives the dentry position.
+ * @return     true if an entry was found; false when there are no more.
+ */
+bool
+dir_index_iter_next(const dir_index* idx, dir_index_iter* it, uint32_t* pos);
@@ -0,0 +1,114 @@
+/**
+ * Write-back of the image to disk implementation.
+ */
+
+#include <errno.h>
+#include <time.h>
+
+#include "flush.h"
+#include "journal.h"
+#include "writeback.h"
+
+// Write back the whole image, including the free counters; with a journal,
+// commit everything instead
+static int
+flush_all(fs_ctx* fs)
+{
+  if (fs->journal.enabled) {
+    return journal_commit(fs, true);
+  }
+  fs_ctx_fold_counters(fs);
+  writeback_dirty(fs, fs->sb, sizeof(*fs->sb));
+  return writeback_flush(fs, 0, fs->dev.nblocks, true);
+}
+
+// Background thread: write back the image every sync_interval ms until
+// flush_stop() clears flush_running
+static void*
+flush_main(void* arg)
+{
+  fs_ctx* fs = (fs_ctx*)arg;
+
+  pthread_mutex_lock(&fs->flush_lock);
+  while (fs->flush_running) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += fs->sync_interval / 1000;
+    deadline.tv_nsec += (long)(fs->sync_interval % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+
+    int err = 0;
+    while (fs->flush_running && err != ETIMEDOUT) {
+      err = pthread_cond_timedwait(&fs->flush_cond, &fs->flush_lock,
+                                   &deadline);
+    }
+    if (!fs->flush_running) break;
+
+    pthread_mutex_unlock(&fs->flush_lock);
+    flush_all(fs);
+    pthread_mutex_lock(&fs->flush_lock);
+  }
+  pthread_mutex_unlock(&fs->flush_lock);
+  return NULL;
+}
+
+bool
+flush_start(fs_ctx* fs)
+{
+  // With a journal, the commit thread also does the periodic write-back
+  if (fs->journal.enabled) {
+    return journal_start(fs);
+  }
+  // Dirty blocks are also written back in the background
+  if (!writeback_start(fs)) {
+    return false;
+  }
+  if (fs->durability != VSFS_DURABILITY_PERIODIC) {
+    return true;
+  }
+
+  fs->flush_running = true;
+  if (pthread_create(&fs->flush_thread, NULL, flush_main, fs) != 0) {
+    fs->flush_running = false;
+    return false;
+  }
+  return true;
+}
+
+void
+flush_stop(fs_ctx* fs)
+{
+  journal_stop(fs);
+  writeback_stop(fs);
+  pthread_mutex_lock(&fs->flush_lock);
+  bool running = fs->flush_running;
+  fs->flush_running = false;
+  pthread_cond_signal(&fs->flush_cond);
+  pthread_mutex_unlock(&fs->flush_lock);
+  if (running) {
+    pthread_join(fs->flush_thread, NULL);
+  }
+
+  // Without a mapping of the file, nothing else writes the image back
+  if (fs->durability != VSFS_DURABILITY_ASYNC || fs->dev.cached) {
+    flush_all(fs);
+  }
+}
+
+int
+flush_blocks(fs_ctx* fs, vsfs_blk_t start, uint32_t n)
+{
+  if (!fs->writeback.enabled) {
+    return bdev_flush(&fs->dev, start, n);
+  }
+  // Syncing the whole file with the mmap engine would also wait for the
+  // dirty pages of every other file; only wait for the range
+  if (!fs->dev.cached) {
+    int err = writeback_flush(fs, start, n, false);
+    return (err < 0) ? err : bdev_flush(&fs->dev, start, n);
+  }
+  return writeback_flush(fs, start, n, true);
+}
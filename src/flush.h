@@ -0,0 +1,57 @@
+/**
+ * Write-back of the image to disk header file.
+ *
+ * Changed blocks are tracked and written back in the background (see
+ * writeback.h); with the mmap I/O engine (see bdev.h) the image is mapped
+ * MAP_SHARED, so the kernel may also write back dirty pages on its own.
+ * With the pread engine changes only reach the disk when they are written
+ * back, at the latest on unmount. The durability mode (-o durability, see
+ * options.h) adds explicit write-back on top of that: either of the whole
+ * image every sync_interval milliseconds from a background thread, or of
+ * the blocks of a single file on fsync() (see inode_sync()).
+ *
+ * With a journal the image is mapped MAP_PRIVATE instead, and the same
+ * points commit the journal; the journal's commit thread takes the place of
+ * the write-back thread. See journal.h.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "fs_ctx.h"
+#include "vsfs.h"
+
+/**
+ * Start the background write-back thread if the durability mode is
+ * periodic, or the journal commit thread if the image has a journal. Also
+ * starts the dirty block write-back thread without a journal. Must be
+ * called after FUSE has daemonized, since threads don't survive fork().
+ *
+ * @param fs  file system context.
+ * @return    true on success; false if the thread could not be started.
+ */
+bool
+flush_start(fs_ctx* fs);
+
+/**
+ * Stop the background write-back, dirty block write-back or commit thread,
+ * if running, and unless the durability mode is async with the mmap
+ * engine, write back the whole image.
+ *
+ * @param fs  file system context.
+ */
+void
+flush_stop(fs_ctx* fs);
+
+/**
+ * Write back a range of blocks of the image and wait for it to complete.
+ *
+ * @param fs     file system context.
+ * @param start  first block number.
+ * @param n      number of blocks.
+ * @return       0 on success; -errno on error (see bdev_flush()).
+ */
+int
+flush_blocks(fs_ctx* fs, vsfs_blk_t start, uint32_t n);
@@ -2,7 +2,20 @@
  * File system runtime context implementation.
  */
 
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
 #include "fs_ctx.h"
+#include "journal.h"
+#include "readahead.h"
+#include "writeback.h"
+
+/** Number of paths kept in the dentry cache. */
+#define VSFS_DCACHE_SIZE 1024
+
+/** Number of files whose block maps are cached. */
+#define VSFS_BMAP_CACHE_SIZE 64
 
 /**
  * Initialize file system context.
@@ -32,7 +45,17 @@ fs_ctx_init(fs_ctx* fs, void* image, size_t size)
    *  You may want to add more sanity checking to make sure the disk
    *  image appears to be a valid VSFS file system.
    */
-  if (fs->sb->magic != VSFS_MAGIC) {
+  if (bdev_load(&fs->dev, VSFS_SB_BLKNUM, 1) < 0 ||
+      fs->sb->magic != VSFS_MAGIC) {
+    return false;
+  }
+
+  /** Everything up to the data region (bitmaps, inode table, journal) is
+   *  used all the time, so it is read in once here rather than on demand.
+   */
+  if (fs->sb->num_blocks > size / VSFS_BLOCK_SIZE ||
+      fs->sb->data_region > fs->sb->num_blocks ||
+      bdev_load(&fs->dev, 0, fs->sb->data_region) < 0) {
     return false;
   }
 
@@ -53,8 +76,92 @@ fs_ctx_init(fs_ctx* fs, void* image, size_t size)
    */
   fs->itable = (vsfs_inode*)(image + VSFS_ITBL_BLKNUM * VSFS_BLOCK_SIZE);
 
+  /** Committed metadata updates that may not have reached their home
+   *  locations are replayed before anything else looks at the metadata.
+   */
+  if (!journal_init(fs)) {
+    return false;
+  }
+
+  /** With the pread engine, the rest of the image is read in on demand into
+   *  a block cache that may be limited in size.
+   */
+  if (!cache_init(fs)) {
+    return false;
+  }
+
+  /** Without a journal, vsfs tracks changed blocks itself and writes them
+   *  back in the background.
+   */
+  if (!writeback_init(fs)) {
+    return false;
+  }
+
+  /** Sequential reads are detected per open file; see readahead.h. */
+  readahead_init(fs);
+
   // TODO: Initialize anything else that you add to the fs context.
 
+  /** Allocation cursors. Each slot starts at a different word of the
+   *  bitmaps, so that threads allocating at the same time don't fight over
+   *  the same bits. Nothing before the data region can be free, so data
+   *  block allocation starts there; slot 0 (the only one used by a
+   *  single-threaded mount) starts at the very beginning.
+   */
+  vsfs_blk_t ndata = fs->sb->num_blocks - fs->sb->data_region;
+  for (uint32_t i = 0; i < VSFS_NSLOTS; ++i) {
+    uint32_t ino = (uint64_t)fs->sb->num_inodes * i / VSFS_NSLOTS;
+    uint32_t blk = fs->sb->data_region + (uint64_t)ndata * i / VSFS_NSLOTS;
+    fs->slots[i].ibmap_hint = ino & ~(uint32_t)63;
+    fs->slots[i].dbmap_hint = blk & ~(uint32_t)63;
+    if (fs->slots[i].dbmap_hint < fs->sb->data_region) {
+      fs->slots[i].dbmap_hint = fs->sb->data_region;
+    }
+  }
+
+  /** Directory indexes are built lazily on the first lookup in a directory,
+   *  so only the (empty) per-inode slots are allocated here.
+   */
+  fs->dindex = calloc(fs->sb->num_inodes, sizeof(dir_index));
+  if (fs->dindex == NULL) {
+    return false;
+  }
+
+  if (!dcache_init(&fs->dcache, VSFS_DCACHE_SIZE)) {
+    return false;
+  }
+
+  fs->ilocks = malloc(fs->sb->num_inodes * sizeof(pthread_rwlock_t));
+  if (fs->ilocks == NULL) {
+    return false;
+  }
+  for (uint32_t i = 0; i < fs->sb->num_inodes; ++i) {
+    pthread_rwlock_init(&fs->ilocks[i], NULL);
+  }
+  pthread_spin_init(&fs->sb_lock, PTHREAD_PROCESS_PRIVATE);
+  pthread_mutex_init(&fs->dindex_lock, NULL);
+  pthread_mutex_init(&fs->flush_lock, NULL);
+  pthread_cond_init(&fs->flush_cond, NULL);
+
+  fs->nopen = calloc(fs->sb->num_inodes, sizeof(uint32_t));
+  if (fs->nopen == NULL) {
+    return false;
+  }
+
+  bmap_cache* bc = &fs->bmap;
+  bc->maps = calloc(fs->sb->num_inodes, sizeof(vsfs_blk_t*));
+  bc->ref = calloc(fs->sb->num_inodes, sizeof(uint8_t));
+  bc->ring_size = VSFS_BMAP_CACHE_SIZE;
+  bc->ring = malloc(bc->ring_size * sizeof(vsfs_ino_t));
+  bc->hand = 0;
+  pthread_mutex_init(&bc->lock, NULL);
+  if (bc->maps == NULL || bc->ref == NULL || bc->ring == NULL) {
+    return false;
+  }
+  for (uint32_t i = 0; i < bc->ring_size; ++i) {
+    bc->ring[i] = VSFS_INO_MAX;
+  }
+
   return true;
 }
 
@@ -68,5 +175,93 @@ void
 fs_ctx_destroy(fs_ctx* fs)
 {
   // TODO: cleanup any other resources allocated in fs_ctx_init()
-  (void)fs;
+  journal_destroy(fs);
+  writeback_destroy(fs);
+  readahead_destroy(fs);
+  cache_destroy(fs);
+  if (fs->ilocks != NULL) {
+    fs_ctx_fold_counters(fs);
+  }
+  if (fs->dindex != NULL) {
+    for (uint32_t i = 0; i < fs->sb->num_inodes; ++i) {
+      dir_index_destroy(&fs->dindex[i]);
+    }
+    free(fs->dindex);
+    fs->dindex = NULL;
+  }
+  dcache_destroy(&fs->dcache);
+  free(fs->nlookup);
+  fs->nlookup = NULL;
+  free(fs->nopen);
+  fs->nopen = NULL;
+  if (fs->bmap.maps != NULL) {
+    for (uint32_t i = 0; i < fs->sb->num_inodes; ++i) {
+      free(fs->bmap.maps[i]);
+    }
+    free(fs->bmap.maps);
+    free(fs->bmap.ref);
+    free(fs->bmap.ring);
+    fs->bmap.maps = NULL;
+    pthread_mutex_destroy(&fs->bmap.lock);
+  }
+
+  if (fs->ilocks != NULL) {
+    for (uint32_t i = 0; i < fs->sb->num_inodes; ++i) {
+      pthread_rwlock_destroy(&fs->ilocks[i]);
+    }
+    free(fs->ilocks);
+    fs->ilocks = NULL;
+    pthread_spin_destroy(&fs->sb_lock);
+    pthread_mutex_destroy(&fs->dindex_lock);
+    pthread_mutex_destroy(&fs->flush_lock);
+    pthread_cond_destroy(&fs->flush_cond);
+  }
+}
+
+fs_slot*
+fs_ctx_slot(fs_ctx* fs)
+{
+  static uint32_t next_slot = 0;
+  static __thread uint32_t slot = UINT32_MAX;
+
+  if (slot == UINT32_MAX) {
+    slot = __atomic_fetch_add(&next_slot, 1, __ATOMIC_RELAXED) % VSFS_NSLOTS;
+  }
+  return &fs->slots[slot];
+}
+
+void
+fs_ctx_fold_counters(fs_ctx* fs)
+{
+  pthread_spin_lock(&fs->sb_lock);
+  for (uint32_t i = 0; i < VSFS_NSLOTS; ++i) {
+    fs_slot* slot = &fs->slots[i];
+    fs->sb->free_inodes +=
+      __atomic_exchange_n(&slot->free_inodes, 0, __ATOMIC_RELAXED);
+    fs->sb->free_blocks +=
+      __atomic_exchange_n(&slot->free_blocks, 0, __ATOMIC_RELAXED);
+  }
+  pthread_spin_unlock(&fs->sb_lock);
+}
+
+void
+fs_ctx_statfs(fs_ctx* fs, struct statvfs* st)
+{
+  vsfs_superblock* sb = fs->sb;
+
+  memset(st, 0, sizeof(*st));
+  st->f_bsize = VSFS_BLOCK_SIZE;  /* Filesystem block size */
+  st->f_frsize = VSFS_BLOCK_SIZE; /* Fragment size */
+  st->f_blocks = sb->num_blocks;  /* Size of fs in f_frsize units */
+  st->f_files = sb->num_inodes;   /* Number of inodes */
+
+  fs_ctx_fold_counters(fs);
+  pthread_spin_lock(&fs->sb_lock);
+  st->f_bfree = sb->free_blocks;  /* Number of free blocks */
+  st->f_bavail = sb->free_blocks; /* Free blocks for unpriv users */
+  st->f_ffree = sb->free_inodes;  /* Number of free inodes */
+  st->f_favail = sb->free_inodes; /* Free inodes for unpriv users */
+  pthread_spin_unlock(&fs->sb_lock);
+
+  st->f_namemax = VSFS_NAME_MAX; /* Maximum filename length */
 }
@@ -5,22 +5,343 @@
 #pragma once
 
 //#include <stdlib.h>
+#include <pthread.h>
 #include <stddef.h>
+#include <sys/statvfs.h>
 //#include <unistd.h>
 //#include <sys/types.h>
+#include "bdev.h"
 #include "bitmap.h"
+#include "dcache.h"
+#include "dir_index.h"
 #include "options.h"
 #include "vsfs.h"
 
+/**
+ * Number of per-thread allocation slots. Threads are assigned slots round
+ * robin, so with more threads than slots some of them share one.
+ */
+#define VSFS_NSLOTS 64
+
+/**
+ * Per-thread allocator state. Each slot is on its own cache line so that
+ * threads allocating in parallel don't write to the same line.
+ */
+typedef struct fs_slot
+{
+  /** Next-fit allocation cursor in the inode bitmap. */
+  uint32_t ibmap_hint;
+  /** Next-fit allocation cursor in the data block bitmap. */
+  uint32_t dbmap_hint;
+  /**
+   * Changes to the superblock free counters made by the threads using this
+   * slot that have not been folded into the superblock yet; see
+   * fs_ctx_fold_counters(). Updated with relaxed atomics since a slot may
+   * be shared.
+   */
+  int32_t free_inodes;
+  int32_t free_blocks;
+  /** Block cache hits and misses of the threads using this slot. */
+  uint64_t cache_hits;
+  uint64_t cache_misses;
+
+} __attribute__((aligned(64))) fs_slot;
+
+/**
+ * Flat logical to physical block maps of recently used files, so that
+ * mapping a block past the direct pointers (or in a file with many extents)
+ * is a single array lookup. See inode_bmap().
+ *
+ * maps[ino] is read under the inode lock and only changed under the inode
+ * write lock, except that a missing map is published by a reader with an
+ * atomic store. At most ring_size maps are cached; they are replaced using
+ * the CLOCK algorithm, which only evicts a map whose inode write lock can be
+ * taken without waiting.
+ */
+typedef struct bmap_cache
+{
+  /** Block map of each inode number; NULL if not cached. */
+  vsfs_blk_t** maps;
+  /** CLOCK reference bit of each inode number; set on every hit. */
+  uint8_t* ref;
+  /** Inode numbers of the cached maps; VSFS_INO_MAX marks a free slot. */
+  vsfs_ino_t* ring;
+  /** Number of slots in the ring. */
+  uint32_t ring_size;
+  /** CLOCK hand: next slot considered for replacement. */
+  uint32_t hand;
+  /** Serializes adding maps (the ring and the hand). */
+  pthread_mutex_t lock;
+
+} bmap_cache;
+
+/**
+ * Metadata journal state; see journal.h. Only used if the image has a
+ * journal (enabled); all other fields are unset otherwise.
+ *
+ * dirty_meta and dirty_data have one bit per block of the image, set with
+ * atomics by the operations that change the block, and cleared when a
+ * commit takes its snapshot. ndirty_* count the set bits approximately.
+ */
+typedef struct fs_journal
+{
+  /** Whether the image has a journal. */
+  bool enabled;
+  /** First block and size in blocks of the journal (from the superblock). */
+  vsfs_blk_t start;
+  uint32_t len;
+  /** Next free journal block, relative to start. */
+  uint32_t head;
+  /** Most metadata blocks in a transaction that still fits in the journal. */
+  uint32_t capacity;
+  /**
+   * Metadata blocks reserved by the operations in progress, changed with
+   * atomics; see journal_begin().
+   */
+  uint32_t reserved;
+  /** Sequence number of the next transaction. */
+  uint64_t seq;
+  /** Whether blocks have been written in place since the last fdatasync. */
+  bool unsynced;
+  /** Metadata blocks changed since the last commit; logged on commit. */
+  bitmap_t* dirty_meta;
+  /** File data blocks changed since the last commit; written in place. */
+  bitmap_t* dirty_data;
+  uint32_t ndirty_meta;
+  uint32_t ndirty_data;
+  /**
+   * Blocks with a copy in the journal since it was last emptied, one bit
+   * per block. Replay would write the copy over such a block, so it is only
+   * written in place as file data once the journal has been emptied.
+   * Protected by commit_lock.
+   */
+  bitmap_t* logged;
+  /**
+   * Block-aligned buffer for the journal header, which journal_reset()
+   * writes with O_DIRECT under the pread and io_uring engines. Protected by
+   * commit_lock.
+   */
+  vsfs_journal_block* hdr;
+  /**
+   * Held shared by every operation that changes the image, and exclusively
+   * by a commit while it takes its snapshot, so that the snapshot only has
+   * whole operations in it. Taken before any inode lock.
+   */
+  pthread_rwlock_t op_lock;
+  /** Serializes commits. */
+  pthread_mutex_t commit_lock;
+
+  /**
+   * Group commit (see journal_start()). The fields below are protected by
+   * lock, except kicked, which is also set with atomics.
+   */
+  /** Background commit thread; only valid while running. */
+  pthread_t thread;
+  /** Whether the commit thread is (still supposed to be) running. */
+  bool running;
+  /** Commit period of the thread in milliseconds. */
+  unsigned int interval;
+  /** Number of dirty metadata blocks that wakes up the thread early. */
+  uint32_t threshold;
+  /** The thread has been woken up to commit before its period is over. */
+  bool kicked;
+  /** A commit that waits for the disk has been asked for (fsync()). */
+  bool sync_wanted;
+  /** Number of commits that have started, i.e. taken their snapshot. */
+  uint64_t nstarted;
+  /** Number of the last commit that has finished. */
+  uint64_t nfinished;
+  /** Number of the last commit that has finished and reached the disk. */
+  uint64_t nsynced;
+  /** Error of the last failed commit. */
+  int error;
+  /** wake wakes up the thread; done is signaled when a commit finishes. */
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t done;
+
+} fs_journal;
+
+/** A FIFO of block numbers, kept in a ring. */
+typedef struct cache_queue
+{
+  vsfs_blk_t* blocks;
+  /** Number of slots in the ring. */
+  uint32_t size;
+  /** Slot of the oldest block. */
+  uint32_t head;
+  /** Number of blocks in the queue. */
+  uint32_t count;
+
+} cache_queue;
+
+/**
+ * Block cache of the pread I/O engine; see cache.h. Only used if enabled
+ * (the image is not mapped); all other fields are unset otherwise.
+ *
+ * Blocks are replaced with 2Q: a block read in for the first time goes to
+ * the a1in FIFO. A block that is read in again while it is remembered in the
+ * a1out FIFO of recently evicted blocks goes to am, which is managed with
+ * CLOCK. The blocks before the data region are pinned: always present and in
+ * no queue.
+ *
+ * owner[blk] is the inode whose lock protects block blk. It is read without
+ * the cache lock by threads that hold that inode lock, and only changed under
+ * the cache lock. Everything else but the reference bits in state is
+ * protected by lock.
+ */
+typedef struct fs_cache
+{
+  /** Whether the image has a block cache (pread engine). */
+  bool enabled;
+  /** Most unpinned blocks kept present; 0 for no limit. */
+  uint32_t capacity;
+  /** Blocks before this one are pinned. */
+  vsfs_blk_t pinned;
+  /** Number of unpinned blocks present and in a queue. */
+  uint32_t nresident;
+  /** Inode whose lock protects each block; VSFS_INO_MAX if not known. */
+  vsfs_ino_t* owner;
+  /** Queue of each block (CACHE_* in cache.c) and its CLOCK reference bit. */
+  uint8_t* state;
+  /** 2Q queues. */
+  cache_queue a1in;
+  cache_queue am;
+  cache_queue a1out;
+  /** Number of blocks evicted so far. */
+  uint64_t evictions;
+  /** Serializes reading blocks in, changing owners and the queues. */
+  pthread_mutex_t lock;
+
+} fs_cache;
+
+/**
+ * Dirty block tracking and background write-back without a journal; see
+ * writeback.h. Only used if enabled; all other fields are unset otherwise.
+ */
+typedef struct fs_writeback
+{
+  /** Whether changes are tracked here (there is no journal). */
+  bool enabled;
+  /**
+   * Blocks changed since they were last written back, one bit per block of
+   * the image (like dbmap), set with atomics.
+   */
+  bitmap_t* dirty;
+  uint32_t ndirty;
+  /**
+   * Blocks being written back, one bit per block, set with atomics. A block
+   * is marked here before its dirty bit is cleared, so that the block cache
+   * does not drop it before the write is done.
+   */
+  bitmap_t* writing;
+  /** Number of blocks written back so far. */
+  uint64_t written;
+  /** Number of dirty blocks that wakes up the thread early. */
+  uint32_t threshold;
+  /** Period of the thread in milliseconds; set by writeback_start(). */
+  unsigned int interval;
+  /** Most bytes per second the thread writes; 0 for no limit. */
+  uint64_t rate;
+  /** Background write-back thread; only valid while running. */
+  pthread_t thread;
+  /** Whether the thread is (still supposed to be) running. */
+  bool running;
+  /**
+   * The thread has been woken up before its period is over. Changed under
+   * lock, also read with atomics.
+   */
+  bool kicked;
+  /** Protects running and kicked; wake wakes up the thread. */
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+
+} fs_writeback;
+
+/** Most prefetch requests waiting for the readahead thread. */
+#define VSFS_READAHEAD_QUEUE 64
+
+/** A range of a file to prefetch; see fs_readahead. */
+typedef struct readahead_req
+{
+  vsfs_ino_t ino;
+  uint64_t offset;
+  uint64_t size;
+
+} readahead_req;
+
+/**
+ * Prefetching ahead of sequential reads with a block cache; see readahead.h.
+ * All fields are protected by lock.
+ */
+typedef struct fs_readahead
+{
+  /**
+   * Pending requests, oldest first, in a ring starting at head. New
+   * requests are dropped while it is full.
+   */
+  readahead_req queue[VSFS_READAHEAD_QUEUE];
+  uint32_t head;
+  uint32_t count;
+  /** Background readahead thread; only valid while running. */
+  pthread_t thread;
+  /** Whether the thread is (still supposed to be) running. */
+  bool running;
+  pthread_mutex_t lock;
+  /** Wakes up the thread when a request is queued. */
+  pthread_cond_t wake;
+
+} fs_readahead;
+
 /**
  * Mounted file system runtime state - "fs context".
+ *
+ * Locking (needed when mounted with -o multithreaded):
+ *   - ilocks[ino] protects inode ino and its data. For a directory it also
+ *     protects the dentries and dindex[ino]. A directory is always locked
+ *     before any inode it contains, and at most one parent/child pair is
+ *     held at a time.
+ *   - The bitmaps need no lock: bits are claimed and released with the
+ *     bitmap_*_atomic() functions, starting from per-thread cursors.
+ *   - Free counter changes go to the calling thread's slot; sb_lock only
+ *     serializes folding them into the superblock.
+ *   - dindex_lock only serializes building a directory index.
+ *   - bmap.lock only serializes adding block maps; see bmap_cache.
+ *   - cache.lock is taken under inode locks; evicting a block takes the
+ *     lock of the inode it belongs to with trywrlock only. See fs_cache.
+ *   - writeback.lock only protects the write-back thread state, and
+ *     readahead.lock the readahead queue. They are taken under any other
+ *     lock, and nothing is taken under them.
+ *   - With a journal, operations that change the image hold journal.op_lock
+ *     shared around all of the above; see fs_journal.
+ * The superblock and index locks are leaves: nothing else but
+ * writeback.lock and readahead.lock is acquired while holding one of them.
+ * The dentry cache has its own lock.
  */
 typedef struct fs_ctx
 {
-  /** Pointer to the start of the image. */
+  /**
+   * The open image file. Set up by the caller before fs_ctx_init(). Blocks
+   * past the metadata (the data region) must be accessed through
+   * bdev_block() or after bdev_load(); see bdev.h.
+   */
+  bdev dev;
+  /** Pointer to the start of the image; same as dev.image. */
   void* image;
   /** Image size in bytes. */
   size_t size;
+  /**
+   * Descriptor of the image file (dev.fd), used to move file data between
+   * FUSE and the image without copying it, and for journal I/O; -1 if the
+   * image could not be opened. Set by the caller before fs_ctx_init().
+   */
+  int image_fd;
+  /**
+   * Have inode_read_buf() copy the data instead of pointing into the image
+   * file, for replies that are sent after the inode lock is released while
+   * other threads may truncate the file. Set by the caller.
+   */
+  bool copy_reads;
   /** Pointer to the superblock in the mmap'd disk image */
   vsfs_superblock* sb;
   /** Pointer to the inode bitmap in the mmap'd disk image */
@@ -29,6 +350,77 @@ typedef struct fs_ctx
   bitmap_t* dbmap;
   /** Pointer to the inode table in the mmap'd disk image */
   vsfs_inode* itable;
+  /** Per-thread allocation cursors; see fs_ctx_slot(). */
+  fs_slot slots[VSFS_NSLOTS];
+  /** Hashed directory indexes, one per inode number; built on first use. */
+  dir_index* dindex;
+  /** Full path to inode number cache, including negative entries. */
+  dcache dcache;
+  /** Cached block maps of recently used files. */
+  bmap_cache bmap;
+  /** Metadata journal. */
+  fs_journal journal;
+  /** Block cache of the pread engine. */
+  fs_cache cache;
+  /**
+   * Block cache capacity in blocks (see fs_cache); 0 for no limit. Set by
+   * the caller before fs_ctx_init().
+   */
+  uint32_t cache_blocks;
+  /** Dirty block tracking without a journal. */
+  fs_writeback writeback;
+  /** Prefetching ahead of sequential reads. */
+  fs_readahead readahead;
+
+  /** Per-inode locks, one per inode number. */
+  pthread_rwlock_t* ilocks;
+  /** Serializes folding the slot counters into the superblock. */
+  pthread_spinlock_t sb_lock;
+  /** Serializes lazy building of directory indexes. */
+  pthread_mutex_t dindex_lock;
+
+  /**
+   * Number of references the kernel holds to each inode (its lookup count).
+   * Only tracked by the inode-based backend, which allocates it; NULL
+   * otherwise. An unlinked inode is not freed while its count is non-zero.
+   * Incremented with atomics under the parent directory lock; decremented
+   * under the inode write lock.
+   */
+  uint64_t* nlookup;
+  /**
+   * Number of open file handles to each inode (path-based backend). An
+   * unlinked inode is not freed while it is open, since handles refer to
+   * inodes by number. Incremented with atomics under the parent directory
+   * lock or while FUSE keeps the path from being removed; decremented under
+   * the inode write lock.
+   */
+  uint32_t* nopen;
+
+  /** Durability mode; see flush.h. */
+  vsfs_durability durability;
+  /** Write-back period in milliseconds with VSFS_DURABILITY_PERIODIC. */
+  unsigned int sync_interval;
+  /** Journal commit period in milliseconds; 0 for the default. */
+  unsigned int commit_interval;
+  /** Dirty metadata blocks that trigger a journal commit; 0 for default. */
+  unsigned int commit_blocks;
+  /** Period of the write-back thread in milliseconds; 0 for the default. */
+  unsigned int writeback_interval;
+  /** Write-back thread rate limit in MiB per second; 0 for no limit. */
+  unsigned int writeback_rate;
+  /** Most blocks prefetched ahead of sequential reads; 0 for none. */
+  uint32_t readahead_blocks;
+  /** Page cache hint for data prefetched for sequential reads. */
+  vsfs_hint stream_hint;
+  /** Page cache hint for the blocks of deleted files. */
+  vsfs_hint free_hint;
+  /** Periodic write-back thread; only valid while flush_running. */
+  pthread_t flush_thread;
+  /** Whether the write-back thread is (still supposed to be) running. */
+  bool flush_running;
+  /** Protects flush_running; flush_cond wakes up the thread to stop it. */
+  pthread_mutex_t flush_lock;
+  pthread_cond_t flush_cond;
 
   // TODO: other useful runtime state of the mounted file system should be
   //       cached here (NOT in global variables in vsfs.c)
@@ -37,9 +429,12 @@ typedef struct fs_ctx
 } fs_ctx;
 
 /**
- * Initialize file system context.
+ * Initialize file system context. Reads in all the metadata before the data
+ * region. If the image has a journal, it is replayed first (see
+ * journal_init()).
  *
- * @param fs     pointer to the context to initialize.
+ * @param fs     pointer to the context to initialize; dev and image_fd must
+ *               be set.
  * @param size   image size in bytes.
  * @return       true on success; false on failure (e.g. invalid superblock).
  */
@@ -48,9 +443,39 @@ fs_ctx_init(fs_ctx* fs, void* image, size_t size);
 
 /**
  * Destroy file system context.
- * Must cleanup all the resources created in fs_ctx_init().
+ * Must cleanup all the resources created in fs_ctx_init(). Commits any
+ * changes that are still only in memory if the image has a journal.
  *
  * @param fs     pointer to the context to clean up
  */
 void
 fs_ctx_destroy(fs_ctx* fs);
+
+/**
+ * Get the allocation slot of the calling thread. A thread keeps the same
+ * slot for its whole lifetime.
+ *
+ * @param fs     file system context.
+ * @return       pointer to the slot.
+ */
+fs_slot*
+fs_ctx_slot(fs_ctx* fs);
+
+/**
+ * Fold the free counter changes of all slots into the superblock, making
+ * free_inodes and free_blocks exact. Called on statfs, sync and unmount.
+ *
+ * @param fs     file system context.
+ */
+void
+fs_ctx_fold_counters(fs_ctx* fs);
+
+/**
+ * Get file system statistics. Folds the slot counters first, so the free
+ * counts are exact.
+ *
+ * @param fs     file system context.
+ * @param st     pointer to the struct statvfs that receives the result.
+ */
+void
+fs_ctx_statfs(fs_ctx* fs, struct statvfs* st);
@@ -0,0 +1,966 @@
+/**
+ * Inode (file data and allocation) operations implementation.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bitmap.h"
+#include "cache.h"
+#include "flush.h"
+#include "inode.h"
+#include "journal.h"
+#include "util.h"
+
+/** Get the inode number of an inode; it owns its blocks in the cache. */
+static vsfs_ino_t
+inode_num(fs_ctx* fs, const vsfs_inode* ino)
+{
+  return ino - fs->itable;
+}
+
+/** Get a pointer to the block pointer of logical block lblk of a file. */
+static vsfs_blk_t*
+block_slot(fs_ctx* fs, vsfs_inode* ino, uint32_t lblk)
+{
+  assert(lblk < VSFS_MAX_FILE_BLOCKS);
+  if (lblk < VSFS_NUM_DIRECT) {
+    return &ino->i_direct[lblk];
+  }
+  vsfs_blk_t* indirect = cache_block(fs, inode_num(fs, ino), ino->i_indirect);
+  return &indirect[lblk - VSFS_NUM_DIRECT];
+}
+
+/** Check if a file uses the extent-based format. */
+static bool
+inode_has_extents(fs_ctx* fs, const vsfs_inode* ino)
+{
+  return (fs->sb->features & VSFS_FEATURE_EXTENTS) &&
+         (ino->i_flags & VSFS_INODE_EXTENTS);
+}
+
+/** Maximum number of blocks a file can have in its format. */
+static uint32_t
+inode_max_blocks(fs_ctx* fs, const vsfs_inode* ino)
+{
+  return inode_has_extents(fs, ino) ? fs->sb->num_blocks : VSFS_MAX_FILE_BLOCKS;
+}
+
+/** Check if the extent list of a file is split up under an index block. */
+static bool
+extent_indexed(const vsfs_inode* ino)
+{
+  return ino->i_flags & VSFS_INODE_EXTENT_INDEX;
+}
+
+/** Get a pointer to extent k of an extent-based file. */
+static vsfs_extent*
+extent_at(fs_ctx* fs, vsfs_inode* ino, uint32_t k)
+{
+  if (ino->i_extent_blk == 0) {
+    return &ino->i_extents[k];
+  }
+  vsfs_blk_t blk = ino->i_extent_blk;
+  if (extent_indexed(ino)) {
+    const vsfs_blk_t* index = cache_block(fs, inode_num(fs, ino), blk);
+    blk = index[k / VSFS_EXTENTS_PER_BLOCK];
+  }
+  vsfs_extent* ext = cache_block(fs, inode_num(fs, ino), blk);
+  return &ext[k % VSFS_EXTENTS_PER_BLOCK];
+}
+
+/**
+ * Add a block map to the cache, evicting another one if the cache is full.
+ * Returns the map that is now cached for the inode; NULL if no map could be
+ * evicted, in which case the caller keeps ownership of map.
+ */
+static vsfs_blk_t*
+bmap_insert(fs_ctx* fs, vsfs_ino_t ino, vsfs_blk_t* map)
+{
+  bmap_cache* bc = &fs->bmap;
+  vsfs_blk_t* ret = NULL;
+
+  pthread_mutex_lock(&bc->lock);
+  // Another reader of the same file may have been first
+  vsfs_blk_t* cur = __atomic_load_n(&bc->maps[ino], __ATOMIC_ACQUIRE);
+  if (cur != NULL) {
+    pthread_mutex_unlock(&bc->lock);
+    free(map);
+    return cur;
+  }
+
+  // Two rounds: the first one may only clear reference bits
+  for (uint32_t n = 0; n < 2 * bc->ring_size; n++) {
+    uint32_t i = bc->hand;
+    bc->hand = (i + 1) % bc->ring_size;
+
+    // A slot is free if its map was dropped by bmap_invalidate()
+    vsfs_ino_t victim = bc->ring[i];
+    if (victim != VSFS_INO_MAX &&
+        __atomic_load_n(&bc->maps[victim], __ATOMIC_RELAXED) != NULL) {
+      if (__atomic_exchange_n(&bc->ref[victim], 0, __ATOMIC_RELAXED)) {
+        continue;
+      }
+      // Readers of the victim may be using its map
+      if (pthread_rwlock_trywrlock(&fs->ilocks[victim]) != 0) continue;
+      free(bc->maps[victim]);
+      __atomic_store_n(&bc->maps[victim], NULL, __ATOMIC_RELAXED);
+      pthread_rwlock_unlock(&fs->ilocks[victim]);
+    }
+
+    bc->ring[i] = ino;
+    __atomic_store_n(&bc->maps[ino], map, __ATOMIC_RELEASE);
+    ret = map;
+    break;
+  }
+  pthread_mutex_unlock(&bc->lock);
+  return ret;
+}
+
+/**
+ * Get the cached block map of a file, building it if needed. Returns NULL if
+ * it could not be cached.
+ */
+static const vsfs_blk_t*
+bmap_get(fs_ctx* fs, vsfs_inode* ino)
+{
+  bmap_cache* bc = &fs->bmap;
+  vsfs_ino_t i = ino - fs->itable;
+
+  vsfs_blk_t* map = __atomic_load_n(&bc->maps[i], __ATOMIC_ACQUIRE);
+  if (map != NULL) {
+    if (!__atomic_load_n(&bc->ref[i], __ATOMIC_RELAXED)) {
+      __atomic_store_n(&bc->ref[i], 1, __ATOMIC_RELAXED);
+    }
+    return map;
+  }
+
+  map = malloc(ino->i_blocks * sizeof(vsfs_blk_t));
+  if (map == NULL) return NULL;
+  if (inode_has_extents(fs, ino)) {
+    for (uint32_t e = 0; e < ino->i_nextents; e++) {
+      const vsfs_extent* ext = extent_at(fs, ino, e);
+      for (uint32_t b = 0; b < ext->e_len; b++) {
+        map[ext->e_lblk + b] = ext->e_start + b;
+      }
+    }
+  } else {
+    memcpy(map, ino->i_direct, VSFS_NUM_DIRECT * sizeof(vsfs_blk_t));
+    memcpy(map + VSFS_NUM_DIRECT, block_slot(fs, ino, VSFS_NUM_DIRECT),
+           (ino->i_blocks - VSFS_NUM_DIRECT) * sizeof(vsfs_blk_t));
+  }
+
+  vsfs_blk_t* cached = bmap_insert(fs, i, map);
+  if (cached == NULL) {
+    free(map);
+  }
+  return cached;
+}
+
+/**
+ * Drop the cached block map of a file before its blocks change. The caller
+ * holds the inode write lock, so nobody else can be using or adding the map.
+ */
+static void
+bmap_invalidate(fs_ctx* fs, vsfs_inode* ino)
+{
+  vsfs_ino_t i = ino - fs->itable;
+  vsfs_blk_t* map = __atomic_load_n(&fs->bmap.maps[i], __ATOMIC_RELAXED);
+  if (map != NULL) {
+    __atomic_store_n(&fs->bmap.maps[i], NULL, __ATOMIC_RELAXED);
+    free(map);
+  }
+}
+
+vsfs_blk_t
+inode_bmap(fs_ctx* fs, vsfs_inode* ino, uint32_t lblk)
+{
+  assert(lblk < ino->i_blocks);
+  bool extents = inode_has_extents(fs, ino);
+
+  // Direct pointers and short extent lists are as fast as the cache
+  if (!extents && lblk < VSFS_NUM_DIRECT) {
+    return ino->i_direct[lblk];
+  }
+  if (!extents || ino->i_extent_blk != 0) {
+    const vsfs_blk_t* map = bmap_get(fs, ino);
+    if (map != NULL) {
+      return map[lblk];
+    }
+  }
+  if (!extents) {
+    return *block_slot(fs, ino, lblk);
+  }
+
+  // Find the last extent that starts at or before lblk
+  uint32_t lo = 0;
+  uint32_t hi = ino->i_nextents;
+  while (hi - lo > 1) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (extent_at(fs, ino, mid)->e_lblk <= lblk) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  const vsfs_extent* ext = extent_at(fs, ino, lo);
+  assert(lblk - ext->e_lblk < ext->e_len);
+  return ext->e_start + (lblk - ext->e_lblk);
+}
+
+void*
+inode_get_address(fs_ctx* fs, vsfs_inode* ino, uint64_t offset)
+{
+  vsfs_blk_t blk = inode_bmap(fs, ino, offset / VSFS_BLOCK_SIZE);
+  return cache_block(fs, inode_num(fs, ino), blk) + offset % VSFS_BLOCK_SIZE;
+}
+
+/**
+ * Add n (which may be negative) to the free block count. The change is kept
+ * in the calling thread's slot until fs_ctx_fold_counters().
+ */
+static void
+sb_add_free_blocks(fs_ctx* fs, int32_t n)
+{
+  __atomic_fetch_add(&fs_ctx_slot(fs)->free_blocks, n, __ATOMIC_RELAXED);
+}
+
+/** Add n (which may be negative) to the free inode count; see above. */
+static void
+sb_add_free_inodes(fs_ctx* fs, int32_t n)
+{
+  __atomic_fetch_add(&fs_ctx_slot(fs)->free_inodes, n, __ATOMIC_RELAXED);
+}
+
+/** Allocate a single data block in next-fit order from the thread cursor. */
+static int
+block_alloc(fs_ctx* fs, vsfs_blk_t* blk)
+{
+  if (bitmap_alloc_atomic(fs->dbmap, fs->sb->num_blocks,
+                          &fs_ctx_slot(fs)->dbmap_hint, blk) < 0) {
+    return -ENOSPC;
+  }
+
+  sb_add_free_blocks(fs, -1);
+  journal_dirty_meta(fs, fs->dbmap, VSFS_BLOCK_SIZE);
+  return 0;
+}
+
+/**
+ * Allocate a run of n contiguous data blocks, searching from block goal, or
+ * from the calling thread's cursor if goal is 0. The first block of the run
+ * is returned in *start.
+ */
+static int
+block_alloc_run(fs_ctx* fs, uint32_t n, vsfs_blk_t goal, vsfs_blk_t* start)
+{
+  uint32_t* hint = (goal != 0) ? &goal : &fs_ctx_slot(fs)->dbmap_hint;
+  if (bitmap_alloc_range_atomic(fs->dbmap, fs->sb->num_blocks, n, hint,
+                                start) < 0) {
+    return -ENOSPC;
+  }
+
+  sb_add_free_blocks(fs, -(int32_t)n);
+  journal_dirty_meta(fs, fs->dbmap, VSFS_BLOCK_SIZE);
+  return 0;
+}
+
+/** Free a run of n blocks starting at block start. */
+static void
+free_run(fs_ctx* fs, vsfs_blk_t start, uint32_t n)
+{
+  bitmap_free_range_atomic(fs->dbmap, fs->sb->num_blocks, start, n);
+  sb_add_free_blocks(fs, n);
+  journal_dirty_meta(fs, fs->dbmap, VSFS_BLOCK_SIZE);
+}
+
+/**
+ * Append a run of blocks to the end of an extent-based file. The run is
+ * merged into the last extent if it directly follows it. The extent list is
+ * moved out of the inode into a block of its own when it outgrows the inode,
+ * and split up under an index block when it outgrows that block.
+ * i_blocks is not changed.
+ *
+ * @param fs     file system context.
+ * @param ino    pointer to the inode of the file.
+ * @param start  first block of the run.
+ * @param n      number of blocks in the run.
+ * @return       0 on success; -ENOSPC if there is no free block for the
+ *               extent list; -EFBIG if the file has too many extents.
+ */
+static int
+extent_append(fs_ctx* fs, vsfs_inode* ino, vsfs_blk_t start, uint32_t n)
+{
+  vsfs_ino_t i = inode_num(fs, ino);
+  uint32_t count = ino->i_nextents;
+
+  if (count > 0) {
+    vsfs_extent* last = extent_at(fs, ino, count - 1);
+    if (last->e_start + last->e_len == start) {
+      last->e_len += n;
+      journal_dirty_meta(fs, last, sizeof(*last));
+      return 0;
+    }
+  }
+  if (count == VSFS_MAX_EXTENTS) return -EFBIG;
+
+  if (count == VSFS_INLINE_EXTENTS && ino->i_extent_blk == 0) {
+    vsfs_blk_t blk;
+    if (block_alloc(fs, &blk) < 0) return -ENOSPC;
+    cache_fill(fs, i, blk, 1);
+    memcpy(fs->image + blk * VSFS_BLOCK_SIZE, ino->i_extents,
+           sizeof(ino->i_extents));
+    ino->i_extent_blk = blk;
+  } else if (count >= VSFS_EXTENTS_PER_BLOCK &&
+             count % VSFS_EXTENTS_PER_BLOCK == 0) {
+    // The last extent block is full; only the slots written are ever read
+    vsfs_blk_t blk;
+    if (block_alloc(fs, &blk) < 0) return -ENOSPC;
+    cache_fill(fs, i, blk, 1);
+    if (!extent_indexed(ino)) {
+      vsfs_blk_t index_blk;
+      if (block_alloc(fs, &index_blk) < 0) {
+        free_run(fs, blk, 1);
+        return -ENOSPC;
+      }
+      cache_fill(fs, i, index_blk, 1);
+      vsfs_blk_t* index = cache_block(fs, i, index_blk);
+      index[0] = ino->i_extent_blk;
+      journal_dirty_meta(fs, &index[0], sizeof(*index));
+      ino->i_extent_blk = index_blk;
+      ino->i_flags |= VSFS_INODE_EXTENT_INDEX;
+    }
+    vsfs_blk_t* slot = (vsfs_blk_t*)cache_block(fs, i, ino->i_extent_blk) +
+                       count / VSFS_EXTENTS_PER_BLOCK;
+    *slot = blk;
+    journal_dirty_meta(fs, slot, sizeof(*slot));
+  }
+
+  vsfs_extent* ext = extent_at(fs, ino, count);
+  ext->e_lblk = ino->i_blocks;
+  ext->e_start = start;
+  ext->e_len = n;
+  ino->i_nextents++;
+  journal_dirty_meta(fs, ext, sizeof(*ext));
+  return 0;
+}
+
+/**
+ * Free the blocks past the first nblocks of an extent-based file. Extent
+ * blocks that are no longer needed are freed, and the extent list is moved
+ * back into the inode once it is short enough.
+ * i_blocks is not changed.
+ */
+static void
+extent_trim(fs_ctx* fs, vsfs_inode* ino, uint32_t nblocks)
+{
+  uint32_t old_count = ino->i_nextents;
+
+  while (ino->i_nextents > 0) {
+    vsfs_extent* last = extent_at(fs, ino, ino->i_nextents - 1);
+    if (last->e_lblk + last->e_len <= nblocks) break;
+
+    uint32_t keep = (last->e_lblk < nblocks) ? nblocks - last->e_lblk : 0;
+    free_run(fs, last->e_start + keep, last->e_len - keep);
+
+    if (keep > 0) {
+      last->e_len = keep;
+      journal_dirty_meta(fs, last, sizeof(*last));
+      break;
+    }
+    ino->i_nextents--;
+  }
+
+  if (extent_indexed(ino)) {
+    const vsfs_blk_t* index = cache_block(fs, inode_num(fs, ino),
+                                          ino->i_extent_blk);
+    uint32_t nleft = div_round_up(ino->i_nextents, VSFS_EXTENTS_PER_BLOCK);
+    for (uint32_t l = (nleft > 0) ? nleft : 1;
+         l < div_round_up(old_count, VSFS_EXTENTS_PER_BLOCK); l++) {
+      free_run(fs, index[l], 1);
+    }
+    if (ino->i_nextents <= VSFS_EXTENTS_PER_BLOCK) {
+      vsfs_blk_t blk = ino->i_extent_blk;
+      ino->i_extent_blk = index[0];
+      ino->i_flags &= ~VSFS_INODE_EXTENT_INDEX;
+      free_run(fs, blk, 1);
+    }
+  }
+
+  if (ino->i_extent_blk != 0 && ino->i_nextents <= VSFS_INLINE_EXTENTS) {
+    vsfs_blk_t blk = ino->i_extent_blk;
+    memcpy(ino->i_extents, cache_block(fs, inode_num(fs, ino), blk),
+           ino->i_nextents * sizeof(vsfs_extent));
+    ino->i_extent_blk = 0;
+    free_run(fs, blk, 1);
+  }
+}
+
+/**
+ * Free the blocks at the end of a file so that only the first nblocks remain.
+ * The indirect block is freed once no indirect pointers are left.
+ * i_size is not changed.
+ *
+ * @param fs       file system context.
+ * @param ino      pointer to the inode of the file.
+ * @param nblocks  number of blocks to keep.
+ */
+static void
+inode_trim_blocks(fs_ctx* fs, vsfs_inode* ino, uint32_t nblocks)
+{
+  if (nblocks >= ino->i_blocks) return;
+  bmap_invalidate(fs, ino);
+  journal_dirty_meta(fs, ino, sizeof(*ino));
+
+  if (inode_has_extents(fs, ino)) {
+    extent_trim(fs, ino, nblocks);
+    ino->i_blocks = nblocks;
+    return;
+  }
+
+  // Free contiguous pointers as one run; whole bitmap words at a time
+  for (uint32_t i = nblocks; i < ino->i_blocks;) {
+    vsfs_blk_t start = *block_slot(fs, ino, i);
+    uint32_t n = 1;
+    while (i + n < ino->i_blocks && *block_slot(fs, ino, i + n) == start + n) {
+      n++;
+    }
+    free_run(fs, start, n);
+    i += n;
+  }
+  if (ino->i_blocks > VSFS_NUM_DIRECT && nblocks <= VSFS_NUM_DIRECT) {
+    free_run(fs, ino->i_indirect, 1);
+  }
+  ino->i_blocks = nblocks;
+}
+
+/**
+ * Get the block right after the last block of a file, where the file would
+ * best continue; 0 if the file is empty or ends at the end of the image.
+ * Doesn't use the block map cache, which is invalid while blocks are added.
+ */
+static vsfs_blk_t
+inode_goal(fs_ctx* fs, vsfs_inode* ino)
+{
+  if (ino->i_blocks == 0) return 0;
+
+  vsfs_blk_t last;
+  if (inode_has_extents(fs, ino)) {
+    const vsfs_extent* ext = extent_at(fs, ino, ino->i_nextents - 1);
+    last = ext->e_start + ext->e_len - 1;
+  } else {
+    last = *block_slot(fs, ino, ino->i_blocks - 1);
+  }
+  return (last + 1 < fs->sb->num_blocks) ? last + 1 : 0;
+}
+
+int
+inode_add_blocks(fs_ctx* fs, vsfs_inode* ino, uint32_t nblocks)
+{
+  if (nblocks > inode_max_blocks(fs, ino) - ino->i_blocks) return -EFBIG;
+  if (nblocks == 0) return 0;
+  bmap_invalidate(fs, ino);
+  journal_dirty_meta(fs, ino, sizeof(*ino));
+
+  uint32_t old_blocks = ino->i_blocks;
+  uint32_t target = ino->i_blocks + nblocks;
+  uint32_t run = nblocks;
+  int err;
+
+  while (ino->i_blocks < target) {
+    uint32_t n = target - ino->i_blocks;
+    if (n > run) n = run;
+
+    // Goal first, so that the file stays contiguous where it can
+    vsfs_blk_t start;
+    if (block_alloc_run(fs, n, inode_goal(fs, ino), &start) < 0) {
+      if (n == 1) {
+        err = -ENOSPC;
+        goto fail;
+      }
+      run = n / 2;
+      continue;
+    }
+
+    if (inode_has_extents(fs, ino)) {
+      err = extent_append(fs, ino, start, n);
+      if (err < 0) {
+        free_run(fs, start, n);
+        goto fail;
+      }
+      ino->i_blocks += n;
+      continue;
+    }
+
+    // First pointer past the direct ones needs the indirect block
+    if (ino->i_blocks <= VSFS_NUM_DIRECT && ino->i_blocks + n > VSFS_NUM_DIRECT) {
+      if (block_alloc(fs, &ino->i_indirect) < 0) {
+        free_run(fs, start, n);
+        err = -ENOSPC;
+        goto fail;
+      }
+      // Only the slots written below are ever read
+      cache_fill(fs, inode_num(fs, ino), ino->i_indirect, 1);
+    }
+
+    for (uint32_t i = 0; i < n; i++) {
+      vsfs_blk_t* slot = block_slot(fs, ino, ino->i_blocks);
+      *slot = start + i;
+      journal_dirty_meta(fs, slot, sizeof(*slot));
+      ino->i_blocks++;
+    }
+  }
+  return 0;
+
+fail:
+  inode_trim_blocks(fs, ino, old_blocks);
+  return err;
+}
+
+int
+inode_alloc(fs_ctx* fs, mode_t mode, vsfs_ino_t* ino)
+{
+  vsfs_superblock *sb = fs->sb;
+
+  if (bitmap_alloc_atomic(fs->ibmap, sb->num_inodes,
+                          &fs_ctx_slot(fs)->ibmap_hint, ino) < 0) {
+    return -ENOSPC;
+  }
+  sb_add_free_inodes(fs, -1);
+
+  vsfs_inode *new_inode = &(fs->itable[*ino]);
+  memset(new_inode, 0, sizeof(vsfs_inode));
+  new_inode->i_mode = mode;
+  new_inode->i_nlink = 1;
+  if (sb->features & VSFS_FEATURE_EXTENTS) {
+    new_inode->i_flags = VSFS_INODE_EXTENTS;
+  }
+  clock_gettime(CLOCK_REALTIME, &(new_inode->i_mtime));
+  journal_dirty_meta(fs, new_inode, sizeof(*new_inode));
+  journal_dirty_meta(fs, fs->ibmap, VSFS_BLOCK_SIZE);
+  return 0;
+}
+
+/**
+ * Number of bytes from offset to the end of its block, capped at size.
+ * Used to split a byte range of a file at block boundaries.
+ */
+static size_t
+block_chunk(uint64_t offset, size_t size)
+{
+  size_t n = VSFS_BLOCK_SIZE - offset % VSFS_BLOCK_SIZE;
+  return (n < size) ? n : size;
+}
+
+/**
+ * Get the length of the part of a byte range of a file that is contiguous in
+ * the image, and its position in the image.
+ */
+static size_t
+inode_run(fs_ctx* fs, vsfs_inode* ino, uint64_t offset, size_t size,
+          uint64_t* pos)
+{
+  uint32_t lblk = offset / VSFS_BLOCK_SIZE;
+  vsfs_blk_t blk = inode_bmap(fs, ino, lblk);
+  *pos = (uint64_t)blk * VSFS_BLOCK_SIZE + offset % VSFS_BLOCK_SIZE;
+
+  size_t n = block_chunk(offset, size);
+  while (n < size && inode_bmap(fs, ino, ++lblk) == ++blk) {
+    n += block_chunk(offset + n, size - n);
+  }
+  return n;
+}
+
+void
+inode_free(fs_ctx* fs, vsfs_ino_t ino)
+{
+  // Before the blocks are freed: once they are, they may be reused (and
+  // their pages dropped with new contents)
+  vsfs_inode* inode = &fs->itable[ino];
+  if (!fs->dev.cached && fs->free_hint != VSFS_HINT_NONE) {
+    for (uint64_t done = 0; done < inode->i_size;) {
+      uint64_t pos;
+      size_t n = inode_run(fs, inode, done, inode->i_size - done, &pos);
+      bdev_advise(&fs->dev, pos / VSFS_BLOCK_SIZE,
+                  div_round_up(pos % VSFS_BLOCK_SIZE + n, VSFS_BLOCK_SIZE),
+                  fs->free_hint);
+      done += n;
+    }
+  }
+  inode_trim_blocks(fs, inode, 0);
+  dir_index_destroy(&fs->dindex[ino]);
+
+  bitmap_free_atomic(fs->ibmap, fs->sb->num_inodes, ino);
+  sb_add_free_inodes(fs, 1);
+  journal_dirty_meta(fs, fs->ibmap, VSFS_BLOCK_SIZE);
+}
+
+bool
+inode_release(fs_ctx* fs, vsfs_ino_t ino)
+{
+  if (fs->itable[ino].i_nlink != 0) return false;
+  if (fs->nopen != NULL &&
+      __atomic_load_n(&fs->nopen[ino], __ATOMIC_ACQUIRE) != 0) {
+    return false;
+  }
+  if (fs->nlookup != NULL &&
+      __atomic_load_n(&fs->nlookup[ino], __ATOMIC_ACQUIRE) != 0) {
+    return false;
+  }
+  inode_free(fs, ino);
+  return true;
+}
+
+int
+inode_truncate(fs_ctx* fs, vsfs_inode* ino, off_t size)
+{
+  int err;
+
+  if ((uint64_t) size > (uint64_t) inode_max_blocks(fs, ino) * VSFS_BLOCK_SIZE) return -EFBIG;
+  vsfs_blk_t block_size = div_round_up(size, VSFS_BLOCK_SIZE);
+
+  if ((uint64_t) size == ino->i_size) return 0;
+
+  if ((uint64_t) size > ino->i_size) {
+    // zero out the uninitialized range in the current last block
+    uint32_t tail = ino->i_size % VSFS_BLOCK_SIZE;
+    if (tail != 0) {
+      void* p = inode_get_address(fs, ino, ino->i_size);
+      memset(p, 0, VSFS_BLOCK_SIZE - tail);
+      journal_dirty_data(fs, p, VSFS_BLOCK_SIZE - tail);
+    }
+
+    // allocate more blocks, as contiguous as possible; zero them as a whole
+    uint32_t old_blocks = ino->i_blocks;
+    if (block_size > old_blocks) {
+      err = inode_add_blocks(fs, ino, block_size - old_blocks);
+      if (err < 0) return err;
+    }
+    for (uint32_t i = old_blocks; i < block_size; i++) {
+      vsfs_blk_t blk = inode_bmap(fs, ino, i);
+      cache_fill(fs, inode_num(fs, ino), blk, 1);
+      void* p = fs->image + (size_t)blk * VSFS_BLOCK_SIZE;
+      memset(p, 0, VSFS_BLOCK_SIZE);
+      journal_dirty_data(fs, p, VSFS_BLOCK_SIZE);
+    }
+  } else { // free blocks
+    inode_trim_blocks(fs, ino, block_size);
+  }
+
+  // Set new file size
+  ino->i_size = size;
+
+  clock_gettime(CLOCK_REALTIME, &(ino->i_mtime));
+  journal_dirty_meta(fs, ino, sizeof(*ino));
+
+  return 0;
+}
+
+ssize_t
+inode_read(fs_ctx* fs, vsfs_inode* ino, void* buf, size_t size, off_t offset)
+{
+  if (ino->i_size <= (uint64_t) offset) return 0;
+  if (ino->i_size < (uint64_t) offset + (uint64_t) size) {
+    size = ino->i_size - offset;
+  }
+
+  // copy run by run; consecutive runs may be anywhere in the image
+  for (size_t done = 0; done < size;) {
+    uint64_t pos;
+    size_t n = inode_run(fs, ino, offset + done, size - done, &pos);
+    int err = cache_load(fs, inode_num(fs, ino), pos / VSFS_BLOCK_SIZE,
+                         div_round_up(pos % VSFS_BLOCK_SIZE + n,
+                                      VSFS_BLOCK_SIZE));
+    if (err < 0) return err;
+    memcpy((char*)buf + done, fs->image + pos, n);
+    done += n;
+  }
+  return size;
+}
+
+/**
+ * Make the blocks of a contiguous range of the image that is about to be
+ * written present: blocks that are only partly overwritten are read in, the
+ * others are not.
+ */
+static int
+prepare_write(fs_ctx* fs, vsfs_inode* ino, uint64_t pos, size_t n)
+{
+  vsfs_ino_t owner = inode_num(fs, ino);
+  vsfs_blk_t first = pos / VSFS_BLOCK_SIZE;
+  vsfs_blk_t last = (pos + n - 1) / VSFS_BLOCK_SIZE;
+  int err = 0;
+
+  if (pos % VSFS_BLOCK_SIZE != 0) {
+    err = cache_load(fs, owner, first++, 1);
+  }
+  if (err == 0 && last >= first && (pos + n) % VSFS_BLOCK_SIZE != 0) {
+    err = cache_load(fs, owner, last--, 1);
+  }
+  if (err == 0 && last + 1 > first) {
+    cache_fill(fs, owner, first, last + 1 - first);
+  }
+  return err;
+}
+
+int
+inode_read_buf(fs_ctx* fs, vsfs_inode* ino, size_t size, off_t offset,
+               struct fuse_bufvec** bufp)
+{
+  if (ino->i_size <= (uint64_t) offset) {
+    size = 0;
+  } else if (ino->i_size < (uint64_t) offset + (uint64_t) size) {
+    size = ino->i_size - offset;
+  }
+
+  // Without the image descriptor the data has to be copied after all. With a
+  // journal or the pread engine, the image file may be behind memory.
+  if (fs->image_fd < 0 || fs->journal.enabled || fs->dev.cached ||
+      fs->copy_reads) {
+    struct fuse_bufvec* vec = malloc(sizeof(*vec));
+    void* mem = malloc(size);
+    if (vec == NULL || mem == NULL) {
+      free(vec);
+      free(mem);
+      return -ENOMEM;
+    }
+    *vec = FUSE_BUFVEC_INIT(size);
+    vec->buf[0].mem = mem;
+    ssize_t res = inode_read(fs, ino, mem, size, offset);
+    if (res < 0) {
+      free(vec);
+      free(mem);
+      return res;
+    }
+    *bufp = vec;
+    return 0;
+  }
+
+  // One buffer per contiguous run, so count the runs first
+  size_t count = 0;
+  uint64_t pos;
+  for (size_t done = 0; done < size; count++) {
+    done += inode_run(fs, ino, offset + done, size - done, &pos);
+  }
+
+  struct fuse_bufvec* vec =
+    malloc(sizeof(*vec) + (count ? count - 1 : 0) * sizeof(struct fuse_buf));
+  if (vec == NULL) {
+    return -ENOMEM;
+  }
+  *vec = FUSE_BUFVEC_INIT(0);
+  vec->count = count ? count : 1;
+
+  size_t done = 0;
+  for (size_t i = 0; i < count; i++) {
+    size_t n = inode_run(fs, ino, offset + done, size - done, &pos);
+    vec->buf[i] = (struct fuse_buf){
+      .size = n,
+      .flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK,
+      .mem = NULL,
+      .fd = fs->image_fd,
+      .pos = pos,
+    };
+    done += n;
+  }
+  *bufp = vec;
+  return 0;
+}
+
+int
+inode_prefetch(fs_ctx* fs, vsfs_inode* ino, uint64_t offset, size_t size)
+{
+  // The inode may have been freed or truncated since the range was chosen
+  if (!S_ISREG(ino->i_mode) || ino->i_size <= offset) return 0;
+  if (ino->i_size - offset < size) {
+    size = ino->i_size - offset;
+  }
+
+  for (size_t done = 0; done < size;) {
+    uint64_t pos;
+    size_t n = inode_run(fs, ino, offset + done, size - done, &pos);
+    if (fs->dev.cached) {
+      int err = cache_load(fs, inode_num(fs, ino), pos / VSFS_BLOCK_SIZE,
+                           div_round_up(pos % VSFS_BLOCK_SIZE + n,
+                                        VSFS_BLOCK_SIZE));
+      if (err < 0) return err;
+    } else {
+      bdev_advise(&fs->dev, pos / VSFS_BLOCK_SIZE,
+                  div_round_up(pos % VSFS_BLOCK_SIZE + n, VSFS_BLOCK_SIZE),
+                  fs->stream_hint);
+    }
+    done += n;
+  }
+  return 0;
+}
+
+/**
+ * Shrink a file that was extended for a write back to the end of what was
+ * actually written, so that a failed write doesn't grow it.
+ */
+static void
+undo_extend(fs_ctx* fs, vsfs_inode* ino, uint64_t old_size, uint64_t end)
+{
+  uint64_t keep = (end > old_size) ? end : old_size;
+  if (ino->i_size > keep) {
+    inode_truncate(fs, ino, keep);
+  }
+}
+
+int
+inode_write(fs_ctx* fs, vsfs_inode* ino, const void* buf, size_t size,
+            off_t offset)
+{
+  uint64_t old_size = ino->i_size;
+
+  // extend the file first (zero-filling any hole) if the write ends past EOF
+  if (ino->i_size < (uint64_t) offset + (uint64_t) size) {
+    int err = inode_truncate(fs, ino, offset + size);
+    if (err < 0) return err;
+  }
+
+  // do the write, one contiguous run of blocks at a time
+  for (size_t done = 0; done < size;) {
+    uint64_t pos;
+    size_t n = inode_run(fs, ino, offset + done, size - done, &pos);
+    int err = prepare_write(fs, ino, pos, n);
+    if (err < 0) {
+      undo_extend(fs, ino, old_size, offset + done);
+      return err;
+    }
+    memcpy(fs->image + pos, (const char*)buf + done, n);
+    journal_dirty_data(fs, fs->image + pos, n);
+    done += n;
+  }
+
+  // update last modified time
+  clock_gettime(CLOCK_REALTIME, &(ino->i_mtime));
+  journal_dirty_meta(fs, ino, sizeof(*ino));
+  return 0;
+}
+
+ssize_t
+inode_write_buf(fs_ctx* fs, vsfs_inode* ino, struct fuse_bufvec* buf,
+                off_t offset)
+{
+  size_t size = fuse_buf_size(buf);
+  uint64_t old_size = ino->i_size;
+  if (ino->i_size < (uint64_t) offset + (uint64_t) size) {
+    int err = inode_truncate(fs, ino, offset + size);
+    if (err < 0) return err;
+  }
+
+  // Data that is still in the FUSE pipe is spliced into the image file; data
+  // that is already in memory is copied straight into the mapping. With a
+  // journal or the pread engine, everything goes through memory.
+  bool to_fd = (fs->image_fd >= 0) && !fs->journal.enabled &&
+               !fs->dev.cached && (buf->buf[buf->idx].flags & FUSE_BUF_IS_FD);
+
+  size_t done = 0;
+  while (done < size) {
+    uint64_t pos;
+    size_t n = inode_run(fs, ino, offset + done, size - done, &pos);
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(n);
+    if (to_fd) {
+      dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+      dst.buf[0].fd = fs->image_fd;
+      dst.buf[0].pos = pos;
+    } else {
+      int err = prepare_write(fs, ino, pos, n);
+      if (err < 0) {
+        if (done == 0) {
+          undo_extend(fs, ino, old_size, offset);
+          return err;
+        }
+        break;
+      }
+      dst.buf[0].mem = fs->image + pos;
+    }
+
+    ssize_t res = fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_MOVE);
+    if (res < 0) {
+      if (done == 0) {
+        undo_extend(fs, ino, old_size, offset);
+        return res;
+      }
+      break;
+    }
+    journal_dirty_data(fs, fs->image + pos, res);
+    done += res;
+    if ((size_t)res < n) break;
+  }
+  if (done < size) {
+    undo_extend(fs, ino, old_size, offset + done);
+  }
+
+  clock_gettime(CLOCK_REALTIME, &(ino->i_mtime));
+  journal_dirty_meta(fs, ino, sizeof(*ino));
+  return done;
+}
+
+int
+inode_sync(fs_ctx* fs, vsfs_ino_t ino)
+{
+  vsfs_inode* inode = &fs->itable[ino];
+  int err = 0;
+
+  // Data blocks, one contiguous run at a time
+  for (uint32_t l = 0; l < inode->i_blocks && err == 0;) {
+    vsfs_blk_t start = inode_bmap(fs, inode, l);
+    uint32_t n = 1;
+    while (l + n < inode->i_blocks &&
+           inode_bmap(fs, inode, l + n) == start + n) {
+      n++;
+    }
+    err = flush_blocks(fs, start, n);
+    l += n;
+  }
+
+  // Block pointers or extents that are not in the inode itself
+  if (err == 0) {
+    vsfs_blk_t map_blk = 0;
+    if (inode_has_extents(fs, inode)) {
+      map_blk = inode->i_extent_blk;
+    } else if (inode->i_blocks > VSFS_NUM_DIRECT) {
+      map_blk = inode->i_indirect;
+    }
+    if (map_blk != 0) {
+      err = flush_blocks(fs, map_blk, 1);
+    }
+  }
+  if (err == 0 && inode_has_extents(fs, inode) && extent_indexed(inode)) {
+    const vsfs_blk_t* index = cache_block(fs, ino, inode->i_extent_blk);
+    uint32_t n = div_round_up(inode->i_nextents, VSFS_EXTENTS_PER_BLOCK);
+    for (uint32_t l = 0; l < n && err == 0; l++) {
+      err = flush_blocks(fs, index[l], 1);
+    }
+  }
+
+  // The inode, then the superblock and the bitmaps (blocks 0 to 2)
+  if (err == 0) {
+    vsfs_blk_t iblk = VSFS_ITBL_BLKNUM +
+                      ino / (VSFS_BLOCK_SIZE / sizeof(vsfs_inode));
+    err = flush_blocks(fs, iblk, 1);
+  }
+  if (err == 0) {
+    fs_ctx_fold_counters(fs);
+    err = flush_blocks(fs, VSFS_SB_BLKNUM, VSFS_ITBL_BLKNUM - VSFS_SB_BLKNUM);
+  }
+  return err;
+}
+
+void
+inode_stat(fs_ctx* fs, vsfs_ino_t ino, struct stat* st)
+{
+  const vsfs_inode* inode = &fs->itable[ino];
+
+  memset(st, 0, sizeof(*st));
+  st->st_ino = ino;
+  st->st_mode = inode->i_mode;
+  st->st_nlink = inode->i_nlink;
+  st->st_size = inode->i_size;
+  st->st_blocks = div_round_up(inode->i_size, 512);
+  st->st_mtim = inode->i_mtime;
+}
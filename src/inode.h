@@ -0,0 +1,235 @@
+/**
+ * Inode (file data and allocation) operations header file.
+ *
+ * These functions work on inodes directly and are shared by the path-based
+ * and the inode-based FUSE backends. Unless noted otherwise, the caller must
+ * hold the inode lock (see fs_ctx.h): a read lock for functions that only
+ * read the inode and a write lock for functions that change it.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <fuse_common.h>
+
+#include "fs_ctx.h"
+#include "vsfs.h"
+
+/**
+ * Map a logical block of a file to a block of the file system.
+ *
+ * Extent lists are sorted by logical block, so the extent is found with a
+ * binary search in O(log extents).
+ *
+ * @param fs    file system context.
+ * @param ino   pointer to the inode of the file.
+ * @param lblk  logical block; must be less than i_blocks.
+ * @return      block number.
+ */
+vsfs_blk_t
+inode_bmap(fs_ctx* fs, vsfs_inode* ino, uint32_t lblk);
+
+/**
+ * Get a pointer to the byte at the given offset of a file in the image.
+ *
+ * @param fs      file system context.
+ * @param ino     pointer to the inode of the file.
+ * @param offset  byte offset; must be within the allocated blocks.
+ * @return        pointer into the mapped image.
+ */
+void*
+inode_get_address(fs_ctx* fs, vsfs_inode* ino, uint64_t offset);
+
+/**
+ * Add nblocks newly allocated blocks to the end of a file.
+ *
+ * The blocks are allocated in runs that are as long as possible, so that a
+ * file's data stays contiguous in the image: the whole range is tried first
+ * and the run length is halved whenever no free run of that length exists.
+ * The single indirect block is allocated when the first indirect pointer is
+ * needed. The contents of the new blocks are NOT initialized and i_size is
+ * not changed. Nothing is allocated on failure.
+ *
+ * @param fs       file system context.
+ * @param ino      pointer to the inode of the file.
+ * @param nblocks  number of blocks to add.
+ * @return         0 on success; -ENOSPC if out of free blocks;
+ *                 -EFBIG if the file would exceed the maximum size.
+ */
+int
+inode_add_blocks(fs_ctx* fs, vsfs_inode* ino, uint32_t nblocks);
+
+/**
+ * Allocate and initialize a new inode. No lock is needed: the inode is not
+ * reachable until it is added to a directory.
+ *
+ * @param fs     file system context.
+ * @param mode   file mode, including the file type.
+ * @param ino    pointer to the variable that receives the inode number.
+ * @return       0 on success; -ENOSPC if out of free inodes.
+ */
+int
+inode_alloc(fs_ctx* fs, mode_t mode, vsfs_ino_t* ino);
+
+/**
+ * Free an inode and all of its data blocks. The caller must hold the inode
+ * write lock, or the inode must not be reachable yet. With the mmap engine,
+ * the free hint (-o free_hint) is applied to the pages of the data blocks
+ * first.
+ *
+ * @param fs     file system context.
+ * @param ino    inode number.
+ */
+void
+inode_free(fs_ctx* fs, vsfs_ino_t ino);
+
+/**
+ * Free an inode if it has no links left, it is not open (fs->nopen) and the
+ * kernel holds no references to it (fs->nlookup; only tracked by the
+ * inode-based backend). Otherwise the inode stays allocated until the last
+ * reference is dropped.
+ *
+ * @param fs     file system context.
+ * @param ino    inode number.
+ * @return       true if the inode was freed.
+ */
+bool
+inode_release(fs_ctx* fs, vsfs_ino_t ino);
+
+/**
+ * Change the size of a file. If the file is extended, the new range is
+ * filled with zeros.
+ *
+ * @param fs    file system context.
+ * @param ino   pointer to the inode of the file.
+ * @param size  new file size in bytes.
+ * @return      0 on success; -ENOSPC if out of free blocks; -EFBIG if the
+ *              size exceeds the maximum file size.
+ */
+int
+inode_truncate(fs_ctx* fs, vsfs_inode* ino, off_t size);
+
+/**
+ * Read data from a file. The byte range can span any number of blocks.
+ *
+ * @param fs      file system context.
+ * @param ino     pointer to the inode of the file.
+ * @param buf     pointer to the buffer that receives the data.
+ * @param size    number of bytes requested.
+ * @param offset  offset from the beginning of the file to read from.
+ * @return        number of bytes read; less than size only at EOF; -errno
+ *                if the data could not be read from the image file.
+ */
+ssize_t
+inode_read(fs_ctx* fs, vsfs_inode* ino, void* buf, size_t size, off_t offset);
+
+/**
+ * Describe a byte range of a file as buffers that point into the image file
+ * (fs->image_fd), one per physically contiguous run of blocks. The data is
+ * not copied: FUSE moves it to the kernel straight from the image file, with
+ * splice() if the kernel supports it. Without the image descriptor, with a
+ * journal (see journal.h), with the pread I/O engine (see bdev.h) or with
+ * fs->copy_reads set, a single memory buffer with a copy of the data is
+ * returned instead.
+ *
+ * The buffers stay valid only as long as the file is not truncated, so the
+ * reply should be sent before the inode lock is released; callers that
+ * can't do that while other threads run must set fs->copy_reads.
+ *
+ * @param fs      file system context.
+ * @param ino     pointer to the inode of the file.
+ * @param size    number of bytes requested.
+ * @param offset  offset from the beginning of the file to read from.
+ * @param bufp    pointer to the variable that receives the buffer vector;
+ *                it (and any memory buffer in it) must be freed with free().
+ * @return        0 on success; -ENOMEM if out of memory; -errno if the data
+ *                could not be read from the image file.
+ */
+int
+inode_read_buf(fs_ctx* fs, vsfs_inode* ino, size_t size, off_t offset,
+               struct fuse_bufvec** bufp);
+
+/**
+ * Start reading a byte range of a file in ahead of a read: the blocks are
+ * loaded into the block cache with the pread and uring engines (see bdev.h),
+ * and with the mmap engine the stream hint (-o stream_hint) is applied to
+ * the mapped pages, which by default has the kernel read them in in the
+ * background. The range is clipped to the file; nothing is done if the
+ * inode is no longer a regular file.
+ *
+ * @param fs      file system context.
+ * @param ino     pointer to the inode of the file.
+ * @param offset  offset from the beginning of the file.
+ * @param size    number of bytes.
+ * @return        0 on success; -errno if the blocks could not be read.
+ */
+int
+inode_prefetch(fs_ctx* fs, vsfs_inode* ino, uint64_t offset, size_t size);
+
+/**
+ * Write data to a file, extending it (and zero-filling any hole) if the
+ * range ends past EOF. Updates the modification time. On error, the file is
+ * no longer than before or than the data written.
+ *
+ * @param fs      file system context.
+ * @param ino     pointer to the inode of the file.
+ * @param buf     pointer to the data.
+ * @param size    number of bytes to write.
+ * @param offset  offset from the beginning of the file to write to.
+ * @return        0 on success; -errno on error (see inode_truncate()), or if
+ *                partly overwritten blocks could not be read in.
+ */
+int
+inode_write(fs_ctx* fs, vsfs_inode* ino, const void* buf, size_t size,
+            off_t offset);
+
+/**
+ * Write data from FUSE buffers to a file, extending it (and zero-filling any
+ * hole) if the range ends past EOF. Updates the modification time. After a
+ * short write, the file ends at the data written, unless it was longer.
+ *
+ * Each physically contiguous run of blocks is filled with one
+ * fuse_buf_copy(). Data that FUSE left in its pipe is spliced into the image
+ * file (fs->image_fd) without passing through userspace; data in memory is
+ * copied directly into the mapped image. With a journal or the pread I/O
+ * engine, all data is copied into memory.
+ *
+ * @param fs      file system context.
+ * @param ino     pointer to the inode of the file.
+ * @param buf     pointer to the source buffers; advanced past the data
+ *                written.
+ * @param offset  offset from the beginning of the file to write to.
+ * @return        number of bytes written on success; -errno on error (see
+ *                inode_truncate()), or the error of the buffer copy if
+ *                nothing was written.
+ */
+ssize_t
+inode_write_buf(fs_ctx* fs, vsfs_inode* ino, struct fuse_bufvec* buf,
+                off_t offset);
+
+/**
+ * Write back a file to disk and wait for it to complete: its data blocks,
+ * its indirect or extent blocks, its inode, and the superblock and bitmaps.
+ * Only dirty pages are actually written. Used for fsync() with
+ * -o durability=fsync; see flush.h.
+ *
+ * @param fs   file system context.
+ * @param ino  inode number of the file or directory.
+ * @return     0 on success; -errno on error (see bdev_flush()).
+ */
+int
+inode_sync(fs_ctx* fs, vsfs_ino_t ino);
+
+/**
+ * Fill in a struct stat for an inode. st_ino is the vsfs inode number.
+ *
+ * @param fs     file system context.
+ * @param ino    inode number.
+ * @param st     pointer to the struct stat that receives the result.
+ */
+void
+inode_stat(fs_ctx* fs, vsfs_ino_t ino, struct stat* st);
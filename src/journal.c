@@ -0,0 +1,897 @@
+/**
+ * Metadata write-ahead journal implementation.
+ */
+
+#define _GNU_SOURCE // pthread_rwlockattr_setkind_np()
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "journal.h"
+#include "util.h"
+#include "writeback.h"
+
+/** Number of bits in a dirty bitmap word. */
+#define WORD_BITS (sizeof(bitmap_t) * CHAR_BIT)
+
+// Even the smallest journal must fit an operation and the superblock
+static_assert(VSFS_JOURNAL_MIN / 2 > VSFS_JOURNAL_OP_BLOCKS + 1,
+              "journal too small for an operation");
+
+/** Initial value of a transaction checksum (64-bit FNV-1a). */
+#define CHECKSUM_SEED 0xcbf29ce484222325ul
+
+/** The dirty blocks of a transaction, taken by a commit. */
+typedef struct txn
+{
+  /** Home block numbers of the logged metadata blocks, ascending. */
+  vsfs_blk_t* meta;
+  uint32_t nmeta;
+  /**
+   * What is written to the journal: each descriptor block followed by the
+   * copies of the blocks it lists, and the commit block.
+   */
+  void* log;
+  uint32_t nlog;
+  /** File data blocks to write in place, ascending. */
+  vsfs_blk_t* data;
+  uint32_t ndata;
+
+} txn;
+
+/** Get a pointer to a block of the journal in the mapped image. */
+static void*
+jblock(fs_ctx* fs, uint32_t pos)
+{
+  return fs->image + (size_t)(fs->journal.start + pos) * VSFS_BLOCK_SIZE;
+}
+
+/** Add a buffer to a checksum, 8 bytes at a time. */
+static uint64_t
+checksum(uint64_t sum, const void* buf, size_t len)
+{
+  const unsigned char* p = buf;
+  for (size_t i = 0; i < len; i += sizeof(uint64_t)) {
+    uint64_t w = 0;
+    memcpy(&w, p + i, (len - i < sizeof(w)) ? len - i : sizeof(w));
+    sum = (sum ^ w) * 0x100000001b3ul;
+  }
+  return sum;
+}
+
+/** Position of the copy of the i-th logged block in a transaction. */
+static uint32_t
+log_pos(uint32_t i)
+{
+  return (i / VSFS_JOURNAL_DESC_MAX) * (VSFS_JOURNAL_DESC_MAX + 1) + 1 +
+         i % VSFS_JOURNAL_DESC_MAX;
+}
+
+/** Get a pointer to a block of the log of a transaction. */
+static void*
+log_block(txn* t, uint32_t pos)
+{
+  return t->log + (size_t)pos * VSFS_BLOCK_SIZE;
+}
+
+/** Set the dirty bit of a block; counts the bits that were not set yet. */
+static void
+mark_block(bitmap_t* bm, uint32_t* count, vsfs_blk_t blk)
+{
+  bitmap_t* w = &bm[blk / WORD_BITS];
+  bitmap_t bit = (bitmap_t)1 << (blk % WORD_BITS);
+
+  // Blocks are usually dirtied many times per commit; don't write the word
+  if (__atomic_load_n(w, __ATOMIC_RELAXED) & bit) return;
+  if (!(__atomic_fetch_or(w, bit, __ATOMIC_RELAXED) & bit)) {
+    __atomic_add_fetch(count, 1, __ATOMIC_RELAXED);
+  }
+}
+
+/** Set the dirty bits of the blocks that contain a byte range. */
+static void
+mark_range(fs_ctx* fs, bitmap_t* bm, uint32_t* count, const void* addr,
+           size_t len)
+{
+  size_t off = (const char*)addr - (const char*)fs->image;
+  vsfs_blk_t last = (off + len - 1) / VSFS_BLOCK_SIZE;
+  for (vsfs_blk_t b = off / VSFS_BLOCK_SIZE; b <= last; b++) {
+    mark_block(bm, count, b);
+  }
+}
+
+void
+journal_dirty_meta(fs_ctx* fs, const void* addr, size_t len)
+{
+  fs_journal* j = &fs->journal;
+  if (!j->enabled) {
+    writeback_dirty(fs, addr, len);
+    return;
+  }
+  if (len == 0) return;
+  mark_range(fs, j->dirty_meta, &j->ndirty_meta, addr, len);
+}
+
+void
+journal_dirty_data(fs_ctx* fs, const void* addr, size_t len)
+{
+  fs_journal* j = &fs->journal;
+  if (!j->enabled) {
+    writeback_dirty(fs, addr, len);
+    return;
+  }
+  if (len == 0) return;
+  mark_range(fs, j->dirty_data, &j->ndirty_data, addr, len);
+}
+
+/** Set the dirty bits of a list of blocks again after a failed commit. */
+static void
+mark_list(bitmap_t* bm, uint32_t* count, const vsfs_blk_t* list, uint32_t n)
+{
+  for (uint32_t i = 0; i < n; i++) {
+    mark_block(bm, count, list[i]);
+  }
+}
+
+/**
+ * Move the set bits of a dirty bitmap into an ascending list of block
+ * numbers. Only called while no operation is in progress.
+ */
+static int
+take_dirty(fs_ctx* fs, bitmap_t* bm, uint32_t* count, vsfs_blk_t** list,
+           uint32_t* n)
+{
+  uint32_t nwords = div_round_up(fs->sb->num_blocks, WORD_BITS);
+  uint32_t total = 0;
+  for (uint32_t w = 0; w < nwords; w++) {
+    total += __builtin_popcountl(bm[w]);
+  }
+
+  *list = malloc((total ? total : 1) * sizeof(vsfs_blk_t));
+  if (*list == NULL) return -ENOMEM;
+
+  uint32_t k = 0;
+  for (uint32_t w = 0; w < nwords; w++) {
+    for (bitmap_t word = bm[w]; word != 0; word &= word - 1) {
+      (*list)[k++] = w * WORD_BITS + __builtin_ctzl(word);
+    }
+    bm[w] = 0;
+  }
+  *n = total;
+  __atomic_store_n(count, 0, __ATOMIC_RELAXED);
+  return 0;
+}
+
+/** Free the lists and the log of a transaction. */
+static void
+txn_free(txn* t)
+{
+  free(t->meta);
+  free(t->data);
+  free(t->log);
+}
+
+/**
+ * Take the dirty blocks for a transaction and copy the metadata blocks into
+ * its log. Must be called while no operation is in progress.
+ */
+static int
+txn_snapshot(fs_ctx* fs, txn* t)
+{
+  fs_journal* j = &fs->journal;
+  memset(t, 0, sizeof(*t));
+
+  // The superblock goes with every transaction that changes metadata, with
+  // the free counters of the slots folded into it
+  fs_ctx_fold_counters(fs);
+  if (__atomic_load_n(&j->ndirty_meta, __ATOMIC_RELAXED) > 0) {
+    journal_dirty_meta(fs, fs->sb, sizeof(*fs->sb));
+  }
+
+  int err = take_dirty(fs, j->dirty_meta, &j->ndirty_meta, &t->meta, &t->nmeta);
+  if (err < 0) return err;
+  err = take_dirty(fs, j->dirty_data, &j->ndirty_data, &t->data, &t->ndata);
+  if (err < 0) goto fail;
+
+  // A data block that became metadata is logged instead; it must not be
+  // written in place before the transaction is committed
+  uint32_t n = 0;
+  for (uint32_t i = 0, m = 0; i < t->ndata; i++) {
+    while (m < t->nmeta && t->meta[m] < t->data[i]) m++;
+    if (m == t->nmeta || t->meta[m] != t->data[i]) {
+      t->data[n++] = t->data[i];
+    }
+  }
+  t->ndata = n;
+  if (t->nmeta == 0) return 0;
+
+  t->nlog = t->nmeta + div_round_up(t->nmeta, VSFS_JOURNAL_DESC_MAX) + 1;
+  if (posix_memalign(&t->log, VSFS_BLOCK_SIZE,
+                     (size_t)t->nlog * VSFS_BLOCK_SIZE) != 0) {
+    t->log = NULL;
+    err = -ENOMEM;
+    goto fail;
+  }
+  for (uint32_t i = 0; i < t->nmeta; i++) {
+    void* home = fs->image + (size_t)t->meta[i] * VSFS_BLOCK_SIZE;
+    // statfs() may fold the counters at any time
+    if (t->meta[i] == VSFS_SB_BLKNUM) pthread_spin_lock(&fs->sb_lock);
+    memcpy(log_block(t, log_pos(i)), home, VSFS_BLOCK_SIZE);
+    if (t->meta[i] == VSFS_SB_BLKNUM) pthread_spin_unlock(&fs->sb_lock);
+  }
+  return 0;
+
+fail:
+  mark_list(j->dirty_meta, &j->ndirty_meta, t->meta, t->nmeta);
+  mark_list(j->dirty_data, &j->ndirty_data, t->data, t->ndata);
+  txn_free(t);
+  return err;
+}
+
+/** Fill in the descriptor and commit blocks of a transaction. */
+static void
+txn_seal(txn* t, uint64_t seq)
+{
+  uint64_t sum = CHECKSUM_SEED;
+  for (uint32_t i = 0; i < t->nmeta; i += VSFS_JOURNAL_DESC_MAX) {
+    vsfs_journal_block* desc = log_block(t, log_pos(i) - 1);
+    uint32_t count = t->nmeta - i;
+    if (count > VSFS_JOURNAL_DESC_MAX) count = VSFS_JOURNAL_DESC_MAX;
+
+    memset(desc, 0, VSFS_BLOCK_SIZE);
+    desc->magic = VSFS_JOURNAL_MAGIC;
+    desc->seq = seq;
+    desc->type = VSFS_JOURNAL_DESC;
+    desc->count = count;
+    memcpy(desc->blocks, t->meta + i, count * sizeof(vsfs_blk_t));
+
+    sum = checksum(sum, desc->blocks, count * sizeof(vsfs_blk_t));
+    sum = checksum(sum, log_block(t, log_pos(i)),
+                   (size_t)count * VSFS_BLOCK_SIZE);
+  }
+
+  vsfs_journal_block* commit = log_block(t, t->nlog - 1);
+  memset(commit, 0, VSFS_BLOCK_SIZE);
+  commit->magic = VSFS_JOURNAL_MAGIC;
+  commit->seq = seq;
+  commit->type = VSFS_JOURNAL_COMMIT;
+  commit->count = t->nmeta;
+  commit->checksum = sum;
+}
+
+/** pwritev() the whole of an I/O vector, which is consumed. */
+static int
+writev_full(int fd, struct iovec* iov, int cnt, off_t off)
+{
+  while (cnt > 0) {
+    ssize_t n = pwritev(fd, iov, cnt, off);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return -errno;
+    }
+    off += n;
+    while (cnt > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      cnt--;
+    }
+    if (cnt > 0) {
+      iov->iov_base = (char*)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Write a list of blocks to their home locations, one pwritev() per run of
+ * consecutive block numbers. The contents come from the log of t, or from
+ * the mapped image if t is NULL.
+ */
+static int
+write_home(fs_ctx* fs, txn* t, const vsfs_blk_t* list, uint32_t n)
+{
+  struct iovec iov[IOV_MAX];
+
+  for (uint32_t i = 0; i < n;) {
+    int cnt = 0;
+    do {
+      size_t home = (size_t)list[i + cnt] * VSFS_BLOCK_SIZE;
+      iov[cnt].iov_base = t ? log_block(t, log_pos(i + cnt))
+                            : fs->image + home;
+      iov[cnt].iov_len = VSFS_BLOCK_SIZE;
+      cnt++;
+    } while (i + cnt < n && cnt < IOV_MAX &&
+             list[i + cnt] == list[i] + (vsfs_blk_t)cnt);
+
+    int err = writev_full(fs->image_fd, iov, cnt,
+                          (off_t)list[i] * VSFS_BLOCK_SIZE);
+    if (err < 0) return err;
+    i += cnt;
+  }
+  return 0;
+}
+
+/**
+ * Wait for all blocks written in place to reach the disk, then mark the
+ * journal empty, so that the transactions in it are never replayed.
+ */
+static int
+journal_reset(fs_ctx* fs)
+{
+  fs_journal* j = &fs->journal;
+  if (fdatasync(fs->image_fd) < 0) return -errno;
+  j->unsynced = false;
+
+  memset(j->hdr, 0, VSFS_BLOCK_SIZE);
+  j->hdr->magic = VSFS_JOURNAL_MAGIC;
+  j->hdr->seq = j->seq;
+  j->hdr->type = VSFS_JOURNAL_HEADER;
+
+  struct iovec iov = { .iov_base = j->hdr, .iov_len = VSFS_BLOCK_SIZE };
+  int err = writev_full(fs->image_fd, &iov, 1,
+                        (off_t)j->start * VSFS_BLOCK_SIZE);
+  if (err < 0) return err;
+  if (fdatasync(fs->image_fd) < 0) return -errno;
+  j->head = 1;
+  memset(j->logged, 0,
+         div_round_up(fs->sb->num_blocks, WORD_BITS) * sizeof(bitmap_t));
+  return 0;
+}
+
+/**
+ * Check if a transaction writes a block in place as file data that has a
+ * copy in the journal, e.g. a directory block that was logged, freed and
+ * reused for a file.
+ */
+static bool
+txn_reuses_logged(fs_ctx* fs, const txn* t)
+{
+  for (uint32_t i = 0; i < t->ndata; i++) {
+    vsfs_blk_t blk = t->data[i];
+    bitmap_t bit = (bitmap_t)1 << (blk % WORD_BITS);
+    if (fs->journal.logged[blk / WORD_BITS] & bit) return true;
+  }
+  return false;
+}
+
+/** Write a transaction to the journal and wait for it to reach the disk. */
+static int
+txn_log(fs_ctx* fs, txn* t)
+{
+  fs_journal* j = &fs->journal;
+
+  // Can't happen: journal_begin() keeps transactions within capacity.
+  // Writing the metadata in place unlogged could tear it in a crash.
+  if (t->nmeta > j->capacity) {
+    fprintf(stderr, "Transaction of %u blocks doesn't fit in the journal\n",
+            t->nmeta);
+    return -ENOSPC;
+  }
+  if (t->nlog > j->len - j->head) {
+    int err = journal_reset(fs);
+    if (err < 0) return err;
+  }
+
+  txn_seal(t, j->seq);
+  struct iovec iov = {
+    .iov_base = t->log,
+    .iov_len = (size_t)t->nlog * VSFS_BLOCK_SIZE,
+  };
+  int err = writev_full(fs->image_fd, &iov, 1,
+                        (off_t)(j->start + j->head) * VSFS_BLOCK_SIZE);
+  if (err < 0) return err;
+  if (fdatasync(fs->image_fd) < 0) return -errno;
+
+  j->head += t->nlog;
+  j->seq++;
+  for (uint32_t i = 0; i < t->nmeta; i++) {
+    vsfs_blk_t blk = t->meta[i];
+    j->logged[blk / WORD_BITS] |= (bitmap_t)1 << (blk % WORD_BITS);
+  }
+  return 0;
+}
+
+/**
+ * Drop the private copies of the pages of a list of blocks that have not
+ * changed again since they were written in place. Must be called while no
+ * operation is in progress.
+ */
+static void
+release_list(fs_ctx* fs, const vsfs_blk_t* list, uint32_t n)
+{
+  fs_journal* j = &fs->journal;
+  for (uint32_t i = 0; i < n;) {
+    uint32_t cnt = 0;
+    while (i + cnt < n && list[i + cnt] == list[i] + cnt) {
+      vsfs_blk_t blk = list[i + cnt];
+      bitmap_t bit = (bitmap_t)1 << (blk % WORD_BITS);
+      // statfs() may fold the counters into the superblock at any time
+      if (blk == VSFS_SB_BLKNUM ||
+          ((j->dirty_meta[blk / WORD_BITS] | j->dirty_data[blk / WORD_BITS]) &
+           bit)) {
+        break;
+      }
+      cnt++;
+    }
+    if (cnt > 0) {
+      madvise(fs->image + (size_t)list[i] * VSFS_BLOCK_SIZE,
+              (size_t)cnt * VSFS_BLOCK_SIZE, MADV_DONTNEED);
+    }
+    i += (cnt > 0) ? cnt : 1;
+  }
+}
+
+/**
+ * With the mmap engine, drop the private copies of the blocks a commit has
+ * written in place, so that a journaled mount doesn't keep every page it
+ * ever changed as anonymous memory. The image file has the same contents
+ * (in the page cache, if not on disk yet), and they are read back from it
+ * the next time the blocks are used. Blocks that changed again keep their
+ * copies until a later commit.
+ */
+static void
+txn_release(fs_ctx* fs, const txn* t)
+{
+  fs_journal* j = &fs->journal;
+  if (fs->dev.cached || sysconf(_SC_PAGESIZE) != VSFS_BLOCK_SIZE) return;
+  if (t->nmeta + t->ndata == 0) return;
+
+  pthread_rwlock_wrlock(&j->op_lock);
+  release_list(fs, t->meta, t->nmeta);
+  release_list(fs, t->data, t->ndata);
+  pthread_rwlock_unlock(&j->op_lock);
+}
+
+int
+journal_commit(fs_ctx* fs, bool wait)
+{
+  fs_journal* j = &fs->journal;
+  if (!j->enabled) return 0;
+
+  pthread_mutex_lock(&j->commit_lock);
+  pthread_rwlock_wrlock(&j->op_lock);
+  // Numbered while no operation is in progress, so that every operation
+  // that completed before journal_sync() read nstarted is in this commit
+  // or an earlier one
+  pthread_mutex_lock(&j->lock);
+  uint64_t n = ++j->nstarted;
+  wait = wait || j->sync_wanted;
+  j->sync_wanted = false;
+  pthread_mutex_unlock(&j->lock);
+  txn t;
+  int err = txn_snapshot(fs, &t);
+  pthread_rwlock_unlock(&j->op_lock);
+
+  if (err == 0) {
+    // Ordered mode: file data is on disk before the metadata that points
+    // to it is committed, so that after a crash no committed inode points
+    // to blocks that still hold a deleted file's contents. There are no
+    // revoke records: a block that was logged is only reused for data once
+    // the journal is empty, or replay would write the old copy over it.
+    if (txn_reuses_logged(fs, &t)) {
+      err = journal_reset(fs);
+    }
+    if (err == 0) {
+      err = write_home(fs, NULL, t.data, t.ndata);
+    }
+    if (err == 0 && t.ndata > 0 && t.nmeta > 0) {
+      if (fdatasync(fs->image_fd) < 0) {
+        err = -errno;
+      } else {
+        j->unsynced = false;
+      }
+    }
+    if (err == 0 && t.nmeta > 0) {
+      err = txn_log(fs, &t);
+    }
+    if (err == 0) {
+      err = write_home(fs, &t, t.meta, t.nmeta);
+    }
+    if (err == 0 && t.nmeta + t.ndata > 0) {
+      j->unsynced = true;
+    }
+    if (err == 0 && wait && j->unsynced) {
+      if (fdatasync(fs->image_fd) < 0) {
+        err = -errno;
+      } else {
+        j->unsynced = false;
+      }
+    }
+
+    if (err < 0) {
+      mark_list(j->dirty_meta, &j->ndirty_meta, t.meta, t.nmeta);
+      mark_list(j->dirty_data, &j->ndirty_data, t.data, t.ndata);
+    } else {
+      txn_release(fs, &t);
+    }
+    txn_free(&t);
+  }
+
+  pthread_mutex_lock(&j->lock);
+  j->nfinished = n;
+  if (err < 0) {
+    j->error = err;
+  } else if (wait) {
+    j->nsynced = n;
+  }
+  pthread_cond_broadcast(&j->done);
+  pthread_mutex_unlock(&j->lock);
+  pthread_mutex_unlock(&j->commit_lock);
+  return err;
+}
+
+int
+journal_sync(fs_ctx* fs)
+{
+  fs_journal* j = &fs->journal;
+  if (!j->enabled) return 0;
+
+  pthread_mutex_lock(&j->lock);
+  if (!j->running) {
+    pthread_mutex_unlock(&j->lock);
+    return journal_commit(fs, true);
+  }
+  // Any commit numbered after now has all our changes; callers that arrive
+  // while a commit is in progress share the next one
+  uint64_t target = j->nstarted + 1;
+  j->sync_wanted = true;
+  pthread_cond_signal(&j->wake);
+  while (j->nfinished < target) {
+    pthread_cond_wait(&j->done, &j->lock);
+  }
+  int err = (j->nsynced >= target) ? 0 : j->error;
+  pthread_mutex_unlock(&j->lock);
+  return err;
+}
+
+void
+journal_begin(fs_ctx* fs)
+{
+  fs_journal* j = &fs->journal;
+  if (!j->enabled) return;
+
+  // Keep a transaction well within the journal. The commit thread normally
+  // gets there first; this only holds back operations it can't keep up
+  // with.
+  if (__atomic_load_n(&j->ndirty_meta, __ATOMIC_RELAXED) >= (j->len - 1) / 4 ||
+      __atomic_load_n(&j->ndirty_data, __ATOMIC_RELAXED) >=
+        VSFS_JOURNAL_MAX_DATA) {
+    journal_commit(fs, false);
+  }
+
+  // A transaction must always fit, however many operations are in progress
+  // when it is committed: each one reserves room for as many metadata
+  // blocks as it can dirty, and if there is not enough left (with the
+  // superblock), it waits for a commit. Blocks of operations in progress
+  // are counted twice, dirty and reserved, which only errs on the safe side.
+  for (;;) {
+    pthread_rwlock_rdlock(&j->op_lock);
+    uint32_t reserved = __atomic_add_fetch(&j->reserved, VSFS_JOURNAL_OP_BLOCKS,
+                                           __ATOMIC_RELAXED);
+    if (__atomic_load_n(&j->ndirty_meta, __ATOMIC_RELAXED) + reserved + 1 <=
+        j->capacity) {
+      return;
+    }
+    __atomic_sub_fetch(&j->reserved, VSFS_JOURNAL_OP_BLOCKS, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&j->op_lock);
+    journal_commit(fs, false);
+  }
+}
+
+void
+journal_end(fs_ctx* fs)
+{
+  fs_journal* j = &fs->journal;
+  if (!j->enabled) return;
+  __atomic_sub_fetch(&j->reserved, VSFS_JOURNAL_OP_BLOCKS, __ATOMIC_RELAXED);
+  pthread_rwlock_unlock(&j->op_lock);
+
+  // Dirty blocks can't be evicted from a limited block cache until they are
+  // committed, so don't let them fill it up
+  uint32_t max_data = VSFS_JOURNAL_MAX_DATA / 2;
+  if (fs->cache.capacity > 0 && fs->cache.capacity / 4 < max_data) {
+    max_data = fs->cache.capacity / 4;
+  }
+
+  // Wake up the commit thread once enough has piled up, but only once per
+  // commit: operations don't touch the thread's lock otherwise
+  if ((__atomic_load_n(&j->ndirty_meta, __ATOMIC_RELAXED) >= j->threshold ||
+       __atomic_load_n(&j->ndirty_data, __ATOMIC_RELAXED) >= max_data) &&
+      !__atomic_load_n(&j->kicked, __ATOMIC_RELAXED) &&
+      !__atomic_exchange_n(&j->kicked, true, __ATOMIC_RELAXED)) {
+    pthread_mutex_lock(&j->lock);
+    pthread_cond_signal(&j->wake);
+    pthread_mutex_unlock(&j->lock);
+  }
+}
+
+// Commit thread: commit every interval ms, or earlier when woken up by
+// journal_end() or journal_sync(), until journal_stop() clears running
+static void*
+journal_main(void* arg)
+{
+  fs_ctx* fs = (fs_ctx*)arg;
+  fs_journal* j = &fs->journal;
+  bool periodic = (fs->durability == VSFS_DURABILITY_PERIODIC);
+
+  pthread_mutex_lock(&j->lock);
+  while (j->running) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += j->interval / 1000;
+    deadline.tv_nsec += (long)(j->interval % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+
+    int err = 0;
+    while (j->running && !__atomic_load_n(&j->kicked, __ATOMIC_RELAXED) &&
+           !j->sync_wanted && err != ETIMEDOUT) {
+      err = pthread_cond_timedwait(&j->wake, &j->lock, &deadline);
+    }
+    if (!j->running) break;
+    __atomic_store_n(&j->kicked, false, __ATOMIC_RELAXED);
+
+    // Don't stop operations for a snapshot of nothing; the periodic mode
+    // may still have home writes to wait for
+    bool idle = !periodic && !j->sync_wanted &&
+                __atomic_load_n(&j->ndirty_meta, __ATOMIC_RELAXED) == 0 &&
+                __atomic_load_n(&j->ndirty_data, __ATOMIC_RELAXED) == 0;
+    pthread_mutex_unlock(&j->lock);
+    if (!idle) {
+      journal_commit(fs, periodic);
+    }
+    pthread_mutex_lock(&j->lock);
+  }
+  pthread_mutex_unlock(&j->lock);
+  return NULL;
+}
+
+bool
+journal_start(fs_ctx* fs)
+{
+  fs_journal* j = &fs->journal;
+  if (!j->enabled) return true;
+
+  j->interval = (fs->durability == VSFS_DURABILITY_PERIODIC)
+                  ? fs->sync_interval
+                  : fs->commit_interval;
+  if (j->interval == 0) {
+    j->interval = VSFS_JOURNAL_INTERVAL;
+  }
+  // Above a quarter of the journal journal_begin() commits by itself
+  j->threshold = (j->len - 1) / 8;
+  if (fs->commit_blocks > 0) {
+    j->threshold = (fs->commit_blocks < (j->len - 1) / 4) ? fs->commit_blocks
+                                                          : (j->len - 1) / 4;
+  }
+
+  pthread_mutex_lock(&j->lock);
+  j->running = true;
+  if (pthread_create(&j->thread, NULL, journal_main, fs) != 0) {
+    j->running = false;
+  }
+  bool running = j->running;
+  pthread_mutex_unlock(&j->lock);
+  return running;
+}
+
+void
+journal_stop(fs_ctx* fs)
+{
+  fs_journal* j = &fs->journal;
+  if (!j->enabled) return;
+
+  pthread_mutex_lock(&j->lock);
+  bool running = j->running;
+  j->running = false;
+  pthread_cond_signal(&j->wake);
+  pthread_mutex_unlock(&j->lock);
+  if (running) {
+    pthread_join(j->thread, NULL);
+  }
+}
+
+/**
+ * Check a transaction in the journal that starts at block pos. Returns the
+ * position of its commit block; 0 if the transaction is incomplete or has a
+ * different sequence number.
+ */
+static uint32_t
+replay_check(fs_ctx* fs, uint32_t pos, uint64_t seq)
+{
+  fs_journal* j = &fs->journal;
+  uint64_t sum = CHECKSUM_SEED;
+  uint32_t nblocks = 0;
+
+  while (pos < j->len) {
+    const vsfs_journal_block* b = jblock(fs, pos);
+    if (b->magic != VSFS_JOURNAL_MAGIC || b->seq != seq) return 0;
+    if (b->type == VSFS_JOURNAL_COMMIT) {
+      return (b->count == nblocks && b->checksum == sum) ? pos : 0;
+    }
+    if (b->type != VSFS_JOURNAL_DESC || b->count == 0 ||
+        b->count > VSFS_JOURNAL_DESC_MAX || b->count >= j->len - pos) {
+      return 0;
+    }
+
+    for (uint32_t i = 0; i < b->count; i++) {
+      vsfs_blk_t home = b->blocks[i];
+      if (home >= fs->sb->num_blocks ||
+          (home >= j->start && home < j->start + j->len)) {
+        return 0;
+      }
+    }
+    sum = checksum(sum, b->blocks, b->count * sizeof(vsfs_blk_t));
+    sum = checksum(sum, jblock(fs, pos + 1),
+                   (size_t)b->count * VSFS_BLOCK_SIZE);
+    nblocks += b->count;
+    pos += 1 + b->count;
+  }
+  return 0;
+}
+
+/** Copy the blocks of a checked transaction to their home locations. */
+static void
+replay_apply(fs_ctx* fs, uint32_t pos, uint32_t end)
+{
+  while (pos < end) {
+    const vsfs_journal_block* b = jblock(fs, pos);
+    for (uint32_t i = 0; i < b->count; i++) {
+      bdev_fill(&fs->dev, b->blocks[i], 1);
+      memcpy(fs->image + (size_t)b->blocks[i] * VSFS_BLOCK_SIZE,
+             jblock(fs, pos + 1 + i), VSFS_BLOCK_SIZE);
+    }
+    pos += 1 + b->count;
+  }
+}
+
+/**
+ * Replay the committed transactions in the journal, in order, through the
+ * shared mapping of the image (or the pread engine's cache), then mark the
+ * journal empty.
+ */
+static int
+journal_replay(fs_ctx* fs)
+{
+  fs_journal* j = &fs->journal;
+  vsfs_journal_block* hdr = jblock(fs, 0);
+  if (hdr->magic != VSFS_JOURNAL_MAGIC || hdr->type != VSFS_JOURNAL_HEADER) {
+    fprintf(stderr, "Invalid journal header\n");
+    return -EINVAL;
+  }
+
+  uint64_t seq = hdr->seq;
+  uint32_t pos = 1;
+  uint32_t end;
+  while ((end = replay_check(fs, pos, seq)) != 0) {
+    replay_apply(fs, pos, end);
+    pos = end + 1;
+    seq++;
+  }
+  j->seq = seq;
+  j->head = 1;
+  if (seq == hdr->seq) return 0;
+
+  // The replayed blocks must be on disk before the journal is emptied
+  int err = bdev_flush(&fs->dev, 0, fs->dev.nblocks);
+  if (err < 0) return err;
+  hdr->seq = seq;
+  return bdev_flush(&fs->dev, j->start, 1);
+}
+
+bool
+journal_init(fs_ctx* fs)
+{
+  fs_journal* j = &fs->journal;
+  memset(j, 0, sizeof(*j));
+  if (!(fs->sb->features & VSFS_FEATURE_JOURNAL)) return true;
+
+  if (fs->image_fd < 0) {
+    fprintf(stderr, "The journal needs the image file to be open\n");
+    return false;
+  }
+  j->start = fs->sb->journal_blk;
+  j->len = fs->sb->journal_len;
+  if (j->len < VSFS_JOURNAL_MIN || j->start >= fs->sb->num_blocks ||
+      j->len > fs->sb->num_blocks - j->start) {
+    fprintf(stderr, "Invalid journal location\n");
+    return false;
+  }
+  // Room for the descriptor blocks and the commit block, after the header
+  j->capacity = j->len - 2;
+  while (j->capacity + div_round_up(j->capacity, VSFS_JOURNAL_DESC_MAX) + 1 >
+         j->len - 1) {
+    j->capacity--;
+  }
+
+  int err = journal_replay(fs);
+  if (err < 0) {
+    fprintf(stderr, "Failed to replay the journal: %s\n", strerror(-err));
+    return false;
+  }
+
+  // From now on, changes only reach the image file through commits. The
+  // pread engine only ever writes blocks back when asked to.
+  if (!fs->dev.cached &&
+      mmap(fs->image, fs->size, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_FIXED, fs->image_fd, 0) == MAP_FAILED) {
+    perror("mmap");
+    return false;
+  }
+
+  uint32_t nwords = div_round_up(fs->sb->num_blocks, WORD_BITS);
+  j->dirty_meta = calloc(nwords, sizeof(bitmap_t));
+  j->dirty_data = calloc(nwords, sizeof(bitmap_t));
+  j->logged = calloc(nwords, sizeof(bitmap_t));
+  void* hdr = NULL;
+  if (posix_memalign(&hdr, VSFS_BLOCK_SIZE, VSFS_BLOCK_SIZE) != 0) {
+    hdr = NULL;
+  }
+  j->hdr = hdr;
+  if (j->dirty_meta == NULL || j->dirty_data == NULL || j->logged == NULL ||
+      j->hdr == NULL) {
+    free(j->dirty_meta);
+    free(j->dirty_data);
+    free(j->logged);
+    free(j->hdr);
+    return false;
+  }
+
+  // Operations must not be able to hold off a commit indefinitely
+  pthread_rwlockattr_t attr;
+  pthread_rwlockattr_init(&attr);
+  pthread_rwlockattr_setkind_np(&attr,
+                                PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  pthread_rwlock_init(&j->op_lock, &attr);
+  pthread_rwlockattr_destroy(&attr);
+  pthread_mutex_init(&j->commit_lock, NULL);
+  pthread_mutex_init(&j->lock, NULL);
+  pthread_cond_init(&j->wake, NULL);
+  pthread_cond_init(&j->done, NULL);
+  // Until journal_start(), only journal_begin() commits by itself
+  j->threshold = UINT32_MAX;
+
+  j->enabled = true;
+  return true;
+}
+
+void
+journal_destroy(fs_ctx* fs)
+{
+  fs_journal* j = &fs->journal;
+  if (!j->enabled) return;
+
+  // Nothing reaches the image file but through commits
+  int err = journal_commit(fs, true);
+  if (err == 0) {
+    err = journal_reset(fs);
+  }
+  if (err < 0) {
+    fprintf(stderr, "Failed to commit the journal: %s\n", strerror(-err));
+  }
+
+  j->enabled = false;
+  free(j->dirty_meta);
+  free(j->dirty_data);
+  free(j->logged);
+  free(j->hdr);
+  j->dirty_meta = NULL;
+  j->dirty_data = NULL;
+  j->logged = NULL;
+  j->hdr = NULL;
+  pthread_rwlock_destroy(&j->op_lock);
+  pthread_mutex_destroy(&j->commit_lock);
+  pthread_mutex_destroy(&j->lock);
+  pthread_cond_destroy(&j->wake);
+  pthread_cond_destroy(&j->done);
+}
@@ -0,0 +1,171 @@
+/**
+ * Metadata write-ahead journal header file.
+ *
+ * With a journal (mkfs -j), the image is mapped MAP_PRIVATE, so that nothing
+ * reaches the disk before it has been logged: a MAP_SHARED mapping can be
+ * written back by the kernel at any time. (The pread I/O engine never writes
+ * back on its own; see bdev.h.) Operations that change the image
+ * record the blocks they change in dirty bitmaps and are grouped into
+ * transactions; a commit
+ *   1. takes a snapshot of the dirty metadata blocks (superblock, bitmaps,
+ *      inode table, directory, indirect and extent blocks) while no
+ *      operation is in progress,
+ *   2. writes the dirty file data blocks in place and waits for them to
+ *      reach the disk (ordered mode),
+ *   3. writes the copies to the journal followed by a commit block and
+ *      waits for them to reach the disk,
+ *   4. writes the copies to their home locations,
+ *   5. with the mmap engine, drops the private copies of the pages it has
+ *      written, which are then read back from the image file when used.
+ * After a crash, committed transactions are replayed from the journal when
+ * the image is mounted, so the metadata is always consistent, and never
+ * points to file data that was not written yet; file data written since
+ * the last commit may be lost. The home writes of the metadata are only
+ * waited for when the journal fills up and has to be emptied.
+ *
+ * Commits are batched: operations never wait for the disk themselves. A
+ * background thread (see journal_start()) commits every commit_interval
+ * milliseconds, or as soon as commit_blocks metadata blocks are dirty, so
+ * that one journal write and flush covers many operations. fsync() in the
+ * fsync durability mode asks the thread for a commit and waits for it (see
+ * journal_sync()); concurrent callers share that commit. There is a final
+ * commit on unmount.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "fs_ctx.h"
+
+/**
+ * Number of dirty file data blocks after which the next operation commits
+ * first, since they are only written back by commits.
+ */
+#define VSFS_JOURNAL_MAX_DATA 4096
+
+/**
+ * Most metadata blocks a single operation dirties. The worst case is about
+ * half of it: the superblock, both bitmaps, the inode table blocks of a file
+ * and its directory, an indirect or extent block and the directory blocks
+ * that an entry is removed from or added to.
+ */
+#define VSFS_JOURNAL_OP_BLOCKS 16
+
+/** Default commit period of the commit thread in milliseconds. */
+#define VSFS_JOURNAL_INTERVAL 5000
+
+/**
+ * Replay the journal of the image, if it has one, and set up the journal
+ * state. With the mmap I/O engine, the image must still be mapped
+ * MAP_SHARED; it is remapped MAP_PRIVATE at the same address. Called by
+ * fs_ctx_init().
+ *
+ * @param fs  file system context; image, sb and image_fd must be set.
+ * @return    true on success; false on failure (e.g. no image descriptor).
+ */
+bool
+journal_init(fs_ctx* fs);
+
+/**
+ * Commit all changes, wait for them to reach the disk and empty the
+ * journal. Called by fs_ctx_destroy().
+ *
+ * @param fs  file system context.
+ */
+void
+journal_destroy(fs_ctx* fs);
+
+/**
+ * Start the commit thread. Its period is sync_interval in the periodic
+ * durability mode, where its commits also wait for the disk, and
+ * commit_interval otherwise; commit_blocks dirty metadata blocks wake it up
+ * early (see fs_ctx). Must be called after FUSE has daemonized, since
+ * threads don't survive fork(). Does nothing without a journal.
+ *
+ * @param fs  file system context.
+ * @return    true on success; false if the thread could not be started.
+ */
+bool
+journal_start(fs_ctx* fs);
+
+/**
+ * Stop the commit thread, if running. Changes that are not committed yet
+ * stay dirty.
+ *
+ * @param fs  file system context.
+ */
+void
+journal_stop(fs_ctx* fs);
+
+/**
+ * Start an operation that changes the image. Commits first if so many
+ * blocks are dirty that the commit thread is falling behind, or if the
+ * journal has no room left for the VSFS_JOURNAL_OP_BLOCKS the operation
+ * reserves. Must be called before taking any inode lock, and be paired with
+ * journal_end(). Does nothing without a journal.
+ *
+ * @param fs  file system context.
+ */
+void
+journal_begin(fs_ctx* fs);
+
+/**
+ * End an operation started with journal_begin(). Wakes up the commit thread
+ * if enough blocks are dirty.
+ *
+ * @param fs  file system context.
+ */
+void
+journal_end(fs_ctx* fs);
+
+/**
+ * Record a change to metadata in the image: the blocks that contain the
+ * byte range are logged by the next commit. Without a journal, the change
+ * is recorded for write-back instead (see writeback_dirty()).
+ *
+ * @param fs    file system context.
+ * @param addr  start of the changed range in the mapped image.
+ * @param len   length of the range in bytes.
+ */
+void
+journal_dirty_meta(fs_ctx* fs, const void* addr, size_t len);
+
+/**
+ * Record a change to file data in the image: the blocks that contain the
+ * byte range are written in place by the next commit. Without a journal,
+ * the change is recorded for write-back instead (see writeback_dirty()).
+ *
+ * @param fs    file system context.
+ * @param addr  start of the changed range in the mapped image.
+ * @param len   length of the range in bytes.
+ */
+void
+journal_dirty_data(fs_ctx* fs, const void* addr, size_t len);
+
+/**
+ * Commit all operations that have completed. Must not be called while
+ * holding an inode lock or inside journal_begin()/journal_end().
+ *
+ * @param fs    file system context.
+ * @param wait  also wait for the home locations and file data to reach the
+ *              disk, e.g. for fsync(); otherwise only the journal is.
+ * @return      0 on success; -errno on error, in which case the changes
+ *              stay dirty and are retried by the next commit.
+ */
+int
+journal_commit(fs_ctx* fs, bool wait);
+
+/**
+ * Commit all operations that have completed and wait for the disk, for
+ * fsync(). If the commit thread is running, the commit is left to it, so
+ * that callers that arrive at about the same time share a single commit;
+ * otherwise this is journal_commit(fs, true). Must not be called while
+ * holding an inode lock or inside journal_begin()/journal_end().
+ *
+ * @param fs  file system context.
+ * @return    0 on success; -errno on error.
+ */
+int
+journal_sync(fs_ctx* fs);
@@ -26,6 +26,10 @@ typedef struct mkfs_opts
   bool force;
   /** Zero out image contents. */
   bool zero;
+  /** Use the extent-based inode format for new files. */
+  bool extents;
+  /** Number of journal blocks; 0 for no journal. */
+  size_t n_journal;
 
 } mkfs_opts;
 
@@ -40,19 +44,21 @@ Options:\n\
     -h      print help and exit\n\
     -f      force format - overwrite existing vsfs file system\n\
     -z      zero out image contents\n\
+    -e      use extent-based inodes instead of direct/indirect pointers\n\
+    -j num  reserve num blocks for a metadata journal (at least %u)\n\
 ";
 
 static void
 print_help(FILE* f, const char* progname)
 {
-  fprintf(f, help_str, progname, VSFS_BLOCK_SIZE);
+  fprintf(f, help_str, progname, VSFS_BLOCK_SIZE, VSFS_JOURNAL_MIN);
 }
 
 static bool
 parse_args(int argc, char* argv[], mkfs_opts* opts)
 {
   char o;
-  while ((o = getopt(argc, argv, "i:hfvz")) != -1) {
+  while ((o = getopt(argc, argv, "i:hfvzej:")) != -1) {
     switch (o) {
       case 'i':
         opts->n_inodes = strtoul(optarg, NULL, 10);
@@ -67,6 +73,16 @@ parse_args(int argc, char* argv[], mkfs_opts* opts)
       case 'z':
         opts->zero = true;
         break;
+      case 'e':
+        opts->extents = true;
+        break;
+      case 'j':
+        opts->n_journal = strtoul(optarg, NULL, 10);
+        if (opts->n_journal < VSFS_JOURNAL_MIN) {
+          fprintf(stderr, "Invalid number of journal blocks\n");
+          return false;
+        }
+        break;
 
       case '?':
         return false;
@@ -165,12 +181,31 @@ mkfs(void* image, size_t size, mkfs_opts* opts)
   uint32_t ino_table_size = div_round_up(opts->n_inodes, inodes_per_block);
 	for (uint32_t i = 0; i < ino_table_size; i++) { bitmap_set(dbmap, nblks, VSFS_DMAP_BLKNUM + 1 + i, true); }
 
+  // The journal directly follows the inode table. Clear it, so that no
+  // transaction from an earlier file system in the image can be replayed.
+  vsfs_blk_t journal_blk = VSFS_ITBL_BLKNUM + ino_table_size;
+  if (journal_blk + opts->n_journal >= nblks) {
+    return false;
+  }
+  for (uint32_t i = 0; i < opts->n_journal; i++) {
+    bitmap_set(dbmap, nblks, journal_blk + i, true);
+  }
+  if (opts->n_journal > 0) {
+    memset(image + journal_blk * VSFS_BLOCK_SIZE, 0,
+           opts->n_journal * VSFS_BLOCK_SIZE);
+    vsfs_journal_block* jh = image + journal_blk * VSFS_BLOCK_SIZE;
+    jh->magic = VSFS_JOURNAL_MAGIC;
+    jh->seq = 1;
+    jh->type = VSFS_JOURNAL_HEADER;
+  }
+
   // Mark root directory inode allocated in inode bitmap
   bitmap_set(ibmap, opts->n_inodes, VSFS_ROOT_INO, true);
 
   // Initialize fields of root dir inode (the mtime is done for you)
   itable = (vsfs_inode*)(image + VSFS_ITBL_BLKNUM * VSFS_BLOCK_SIZE);
   root_ino = &itable[VSFS_ROOT_INO];
+  memset(root_ino, 0, sizeof(*root_ino));
 
   if (clock_gettime(CLOCK_REALTIME, &(root_ino->i_mtime)) != 0) {
     perror("clock_gettime");
@@ -186,12 +221,24 @@ mkfs(void* image, size_t size, mkfs_opts* opts)
   // Allocate a data block for root directory; record it in root inode
   // (void)root_entries;
 
-  if (bitmap_alloc(dbmap, nblks, &root_ino->i_direct[0]) == -1) { return false; }
+  vsfs_blk_t root_blk;
+  if (bitmap_alloc(dbmap, nblks, &root_blk) == -1) { return false; }
+
+  if (opts->extents) {
+    root_ino->i_flags = VSFS_INODE_EXTENTS;
+    root_ino->i_nextents = 1;
+    root_ino->i_extent_blk = 0;
+    root_ino->i_extents[0].e_lblk = 0;
+    root_ino->i_extents[0].e_start = root_blk;
+    root_ino->i_extents[0].e_len = 1;
+  } else {
+    root_ino->i_direct[0] = root_blk;
+  }
 
 
   // Create '.' and '..' entries in root dir data block.
 
-  root_entries = (vsfs_dentry *)(image + (root_ino->i_direct[0]) * VSFS_BLOCK_SIZE);
+  root_entries = (vsfs_dentry *)(image + root_blk * VSFS_BLOCK_SIZE);
   root_entries[0].ino = VSFS_ROOT_INO;
   strncpy(root_entries[0].name, ".", sizeof(root_entries[0].name));
   root_entries[1].ino = VSFS_ROOT_INO;
@@ -210,10 +257,21 @@ mkfs(void* image, size_t size, mkfs_opts* opts)
   sb->num_inodes = opts->n_inodes;
   sb->free_inodes = opts->n_inodes - 1;
   sb->num_blocks = nblks;
-  sb->free_blocks = sb->num_blocks - VSFS_DMAP_BLKNUM - ino_table_size - 2;
+  sb->free_blocks = sb->num_blocks - VSFS_DMAP_BLKNUM - ino_table_size - 2 -
+                    opts->n_journal;
 
-  // Set start of data region to first block after inode table.
-  sb->data_region = VSFS_ITBL_BLKNUM + ino_table_size;
+  // Set start of data region to first block after inode table and journal.
+  sb->data_region = journal_blk + opts->n_journal;
+
+  sb->features = opts->extents ? VSFS_FEATURE_EXTENTS : 0;
+  if (opts->n_journal > 0) {
+    sb->features |= VSFS_FEATURE_JOURNAL;
+    sb->journal_blk = journal_blk;
+    sb->journal_len = opts->n_journal;
+  } else {
+    sb->journal_blk = 0;
+    sb->journal_len = 0;
+  }
 
   ret = true;
 out:
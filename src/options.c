@@ -18,20 +18,155 @@
 
 static const struct fuse_opt opt_spec[] = { VSFS_OPT("-h", help),
                                             VSFS_OPT("--help", help),
+                                            VSFS_OPT("max_io=%u", max_io),
+                                            VSFS_OPT("multithreaded",
+                                                     multithreaded),
+                                            VSFS_OPT("lowlevel", lowlevel),
+                                            VSFS_OPT("attr_timeout=%lf",
+                                                     attr_timeout),
+                                            VSFS_OPT("entry_timeout=%lf",
+                                                     entry_timeout),
+                                            VSFS_OPT("negative_timeout=%lf",
+                                                     negative_timeout),
+                                            VSFS_OPT("kernel_cache",
+                                                     kernel_cache),
+                                            VSFS_OPT("durability=%s",
+                                                     durability_str),
+                                            VSFS_OPT("sync_interval=%u",
+                                                     sync_interval),
+                                            VSFS_OPT("commit_interval=%u",
+                                                     commit_interval),
+                                            VSFS_OPT("commit_blocks=%u",
+                                                     commit_blocks),
+                                            VSFS_OPT("writeback_interval=%u",
+                                                     writeback_interval),
+                                            VSFS_OPT("writeback_rate=%u",
+                                                     writeback_rate),
+                                            VSFS_OPT("io=%s", io_str),
+                                            VSFS_OPT("o_direct", o_direct),
+                                            VSFS_OPT("cache_size=%u",
+                                                     cache_size),
+                                            VSFS_OPT("readahead=%u",
+                                                     readahead),
+                                            VSFS_OPT("meta_hint=%s",
+                                                     meta_hint_str),
+                                            VSFS_OPT("stream_hint=%s",
+                                                     stream_hint_str),
+                                            VSFS_OPT("free_hint=%s",
+                                                     free_hint_str),
                                             FUSE_OPT_END };
 
+/** Default (and smallest) request size: a single block. */
+#define VSFS_MIN_IO 4096
+
+/** Default attribute and entry timeout in seconds; same as in FUSE. */
+#define VSFS_DEFAULT_TIMEOUT 1.0
+
+/** Default write-back period in milliseconds with -o durability=periodic. */
+#define VSFS_DEFAULT_SYNC_INTERVAL 1000
+
+/** Default readahead limit in KiB. */
+#define VSFS_DEFAULT_READAHEAD 256
+
+/** Names of the durability modes, indexed by vsfs_durability. */
+static const char* durability_names[] = { "async", "periodic", "fsync" };
+
+/** Names of the I/O engines, indexed by vsfs_io_engine. */
+static const char* io_names[] = { "mmap", "pread", "uring" };
+
+/** Names of the page cache hints, indexed by vsfs_hint. */
+static const char* hint_names[] = { "none",     "random", "sequential",
+                                    "willneed", "cold",   "dontneed" };
+
 static const char* help_str = "\
 Usage: %s image mountpoint [options]\n\
 \n\
 Mount vsfs image file under mount point directory. Use fusermount(1) to \n\
-unmount. Only single-threaded mount is supported; -s FUSE option is implied.\n\
+unmount. The mount is single-threaded (-s FUSE option is implied) unless\n\
+-o multithreaded is given.\n\
 \n\
 general options:\n\
     -o opt,[opt...]        mount options\n\
     -h   --help            print help\n\
 \n\
+vsfs options:\n\
+    -o max_io=N            max. size of a read or write request in bytes;\n\
+                           a multiple of 4096 (default: 4096). The kernel\n\
+                           may limit requests to 128 KiB regardless.\n\
+    -o multithreaded       serve requests from multiple threads\n\
+    -o lowlevel            use the inode-based low-level FUSE API\n\
+    -o attr_timeout=T      cache file attributes for T seconds (default: 1.0)\n\
+    -o entry_timeout=T     cache name lookups for T seconds (default: 1.0)\n\
+    -o negative_timeout=T  cache failed lookups for T seconds (default: 0.0)\n\
+    -o kernel_cache        keep cached file data across opens; only safe if\n\
+                           the image is not modified outside of this mount\n\
+    -o durability=MODE     when changes are written to disk: async (when\n\
+                           the kernel decides), periodic (every\n\
+                           sync_interval ms) or fsync (on every fsync() of\n\
+                           the file) (default: async)\n\
+    -o sync_interval=N     write-back period in ms with durability=periodic\n\
+                           (default: 1000)\n\
+    -o commit_interval=N   with a journal, commit at least every N ms\n\
+                           (default: 5000; sync_interval with\n\
+                           durability=periodic)\n\
+    -o commit_blocks=N     with a journal, commit early once N metadata\n\
+                           blocks are dirty (default: 1/8 of the journal)\n\
+    -o writeback_interval=N  without a journal, write back dirty blocks\n\
+                           at least every N ms (default: 5000)\n\
+    -o writeback_rate=N    without a journal, write back dirty blocks in\n\
+                           the background at most N MiB/s (default: no\n\
+                           limit)\n\
+    -o io=ENGINE           how the image file is accessed: mmap (mapped\n\
+                           into memory), pread (read and written in\n\
+                           blocks, cached by vsfs) or uring (like pread,\n\
+                           with many blocks in flight at a time through\n\
+                           io_uring) (default: mmap)\n\
+    -o o_direct            with io=pread or uring, bypass the kernel page\n\
+                           cache\n\
+    -o cache_size=N        with io=pread or uring, keep at most N MiB of\n\
+                           file data and directories in memory (default:\n\
+                           no limit)\n\
+    -o readahead=N         prefetch up to N KiB ahead of sequential reads\n\
+                           of a file; 0 to disable (default: 256)\n\
+    -o meta_hint=HINT      with io=mmap, page cache hint for the bitmaps\n\
+                           and the inode table: none, random, sequential\n\
+                           or willneed (default: random)\n\
+    -o stream_hint=HINT    with io=mmap, hint for the data prefetched\n\
+                           ahead of sequential reads: none, willneed or\n\
+                           sequential (default: willneed)\n\
+    -o free_hint=HINT      with io=mmap, hint for the blocks of deleted\n\
+                           files: none, cold or dontneed (default: cold)\n\
+\n\
 ";
 
+/**
+ * Parse a page cache hint option.
+ *
+ * @param name     option name, for error messages.
+ * @param str      hint name as given; NULL if the option was not given.
+ * @param allowed  bit mask of the hints allowed for the option.
+ * @param hint     receives the hint; left alone if str is NULL.
+ * @return         true on success; false if the hint is unknown or not
+ *                 allowed.
+ */
+static bool
+parse_hint(const char* name, const char* str, unsigned int allowed,
+           vsfs_hint* hint)
+{
+  if (str == NULL) return true;
+  size_t n = sizeof(hint_names) / sizeof(hint_names[0]);
+  size_t i = 0;
+  while (i < n && strcmp(str, hint_names[i]) != 0) {
+    i++;
+  }
+  if (i == n || !(allowed & (1u << i))) {
+    fprintf(stderr, "Invalid %s: %s\n", name, str);
+    return false;
+  }
+  *hint = (vsfs_hint)i;
+  return true;
+}
+
 // Callback for fuse_opt_parse()
 static int
 opt_proc(void* data, const char* arg, int key, struct fuse_args* out)
@@ -49,6 +184,9 @@ opt_proc(void* data, const char* arg, int key, struct fuse_args* out)
 bool
 vsfs_opt_parse(struct fuse_args* args, vsfs_opts* opts)
 {
+  opts->attr_timeout = VSFS_DEFAULT_TIMEOUT;
+  opts->entry_timeout = VSFS_DEFAULT_TIMEOUT;
+  opts->readahead = VSFS_DEFAULT_READAHEAD;
   if (fuse_opt_parse(args, opts, opt_spec, opt_proc) != 0)
     return false;
 
@@ -62,13 +200,106 @@ vsfs_opt_parse(struct fuse_args* args, vsfs_opts* opts)
     return false;
   }
 
-  // Only single-threaded mount is supported
-  fuse_opt_add_arg(args, "-s");
-  // Limit the size of reads and writes to 4K
-  fuse_opt_add_arg(args, "-o");
-  fuse_opt_add_arg(args, "max_read=4096");
+  if (opts->max_io == 0) {
+    opts->max_io = VSFS_MIN_IO;
+  }
+  if (opts->max_io % VSFS_MIN_IO != 0) {
+    fprintf(stderr, "max_io must be a multiple of %d\n", VSFS_MIN_IO);
+    return false;
+  }
+
+  if (opts->attr_timeout < 0 || opts->entry_timeout < 0 ||
+      opts->negative_timeout < 0) {
+    fprintf(stderr, "Timeouts must not be negative\n");
+    return false;
+  }
+
+  opts->durability = VSFS_DURABILITY_ASYNC;
+  if (opts->durability_str != NULL) {
+    size_t n = sizeof(durability_names) / sizeof(durability_names[0]);
+    size_t i = 0;
+    while (i < n && strcmp(opts->durability_str, durability_names[i]) != 0) {
+      i++;
+    }
+    if (i == n) {
+      fprintf(stderr, "Unknown durability mode: %s\n", opts->durability_str);
+      return false;
+    }
+    opts->durability = (vsfs_durability)i;
+  }
+  opts->io = VSFS_IO_MMAP;
+  if (opts->io_str != NULL) {
+    size_t n = sizeof(io_names) / sizeof(io_names[0]);
+    size_t i = 0;
+    while (i < n && strcmp(opts->io_str, io_names[i]) != 0) {
+      i++;
+    }
+    if (i == n) {
+      fprintf(stderr, "Unknown I/O engine: %s\n", opts->io_str);
+      return false;
+    }
+    opts->io = (vsfs_io_engine)i;
+  }
+
+  opts->meta_hint = VSFS_HINT_RANDOM;
+  opts->stream_hint = VSFS_HINT_WILLNEED;
+  opts->free_hint = VSFS_HINT_COLD;
+  // Dropping pages of blocks that are in use would lose changes with a
+  // journal, where the mapping is private
+  unsigned int used = 1u << VSFS_HINT_NONE | 1u << VSFS_HINT_RANDOM |
+                      1u << VSFS_HINT_SEQUENTIAL | 1u << VSFS_HINT_WILLNEED;
+  unsigned int stream = 1u << VSFS_HINT_NONE | 1u << VSFS_HINT_WILLNEED |
+                        1u << VSFS_HINT_SEQUENTIAL;
+  unsigned int freed = 1u << VSFS_HINT_NONE | 1u << VSFS_HINT_COLD |
+                       1u << VSFS_HINT_DONTNEED;
+  if (!parse_hint("meta_hint", opts->meta_hint_str, used,
+                  &opts->meta_hint) ||
+      !parse_hint("stream_hint", opts->stream_hint_str, stream,
+                  &opts->stream_hint) ||
+      !parse_hint("free_hint", opts->free_hint_str, freed,
+                  &opts->free_hint)) {
+    return false;
+  }
+
+  if (opts->o_direct && opts->io == VSFS_IO_MMAP) {
+    fprintf(stderr, "o_direct needs io=pread or io=uring\n");
+    return false;
+  }
+  if (opts->cache_size > 0 && opts->io == VSFS_IO_MMAP) {
+    fprintf(stderr, "cache_size needs io=pread or io=uring\n");
+    return false;
+  }
+  if (opts->sync_interval == 0) {
+    opts->sync_interval = VSFS_DEFAULT_SYNC_INTERVAL;
+  }
+
+  if (!opts->multithreaded) {
+    fuse_opt_add_arg(args, "-s");
+  }
+  // Limit the size of reads and writes to max_io (4K by default)
+  char opt[128];
+  snprintf(opt, sizeof(opt), "max_read=%u,max_write=%u", opts->max_io,
+           opts->max_io);
   fuse_opt_add_arg(args, "-o");
-  fuse_opt_add_arg(args, "max_write=4096");
+  fuse_opt_add_arg(args, opt);
+  if (opts->max_io > VSFS_MIN_IO) {
+    // Without big_writes the kernel splits writes into single pages
+    fuse_opt_add_arg(args, "-o");
+    fuse_opt_add_arg(args, "big_writes");
+  }
+  // The high-level API implements the caching options itself; the low-level
+  // backend applies them in its replies and would reject them
+  if (!opts->lowlevel) {
+    snprintf(opt, sizeof(opt),
+             "attr_timeout=%g,entry_timeout=%g,negative_timeout=%g",
+             opts->attr_timeout, opts->entry_timeout, opts->negative_timeout);
+    fuse_opt_add_arg(args, "-o");
+    fuse_opt_add_arg(args, opt);
+    if (opts->kernel_cache) {
+      fuse_opt_add_arg(args, "-o");
+      fuse_opt_add_arg(args, "kernel_cache");
+    }
+  }
 
   return true;
 }
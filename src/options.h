@@ -8,6 +8,51 @@
 
 #include <fuse_opt.h>
 
+/** When changes to the image are written back to disk. */
+typedef enum vsfs_durability
+{
+  /** Whenever the kernel writes back dirty pages; fsync() does nothing. */
+  VSFS_DURABILITY_ASYNC,
+  /** Every sync_interval milliseconds, by a background thread. */
+  VSFS_DURABILITY_PERIODIC,
+  /** On every fsync(), for the blocks of the synced file only. */
+  VSFS_DURABILITY_FSYNC,
+
+} vsfs_durability;
+
+/** How the image file is accessed; see bdev.h. */
+typedef enum vsfs_io_engine
+{
+  /** The image is mapped into memory; the kernel moves the data. */
+  VSFS_IO_MMAP,
+  /** Blocks are read and written with pread() and pwrite(). */
+  VSFS_IO_PREAD,
+  /** Like pread, but blocks are read and written with io_uring. */
+  VSFS_IO_URING,
+
+} vsfs_io_engine;
+
+/**
+ * Page cache hint for a region of the mapped image (mmap engine only); see
+ * bdev_advise().
+ */
+typedef enum vsfs_hint
+{
+  /** No hint; the kernel default. */
+  VSFS_HINT_NONE,
+  /** Pages are used in random order: no readahead on page faults. */
+  VSFS_HINT_RANDOM,
+  /** Pages are used in order: more readahead, freed soon after use. */
+  VSFS_HINT_SEQUENTIAL,
+  /** Pages will be used soon: start reading them in now. */
+  VSFS_HINT_WILLNEED,
+  /** Pages are unlikely to be used again: reclaim them first. */
+  VSFS_HINT_COLD,
+  /** Pages are not needed: drop them from the mapping now. */
+  VSFS_HINT_DONTNEED,
+
+} vsfs_hint;
+
 /** vsfs command line options. */
 typedef struct vsfs_opts
 {
@@ -15,6 +60,54 @@ typedef struct vsfs_opts
   const char* img_path;
   /** Print help and exit. FUSE option. */
   int help;
+  /** Maximum size of a single read or write request in bytes. */
+  unsigned int max_io;
+  /** Serve requests from multiple threads instead of implying -s. */
+  int multithreaded;
+  /** Use the inode-based low-level FUSE API instead of the path-based one. */
+  int lowlevel;
+  /** How long the kernel caches file attributes, in seconds. */
+  double attr_timeout;
+  /** How long the kernel caches name lookups, in seconds. */
+  double entry_timeout;
+  /** How long the kernel caches failed name lookups, in seconds. */
+  double negative_timeout;
+  /** Keep the kernel page cache of a file across opens. */
+  int kernel_cache;
+  /** Durability mode name, as given on the command line. */
+  const char* durability_str;
+  /** Durability mode; set from durability_str. */
+  vsfs_durability durability;
+  /** Write-back period in milliseconds in the periodic durability mode. */
+  unsigned int sync_interval;
+  /** Journal commit period in milliseconds; 0 for the default. */
+  unsigned int commit_interval;
+  /** Dirty metadata blocks that trigger a journal commit; 0 for default. */
+  unsigned int commit_blocks;
+  /** Dirty block write-back period in milliseconds; 0 for the default. */
+  unsigned int writeback_interval;
+  /** Dirty block write-back rate limit in MiB per second; 0 for none. */
+  unsigned int writeback_rate;
+  /** I/O engine name, as given on the command line. */
+  const char* io_str;
+  /** I/O engine; set from io_str. */
+  vsfs_io_engine io;
+  /** Open the image file with O_DIRECT (pread and uring engines only). */
+  int o_direct;
+  /** Block cache size in MiB (not with mmap); 0 for no limit. */
+  unsigned int cache_size;
+  /** Most data prefetched ahead of sequential reads in KiB; 0 for none. */
+  unsigned int readahead;
+  /** Hint names, as given on the command line. */
+  const char* meta_hint_str;
+  const char* stream_hint_str;
+  const char* free_hint_str;
+  /** Hint for the metadata blocks; set from meta_hint_str. */
+  vsfs_hint meta_hint;
+  /** Hint for data prefetched for sequential reads; see readahead.h. */
+  vsfs_hint stream_hint;
+  /** Hint for the blocks of deleted files, before they are freed. */
+  vsfs_hint free_hint;
 
 } vsfs_opts;
 
@@ -0,0 +1,164 @@
+/**
+ * Readahead for sequential reads implementation.
+ */
+
+#include <string.h>
+
+#include "inode.h"
+#include "readahead.h"
+#include "util.h"
+
+/** Smallest prefetch window in blocks. */
+#define READAHEAD_MIN_BLOCKS 4
+
+void
+readahead_init(fs_ctx* fs)
+{
+  fs_readahead* r = &fs->readahead;
+  memset(r, 0, sizeof(*r));
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_cond_init(&r->wake, NULL);
+}
+
+void
+readahead_destroy(fs_ctx* fs)
+{
+  fs_readahead* r = &fs->readahead;
+  pthread_mutex_destroy(&r->lock);
+  pthread_cond_destroy(&r->wake);
+}
+
+/** Queue a range of a file for the readahead thread, unless it is full. */
+static void
+enqueue(fs_ctx* fs, vsfs_ino_t ino, uint64_t offset, uint64_t size)
+{
+  fs_readahead* r = &fs->readahead;
+  pthread_mutex_lock(&r->lock);
+  if (r->running && r->count < VSFS_READAHEAD_QUEUE) {
+    uint32_t i = (r->head + r->count) % VSFS_READAHEAD_QUEUE;
+    r->queue[i] = (readahead_req){ .ino = ino, .offset = offset,
+                                   .size = size };
+    r->count++;
+    pthread_cond_signal(&r->wake);
+  }
+  pthread_mutex_unlock(&r->lock);
+}
+
+void
+readahead_read(fs_ctx* fs, vsfs_ino_t ino, readahead_state* ra,
+               uint64_t offset, size_t size)
+{
+  uint32_t max = fs->readahead_blocks;
+  // Prefetched blocks must not push out the ones being read
+  if (fs->cache.capacity > 0 && max > fs->cache.capacity / 4) {
+    max = fs->cache.capacity / 4;
+  }
+  if (max == 0 || size == 0) return;
+
+  uint64_t next = __atomic_load_n(&ra->next, __ATOMIC_RELAXED);
+  uint64_t end = __atomic_load_n(&ra->end, __ATOMIC_RELAXED);
+  uint32_t window = __atomic_load_n(&ra->window, __ATOMIC_RELAXED);
+  uint64_t stop = offset + size;
+  __atomic_store_n(&ra->next, stop, __ATOMIC_RELAXED);
+  if (offset != next) {
+    __atomic_store_n(&ra->window, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&ra->end, 0, __ATOMIC_RELAXED);
+    return;
+  }
+
+  // Enough is still ahead of the reader
+  if (window > 0 && end > stop &&
+      end - stop >= (uint64_t)window * VSFS_BLOCK_SIZE / 2) {
+    return;
+  }
+
+  if (window == 0) {
+    window = 4 * div_round_up(size, VSFS_BLOCK_SIZE);
+    if (window < READAHEAD_MIN_BLOCKS) {
+      window = READAHEAD_MIN_BLOCKS;
+    }
+  } else {
+    window *= 2;
+  }
+  if (window > max) {
+    window = max;
+  }
+
+  uint64_t from = (end > stop) ? end : stop;
+  uint64_t to = stop + (uint64_t)window * VSFS_BLOCK_SIZE;
+  uint64_t i_size = fs->itable[ino].i_size;
+  if (to > i_size) {
+    to = i_size;
+  }
+  __atomic_store_n(&ra->window, window, __ATOMIC_RELAXED);
+  __atomic_store_n(&ra->end, to, __ATOMIC_RELAXED);
+  if (to <= from) return;
+
+  if (fs->dev.cached) {
+    enqueue(fs, ino, from, to - from);
+  } else {
+    inode_prefetch(fs, &fs->itable[ino], from, to - from);
+  }
+}
+
+// Readahead thread: load the queued ranges into the block cache until
+// readahead_stop() clears running
+static void*
+readahead_main(void* arg)
+{
+  fs_ctx* fs = (fs_ctx*)arg;
+  fs_readahead* r = &fs->readahead;
+
+  pthread_mutex_lock(&r->lock);
+  while (r->running) {
+    if (r->count == 0) {
+      pthread_cond_wait(&r->wake, &r->lock);
+      continue;
+    }
+    readahead_req req = r->queue[r->head];
+    r->head = (r->head + 1) % VSFS_READAHEAD_QUEUE;
+    r->count--;
+    pthread_mutex_unlock(&r->lock);
+
+    // The file may have changed or even been freed since; the range is
+    // looked up again under the lock, like for a read
+    pthread_rwlock_rdlock(&fs->ilocks[req.ino]);
+    inode_prefetch(fs, &fs->itable[req.ino], req.offset, req.size);
+    pthread_rwlock_unlock(&fs->ilocks[req.ino]);
+
+    pthread_mutex_lock(&r->lock);
+  }
+  pthread_mutex_unlock(&r->lock);
+  return NULL;
+}
+
+bool
+readahead_start(fs_ctx* fs)
+{
+  fs_readahead* r = &fs->readahead;
+  if (!fs->dev.cached || fs->readahead_blocks == 0) return true;
+
+  pthread_mutex_lock(&r->lock);
+  r->running = true;
+  if (pthread_create(&r->thread, NULL, readahead_main, fs) != 0) {
+    r->running = false;
+  }
+  bool running = r->running;
+  pthread_mutex_unlock(&r->lock);
+  return running;
+}
+
+void
+readahead_stop(fs_ctx* fs)
+{
+  fs_readahead* r = &fs->readahead;
+  pthread_mutex_lock(&r->lock);
+  bool running = r->running;
+  r->running = false;
+  r->count = 0;
+  pthread_cond_signal(&r->wake);
+  pthread_mutex_unlock(&r->lock);
+  if (running) {
+    pthread_join(r->thread, NULL);
+  }
+}
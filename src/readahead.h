@@ -0,0 +1,96 @@
+/**
+ * Readahead for sequential reads header file.
+ *
+ * Every open file has its own readahead state (see readahead_read()). A read
+ * that starts where the previous read of the same handle ended is
+ * sequential; the blocks right after it are then prefetched, so that the
+ * next reads find them present instead of waiting for the disk one request
+ * at a time. The window starts at four times the size of the read and
+ * doubles with every prefetch, up to -o readahead (see options.h); a read
+ * anywhere else starts over. A new prefetch is issued once less than half
+ * of the window is left ahead of the reader, so the disk stays busy while
+ * the reader works through the blocks that are already there.
+ *
+ * With the mmap engine the mapped range gets the -o stream_hint page cache
+ * hint (see bdev_advise()); the default, MADV_WILLNEED, reads it in in the
+ * background. With a block cache (see cache.h), the range is queued for the
+ * readahead thread, which loads the blocks into the cache under the inode
+ * lock, just like a read would (with the uring engine, many of them in
+ * flight at once). Requests are dropped when the queue is full: readahead is
+ * only a hint.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fs_ctx.h"
+#include "vsfs.h"
+
+/**
+ * Sequential read detection of an open file. Zero-initialized when the
+ * file is opened. Updated with relaxed atomics, since reads of the same
+ * handle may run in parallel; if they do, they are not sequential anyway.
+ */
+typedef struct readahead_state
+{
+  /** File offset right after the last read. */
+  uint64_t next;
+  /** File offset up to which blocks have been prefetched. */
+  uint64_t end;
+  /** Prefetch window in blocks; 0 while reads are not sequential. */
+  uint32_t window;
+
+} readahead_state;
+
+/**
+ * Set up the readahead queue. Called by fs_ctx_init().
+ *
+ * @param fs  file system context.
+ */
+void
+readahead_init(fs_ctx* fs);
+
+/**
+ * Release the readahead queue. Called by fs_ctx_destroy().
+ *
+ * @param fs  file system context.
+ */
+void
+readahead_destroy(fs_ctx* fs);
+
+/**
+ * Start the readahead thread, if there is a block cache and readahead is
+ * enabled (readahead_blocks). Must be called after FUSE has daemonized,
+ * since threads don't survive fork().
+ *
+ * @param fs  file system context.
+ * @return    true on success; false if the thread could not be started.
+ */
+bool
+readahead_start(fs_ctx* fs);
+
+/**
+ * Stop the readahead thread, if running. Requests that are still queued are
+ * dropped.
+ *
+ * @param fs  file system context.
+ */
+void
+readahead_stop(fs_ctx* fs);
+
+/**
+ * Record a read of an open file, and if it is sequential, prefetch the
+ * blocks after it. The caller must hold the lock of the inode.
+ *
+ * @param fs      file system context.
+ * @param ino     inode number of the file.
+ * @param ra      readahead state of the open file.
+ * @param offset  offset the read started at.
+ * @param size    number of bytes read.
+ */
+void
+readahead_read(fs_ctx* fs, vsfs_ino_t ino, readahead_state* ra,
+               uint64_t offset, size_t size);
@@ -5,9 +5,13 @@
 #pragma once
 
 #include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -40,3 +44,23 @@ div_round_up(uint32_t x, uint32_t y)
 {
   return (x + y - 1) / y;
 }
+
+/**
+ * Format a counter as the value of an extended attribute, with getxattr(2)
+ * semantics: the value is a decimal number, not null-terminated.
+ *
+ * @param v      counter value.
+ * @param value  buffer for the value.
+ * @param size   buffer size; 0 to only get the length of the value.
+ * @return       length of the value; -ERANGE if size is too small.
+ */
+static inline ssize_t
+format_xattr(uint64_t v, char* value, size_t size)
+{
+  char buf[24];
+  int len = snprintf(buf, sizeof(buf), "%" PRIu64, v);
+  if (size == 0) return len;
+  if (size < (size_t)len) return -ERANGE;
+  memcpy(value, buf, len);
+  return len;
+}
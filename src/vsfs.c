@@ -1,21 +1,29 @@
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/mman.h>
+#include <unistd.h>
 #include <libgen.h>
 
 // Using 2.9.x FUSE API
 #define FUSE_USE_VERSION 29
 #include <fuse.h>
 
-#include "bitmap.h"
+#include "bdev.h"
+#include "cache.h"
+#include "dir.h"
+#include "flush.h"
 #include "fs_ctx.h"
-#include "map.h"
+#include "inode.h"
+#include "journal.h"
 #include "options.h"
+#include "readahead.h"
 #include "util.h"
 #include "vsfs.h"
+#include "vsfs_ll.h"
+#include "writeback.h"
 
 
 /**
@@ -32,21 +40,40 @@
 static bool
 vsfs_init(fs_ctx* fs, vsfs_opts* opts)
 {
-  size_t size;
-  void* image;
-
   // Nothing to initialize if only printing help
   if (opts->help) {
     return true;
   }
 
-  // Map the disk image file into memory
-  image = map_file(opts->img_path, VSFS_BLOCK_SIZE, &size);
-  if (image == NULL) {
+  // Open the disk image file with the chosen I/O engine (see bdev.h)
+  if (!bdev_open(&fs->dev, opts->img_path, opts->io, opts->o_direct)) {
     return false;
   }
+  fs->image_fd = fs->dev.fd;
+  fs->cache_blocks =
+    (uint64_t)opts->cache_size * 1024 * 1024 / VSFS_BLOCK_SIZE;
 
-  return fs_ctx_init(fs, image, size);
+  if (!fs_ctx_init(fs, fs->dev.image, fs->dev.size)) {
+    bdev_close(&fs->dev);
+    return false;
+  }
+  fs->durability = opts->durability;
+  fs->sync_interval = opts->sync_interval;
+  fs->commit_interval = opts->commit_interval;
+  fs->commit_blocks = opts->commit_blocks;
+  fs->writeback_interval = opts->writeback_interval;
+  fs->writeback_rate = opts->writeback_rate;
+  fs->readahead_blocks =
+    (uint64_t)opts->readahead * 1024 / VSFS_BLOCK_SIZE;
+  fs->stream_hint = opts->stream_hint;
+  fs->free_hint = opts->free_hint;
+  // FUSE sends the replies of the path-based API after read_buf returns
+  fs->copy_reads = opts->multithreaded && !opts->lowlevel;
+  // Metadata is looked up all over the place, and faulting in the blocks
+  // around an inode or bitmap word mostly reads in what is not needed. Only
+  // set now: the journal maps the image again.
+  bdev_advise(&fs->dev, 0, fs->sb->data_region, opts->meta_hint);
+  return true;
 }
 
 /**
@@ -59,8 +86,10 @@ vsfs_destroy(void* ctx)
 {
   fs_ctx* fs = (fs_ctx*)ctx;
   if (fs->image) {
-    munmap(fs->image, fs->size);
+    readahead_stop(fs);
+    flush_stop(fs);
     fs_ctx_destroy(fs);
+    bdev_close(&fs->dev);
   }
 }
 
@@ -71,61 +100,217 @@ get_fs(void)
   return (fs_ctx*)fuse_get_context()->private_data;
 }
 
-static void *get_address(vsfs_inode *ino, uint32_t offset) {
+/**
+ * Set up the connection to the kernel.
+ *
+ * Enables splicing of requests and replies if the kernel supports it, so
+ * that file data for vsfs_read_buf() and vsfs_write_buf() is moved without
+ * a userspace copy. Starts the write-back thread (see flush.h) and the
+ * readahead thread (see readahead.h), since this is the first callback after
+ * FUSE has daemonized.
+ *
+ * @param conn  connection parameters.
+ * @return      file system context, which becomes the FUSE private data.
+ */
+static void*
+vsfs_conn_init(struct fuse_conn_info* conn)
+{
+  conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_READ);
   fs_ctx* fs = get_fs();
-	vsfs_blk_t *blocks;
-	uint32_t block_num = offset / VSFS_BLOCK_SIZE;
-	if (block_num >= VSFS_NUM_DIRECT) {
-    block_num -= VSFS_NUM_DIRECT;
-    blocks = fs->image + (ino->i_indirect) * VSFS_BLOCK_SIZE;
+  if (!flush_start(fs)) {
+    fprintf(stderr, "Failed to start the write-back thread\n");
+  }
+  if (!readahead_start(fs)) {
+    fprintf(stderr, "Failed to start the readahead thread\n");
+  }
+  return fs;
+}
 
-	} else {
-    blocks = ino->i_direct;
-	}
+/**
+ * Get the next component of a path.
+ *
+ * Components are found in place; nothing is copied. Repeated '/' characters
+ * are skipped.
+ *
+ * @param p     pointer to the current position in the path; advanced past
+ *              the returned component.
+ * @param end   end of the part of the path to iterate over.
+ * @param comp  pointer to the variable that receives the component start.
+ * @return      component length; 0 if there are no more components.
+ */
+static size_t
+path_next_comp(const char** p, const char* end, const char** comp)
+{
+  const char* s = *p;
+  while (s < end && *s == '/') s++;
 
-	return fs->image + blocks[block_num] * VSFS_BLOCK_SIZE + (offset % VSFS_BLOCK_SIZE);
+  const char* e = s;
+  while (e < end && *e != '/') e++;
+
+  *comp = s;
+  *p = e;
+  return e - s;
 }
 
+/**
+ * Resolve the part of a path before end, one component at a time.
+ *
+ * Each component is looked up in the directory found for the previous one,
+ * so the cost is O(depth) directory lookups. Each directory is read-locked
+ * only while it is searched; no lock is held on return.
+ *
+ * @param fs    file system context.
+ * @param path  absolute path.
+ * @param end   end of the part of the path to resolve.
+ * @param ino   pointer to the variable that receives the inode number.
+ * @return      0 on success; -errno on error.
+ */
+static int
+path_walk(fs_ctx* fs, const char* path, const char* end, vsfs_ino_t* ino)
+{
+  vsfs_ino_t cur = VSFS_ROOT_INO;
+  const char* p = path;
+  const char* comp;
+  size_t len;
+
+  while ((len = path_next_comp(&p, end, &comp)) > 0) {
+    if (len >= VSFS_NAME_MAX) return -ENAMETOOLONG;
+    if (!S_ISDIR(fs->itable[cur].i_mode)) return -ENOTDIR;
+
+    vsfs_ino_t dir = cur;
+    pthread_rwlock_rdlock(&fs->ilocks[dir]);
+    int err = dir_lookup(fs, dir, comp, len, &cur, NULL);
+    pthread_rwlock_unlock(&fs->ilocks[dir]);
+    if (err < 0) return err;
+  }
 
-static vsfs_dentry *get_dir_entry(vsfs_inode *ino, uint64_t i) {
-  vsfs_dentry *dentry = (vsfs_dentry *) get_address(ino, i * sizeof(vsfs_dentry));
-  return dentry;
+  *ino = cur;
+  return 0;
 }
 
+/**
+ * Split a path into its parent directory and its last component, and
+ * resolve the parent directory.
+ *
+ * @param fs      file system context.
+ * @param path    absolute path; must not be "/".
+ * @param parent  pointer to the variable that receives the inode number of
+ *                the parent directory.
+ * @param name    pointer to the variable that receives the last component.
+ * @param len     pointer to the variable that receives its length.
+ * @return        0 on success; -errno on error.
+ */
+static int
+path_lookup_parent(fs_ctx* fs, const char* path, vsfs_ino_t* parent,
+                   const char** name, size_t* len)
+{
+  const char* end = path + strlen(path);
+  while (end > path && end[-1] == '/') end--;
 
+  const char* base = end;
+  while (base > path && base[-1] != '/') base--;
+  if (base == end) return -ENOENT; // no last component, e.g. "/"
 
+  int err = path_walk(fs, path, base, parent);
+  if (err < 0) return err;
+  if (!S_ISDIR(fs->itable[*parent].i_mode)) return -ENOTDIR;
+  if ((size_t)(end - base) >= VSFS_NAME_MAX) return -ENAMETOOLONG;
 
+  *name = base;
+  *len = end - base;
+  return 0;
+}
 
-/* Returns the inode number for the element at the end of the path
- * if it exists.  If there is any error, return -1.
- * Possible errors include:
- *   - The path is not an absolute path
- *   - An element on the path cannot be found
+/**
+ * Returns the inode number for the element at the end of the path if it
+ * exists.
+ *
+ * Results are cached in the dentry cache. A negative entry is only cached
+ * when the parent directory exists and the last component is not in it.
+ * Results are inserted while the parent is still read-locked, and operations
+ * that change a directory invalidate the cache under its write lock, so a
+ * stale result can never be inserted after the invalidation.
+ *
+ * Errors:
+ *   EINVAL        the path is not an absolute path.
+ *   ENAMETOOLONG  a component of the path is too long.
+ *   ENOENT        an element on the path cannot be found.
+ *   ENOTDIR       a component of the path prefix is not a directory.
+ *
+ * @param path  absolute path.
+ * @param ino   pointer to the variable that receives the inode number.
+ * @return      0 on success; -errno on error.
  */
 static int
 path_lookup(const char* path, vsfs_ino_t* ino)
 {
   if (path[0] != '/') {
     fprintf(stderr, "Not an absolute path\n");
-    return -1;
+    return -EINVAL;
   }
+  if (strlen(path) >= VSFS_PATH_MAX) return -ENAMETOOLONG;
 
   if (strcmp(path, "/") == 0) {
     *ino = VSFS_ROOT_INO;
     return 0;
   }
 
-  vsfs_dentry *dir_entry;
-  for (uint64_t i = 0; i < VSFS_BLOCK_SIZE / sizeof(vsfs_dentry); i++) {
-    dir_entry = get_dir_entry(&get_fs()->itable[0], i);
-    if (dir_entry->ino != VSFS_INO_MAX && strcmp((const char *) (path + 1), dir_entry->name) == 0) {
-      *ino = dir_entry->ino;
-	    return 0;
-    }
+  fs_ctx* fs = get_fs();
+  if (dcache_lookup(&fs->dcache, path, ino)) {
+    return (*ino == DCACHE_NEGATIVE) ? -ENOENT : 0;
+  }
+
+  vsfs_ino_t parent;
+  const char* name;
+  size_t len;
+  int err = path_lookup_parent(fs, path, &parent, &name, &len);
+  if (err < 0) return err;
+
+  pthread_rwlock_rdlock(&fs->ilocks[parent]);
+  err = dir_lookup(fs, parent, name, len, ino, NULL);
+  if (err == 0) {
+    dcache_insert(&fs->dcache, path, *ino);
+  } else if (err == -ENOENT) {
+    dcache_insert(&fs->dcache, path, DCACHE_NEGATIVE);
   }
+  pthread_rwlock_unlock(&fs->ilocks[parent]);
+  return err;
+}
+
+/** Open file; fi->fh points to one (see vsfs_open()). */
+typedef struct vsfs_file
+{
+  /** Inode number of the file. */
+  vsfs_ino_t ino;
+  /** Sequential read detection; see readahead.h. */
+  readahead_state ra;
+
+} vsfs_file;
 
-  *ino = VSFS_INO_MAX;
-	return -1;
+/** Get the open file of a handle. */
+static vsfs_file*
+get_file(struct fuse_file_info* fi)
+{
+  return (vsfs_file*)(uintptr_t)fi->fh;
+}
+
+/**
+ * Get the inode number of an open file from its handle, or resolve the path
+ * if the operation was not called on an open file.
+ *
+ * @param path  path to the file.
+ * @param fi    open file info; can be NULL.
+ * @param ino   pointer to the variable that receives the inode number.
+ * @return      0 on success; -errno on error (see path_lookup()).
+ */
+static int
+file_lookup(const char* path, struct fuse_file_info* fi, vsfs_ino_t* ino)
+{
+  if (fi != NULL) {
+    *ino = get_file(fi)->ino;
+    return 0;
+  }
+  return path_lookup(path, ino);
 }
 
 /**
@@ -143,37 +328,68 @@ static int
 vsfs_statfs(const char* path, struct statvfs* st)
 {
   (void)path; // unused
+  fs_ctx_statfs(get_fs(), st);
+  return 0;
+}
+
+/**
+ * Get an extended attribute.
+ *
+ * Implements the getxattr() system call. The only attributes are counters
+ * of the root directory: the block cache counters with -o io=pread (see
+ * cache_getxattr()), e.g. user.vsfs.cache_hits, and the write-back
+ * counters without a journal (see writeback_getxattr()), e.g.
+ * user.vsfs.writeback_written.
+ *
+ * Errors:
+ *   ENODATA  no such attribute.
+ *   ERANGE   the value doesn't fit in the buffer.
+ *
+ * @param path   path to a file or directory.
+ * @param name   attribute name.
+ * @param value  buffer for the value.
+ * @param size   buffer size; 0 to only get the length of the value.
+ * @return       length of the value on success; -errno on error.
+ */
+static int
+vsfs_getxattr(const char* path, const char* name, char* value, size_t size)
+{
+  if (strcmp(path, "/") != 0) return -ENODATA;
+  ssize_t len = cache_getxattr(get_fs(), name, value, size);
+  if (len == -ENODATA) {
+    len = writeback_getxattr(get_fs(), name, value, size);
+  }
+  return len;
+}
+
+
+/**
+ * Get file or directory attributes of an open file; see vsfs_getattr().
+ *
+ * @param path  path to a file or directory.
+ * @param st    pointer to the struct stat that receives the result.
+ * @param fi    open file info (see vsfs_open()); NULL if the file is not
+ *              open.
+ * @return      0 on success; -errno on error.
+ */
+static int
+vsfs_fgetattr(const char* path, struct stat* st, struct fuse_file_info* fi)
+{
   fs_ctx* fs = get_fs();
-  vsfs_superblock* sb = fs->sb; /* Get ptr to superblock from context */
 
   memset(st, 0, sizeof(*st));
-  st->f_bsize = VSFS_BLOCK_SIZE;  /* Filesystem block size */
-  st->f_frsize = VSFS_BLOCK_SIZE; /* Fragment size */
-  st->f_blocks = sb->num_blocks;  /* Size of fs in f_frsize units */
-  st->f_bfree = sb->free_blocks;  /* Number of free blocks */
-  st->f_bavail = sb->free_blocks; /* Free blocks for unpriv users */
-  st->f_files = sb->num_inodes;   /* Number of inodes */
-  st->f_ffree = sb->free_inodes;  /* Number of free inodes */
-  st->f_favail = sb->free_inodes; /* Free inodes for unpriv users */
 
-  st->f_namemax = VSFS_NAME_MAX; /* Maximum filename length */
+  vsfs_ino_t ino;
+  int err = file_lookup(path, fi, &ino);
+  if (err < 0) return err;
+
+  pthread_rwlock_rdlock(&fs->ilocks[ino]);
+  inode_stat(fs, ino, st);
+  pthread_rwlock_unlock(&fs->ilocks[ino]);
 
   return 0;
 }
 
-
-// static char*
-// get_next_comp(char* p)
-// {
-//     int c = *p;
-//     while (c) {
-//         if (c == '/') { return p; }
-//         p++;
-//         c = *p;
-//     }
-//     return 0;
-// }
-
 /**
  * Get file or directory attributes.
  *
@@ -193,49 +409,7 @@ vsfs_statfs(const char* path, struct statvfs* st)
 static int
 vsfs_getattr(const char* path, struct stat* st)
 {
-  if (strlen(path) >= VSFS_PATH_MAX || strlen(path) >= VSFS_NAME_MAX + 1)
-    return -ENAMETOOLONG;
-  fs_ctx* fs = get_fs();
-
-  memset(st, 0, sizeof(*st));
-
-  
-  // Error checking assuming longer paths
-
-  /*
-  const char *start = path;
-  char *end;
-  char curr_path[VSFS_PATH_MAX];
-
-  if (*start == '/') { start++; }
-
-  while ((end = get_next_comp(start))) {
-
-    size_t comp_len = end - start;
-    if (comp_len >= VSFS_NAME_MAX) return -ENAMETOOLONG;
-
-    size_t n = end - path;
-    memcpy(curr_path, path, n);
-    curr_path[n] = '\0';
-
-    vsfs_ino_t ino;
-    int err = path_lookup(curr_path, &ino);
-    if (err == -1) return -ENOENT;
-    if (!S_ISDIR(fs->itable[ino].i_mode)) return -ENOTDIR;
-    start = end + 1;
-  } */
-
-  vsfs_ino_t ino;
-  int err = path_lookup(path, &ino);
-  if (err == -1) return -ENOENT;
-    
-  st->st_mode = fs->itable[ino].i_mode;
-  st->st_nlink = fs->itable[ino].i_nlink;
-  st->st_size = fs->itable[ino].i_size;
-  st->st_blocks = div_round_up(fs->itable[ino].i_size, 512);
-  st->st_mtim = fs->itable[ino].i_mtime;
-
-  return 0;
+  return vsfs_fgetattr(path, st, NULL);
 }
 
 /**
@@ -268,17 +442,102 @@ vsfs_readdir(const char* path,
   (void)fi;     // unused
   fs_ctx* fs = get_fs();
 
-  assert(strcmp(path, "/") == 0);
-  for (uint64_t i = 0; i < VSFS_BLOCK_SIZE / sizeof(vsfs_dentry); i++) {
-    vsfs_dentry *dir_entry = get_dir_entry(&fs->itable[0], i);
+  vsfs_ino_t ino;
+  int err = path_lookup(path, &ino);
+  if (err < 0) return err;
+
+  vsfs_inode* dir = &fs->itable[ino];
+  assert(S_ISDIR(dir->i_mode));
+  err = 0;
+  pthread_rwlock_rdlock(&fs->ilocks[ino]);
+  for (uint32_t i = 0; i < dir_nentries(dir); i++) {
+    vsfs_dentry *dir_entry = dir_get_entry(fs, dir, i);
     if (dir_entry->ino != VSFS_INO_MAX) {
       int is_full = filler(buf, dir_entry->name, NULL, 0);
-      if (is_full) { return -ENOMEM; }
+      if (is_full) { err = -ENOMEM; break; }
     }
   }
-  return 0;
+  pthread_rwlock_unlock(&fs->ilocks[ino]);
+  return err;
+}
+
+/**
+ * Create a directory.
+ *
+ * Implements the mkdir() system call.
+ *
+ * Assumptions (already verified by FUSE using getattr() calls):
+ *   "path" doesn't exist.
+ *   The parent directory of "path" exists and is a directory.
+ *   "path" and its components are not too long.
+ *
+ * Errors:
+ *   ENOMEM  not enough memory (e.g. a malloc() call failed).
+ *   ENOSPC  not enough free space in the file system.
+ *
+ * @param path  path to the directory to create.
+ * @param mode  file mode bits.
+ * @return      0 on success; -errno on error.
+ */
+static int
+vsfs_mkdir(const char* path, mode_t mode)
+{
+  fs_ctx* fs = get_fs();
+
+  vsfs_ino_t parent;
+  const char* name;
+  size_t len;
+  int err = path_lookup_parent(fs, path, &parent, &name, &len);
+  if (err < 0) return err;
+
+  journal_begin(fs);
+  pthread_rwlock_wrlock(&fs->ilocks[parent]);
+  vsfs_ino_t ino;
+  err = dir_mkdir(fs, parent, name, len, mode, &ino);
+  if (err == 0) {
+    dcache_invalidate(&fs->dcache, path);
+  }
+  pthread_rwlock_unlock(&fs->ilocks[parent]);
+  journal_end(fs);
+  return err;
 }
 
+/**
+ * Remove a directory.
+ *
+ * Implements the rmdir() system call.
+ *
+ * Assumptions (already verified by FUSE using getattr() calls):
+ *   "path" exists and is a directory.
+ *
+ * Errors:
+ *   ENOTEMPTY  the directory is not empty.
+ *
+ * @param path  path to the directory to remove.
+ * @return      0 on success; -errno on error.
+ */
+static int
+vsfs_rmdir(const char* path)
+{
+  fs_ctx* fs = get_fs();
+
+  vsfs_ino_t parent;
+  const char* name;
+  size_t len;
+  int err = path_lookup_parent(fs, path, &parent, &name, &len);
+  if (err < 0) return err;
+
+  journal_begin(fs);
+  pthread_rwlock_wrlock(&fs->ilocks[parent]);
+  err = dir_rmdir(fs, parent, name, len);
+  if (err == 0) {
+    // Drop the directory itself and any negative entries below it
+    dcache_invalidate_prefix(&fs->dcache, path);
+  }
+  pthread_rwlock_unlock(&fs->ilocks[parent]);
+  journal_end(fs);
+  return err;
+}
 
 /**
  * Create a file.
@@ -296,102 +555,134 @@ vsfs_readdir(const char* path,
  *
  * @param path  path to the file to create.
  * @param mode  file mode bits.
- * @param fi    unused.
+ * @param fi    open file info; receives the handle of the new file (see
+ *              vsfs_open()).
  * @return      0 on success; -errno on error.
  */
 static int
 vsfs_create(const char* path, mode_t mode, struct fuse_file_info* fi)
 {
-  (void)fi; // unused
   assert(S_ISREG(mode));
   fs_ctx* fs = get_fs();
 
-  vsfs_superblock *sb = (vsfs_superblock *) fs->image;
-  
-  if (sb->free_inodes == 0) { return -ENOSPC; }
-
-  // Find available inode
-  uint32_t new_ino;
-  if (bitmap_alloc(fs->ibmap, sb->num_inodes, &new_ino) < 0) return -ENOSPC;
-  bitmap_set(fs->ibmap, sb->num_inodes, new_ino, true);
-  vsfs_inode *new_inode = &(fs->itable[new_ino]);
-  memset(new_inode, 0, sizeof(vsfs_inode));
-  sb->free_inodes--;
-
-  // Create new inode
-  new_inode->i_size = 0;
-  new_inode->i_blocks = 0;
-  new_inode->i_mode = mode;
-  new_inode->i_nlink = 1;
-  clock_gettime(CLOCK_REALTIME, &(new_inode->i_mtime));
-
-  // Add inode to parent dentry
-  for (uint64_t i = 0; i < VSFS_BLOCK_SIZE / sizeof(vsfs_dentry); i++) {
-    vsfs_dentry *dir_entry = get_dir_entry(&fs->itable[0], i);
-    if (dir_entry->ino == VSFS_INO_MAX) {
-      dir_entry->ino = new_ino;
-      strcpy(dir_entry->name, strrchr(path, '/') + 1);
-      vsfs_inode* parent_inode = &(fs->itable[0]);
-      clock_gettime(CLOCK_REALTIME, &(parent_inode->i_mtime));
-      return 0;
-    }
+  vsfs_ino_t parent;
+  const char* name;
+  size_t len;
+  int err = path_lookup_parent(fs, path, &parent, &name, &len);
+  if (err < 0) return err;
+  vsfs_file* file = calloc(1, sizeof(*file));
+  if (file == NULL) return -ENOMEM;
+
+  journal_begin(fs);
+  pthread_rwlock_wrlock(&fs->ilocks[parent]);
+  err = dir_create(fs, parent, name, len, mode, &file->ino);
+  if (err == 0) {
+    dcache_invalidate(&fs->dcache, path);
+    __atomic_add_fetch(&fs->nopen[file->ino], 1, __ATOMIC_ACQ_REL);
+    fi->fh = (uintptr_t)file;
   }
-  return -ENOSPC;
+  pthread_rwlock_unlock(&fs->ilocks[parent]);
+  journal_end(fs);
+  if (err < 0) {
+    free(file);
+  }
+  return err;
 }
 
 /**
- * Remove a file.
+ * Open a file.
  *
- * Implements the unlink() system call.
+ * The file handle (fi->fh) points to a vsfs_file with the inode number, so
+ * operations on the open file don't have to resolve the path again, and the
+ * readahead state of the open file (see readahead.h). The inode is not freed
+ * while it is open, even if it is unlinked (see inode_release()).
  *
  * Assumptions (already verified by FUSE using getattr() calls):
  *   "path" exists and is a file.
  *
- * Errors: none
+ * Errors:
+ *   ENOMEM  not enough memory.
  *
- * @param path  path to the file to remove.
+ * @param path  path to the file to open.
+ * @param fi    open file info; receives the file handle.
  * @return      0 on success; -errno on error.
  */
 static int
-vsfs_unlink(const char* path)
+vsfs_open(const char* path, struct fuse_file_info* fi)
 {
   fs_ctx* fs = get_fs();
 
-
-  // Get file inode from path
+  // FUSE doesn't let the path be removed while it is being opened
   vsfs_ino_t ino;
-  path_lookup(path, &ino);
-  vsfs_inode *inode = &(fs->itable[ino]);
-
-  inode->i_nlink--;
-
-  // Free the inode
-  if (inode->i_nlink == 0) {
-    bitmap_free(fs->ibmap, fs->sb->num_inodes, (uint32_t) ino);
-    fs->sb->free_inodes++;
-  }
-
-  // Free the blocks
-  for (uint32_t i = 0; i < inode->i_blocks; i++) {
-    bitmap_free(fs->dbmap, fs->sb->num_blocks, inode->i_direct[i]);
-    fs->sb->free_blocks++;
-  }
+  int err = path_lookup(path, &ino);
+  if (err < 0) return err;
+  vsfs_file* file = calloc(1, sizeof(*file));
+  if (file == NULL) return -ENOMEM;
+  file->ino = ino;
 
-  // Find the dir entry, set its ino to max and name to nothing
-  for (uint64_t i = 0; i < VSFS_BLOCK_SIZE / sizeof(vsfs_dentry); i++) {
-    vsfs_dentry *dir_entry = get_dir_entry(&fs->itable[0], i);
-    if (dir_entry->ino != VSFS_INO_MAX && strcmp((const char *) (path + 1), dir_entry->name) == 0) {
-      memset(dir_entry, 0, strlen(dir_entry->name));
-      dir_entry->ino = VSFS_INO_MAX;
-      vsfs_inode* parent_inode = &(fs->itable[0]);
-      clock_gettime(CLOCK_REALTIME, &(parent_inode->i_mtime));
-      return 0;
-    }
-  }
+  __atomic_add_fetch(&fs->nopen[ino], 1, __ATOMIC_ACQ_REL);
+  fi->fh = (uintptr_t)file;
+  return 0;
+}
 
+/**
+ * Close a file. Called once for every open() or create() when the last
+ * descriptor that refers to it is closed.
+ *
+ * @param path  unused.
+ * @param fi    open file info.
+ * @return      0.
+ */
+static int
+vsfs_release(const char* path, struct fuse_file_info* fi)
+{
+  (void)path; // unused
+  fs_ctx* fs = get_fs();
+  vsfs_ino_t ino = get_file(fi)->ino;
+  free(get_file(fi));
+
+  journal_begin(fs);
+  pthread_rwlock_wrlock(&fs->ilocks[ino]);
+  __atomic_sub_fetch(&fs->nopen[ino], 1, __ATOMIC_ACQ_REL);
+  inode_release(fs, ino);
+  pthread_rwlock_unlock(&fs->ilocks[ino]);
+  journal_end(fs);
   return 0;
+}
 
+/**
+ * Remove a file.
+ *
+ * Implements the unlink() system call.
+ *
+ * Assumptions (already verified by FUSE using getattr() calls):
+ *   "path" exists and is a file.
+ *
+ * Errors: none
+ *
+ * @param path  path to the file to remove.
+ * @return      0 on success; -errno on error.
+ */
+static int
+vsfs_unlink(const char* path)
+{
+  fs_ctx* fs = get_fs();
 
+  vsfs_ino_t parent;
+  const char* name;
+  size_t len;
+  int err = path_lookup_parent(fs, path, &parent, &name, &len);
+  if (err < 0) return err;
+
+  journal_begin(fs);
+  pthread_rwlock_wrlock(&fs->ilocks[parent]);
+  err = dir_unlink(fs, parent, name, len);
+  if (err == 0) {
+    dcache_invalidate(&fs->dcache, path);
+  }
+  pthread_rwlock_unlock(&fs->ilocks[parent]);
+  journal_end(fs);
+  return err;
 }
 
 /**
@@ -426,10 +717,13 @@ vsfs_utimens(const char* path, const struct timespec times[2])
 
   // Find the inode for the final component in path
   vsfs_ino_t ino_num;
-	path_lookup(path, &ino_num);
+  int err = path_lookup(path, &ino_num);
+  if (err < 0) return err;
 	ino = &fs->itable[ino_num];
 
   // Update the mtime for that inode.
+  journal_begin(fs);
+  pthread_rwlock_wrlock(&fs->ilocks[ino_num]);
   if (times[1].tv_nsec == UTIME_NOW) {
     if (clock_gettime(CLOCK_REALTIME, &(ino->i_mtime)) != 0) {
     	assert(false);
@@ -437,10 +731,39 @@ vsfs_utimens(const char* path, const struct timespec times[2])
   } else {
     ino->i_mtime = times[1];
   }
+  journal_dirty_meta(fs, ino, sizeof(*ino));
+  pthread_rwlock_unlock(&fs->ilocks[ino_num]);
+  journal_end(fs);
 
   return 0;
 }
 
+/**
+ * Change the size of an open file; see vsfs_truncate().
+ *
+ * @param path  path to the file to set the size.
+ * @param size  new file size in bytes.
+ * @param fi    open file info (see vsfs_open()); NULL if the file is not
+ *              open.
+ * @return      0 on success; -errno on error.
+ */
+static int
+vsfs_ftruncate(const char* path, off_t size, struct fuse_file_info* fi)
+{
+  fs_ctx* fs = get_fs();
+
+  vsfs_ino_t ino_num;
+  int err = file_lookup(path, fi, &ino_num);
+  if (err < 0) return err;
+
+  journal_begin(fs);
+  pthread_rwlock_wrlock(&fs->ilocks[ino_num]);
+  err = inode_truncate(fs, &fs->itable[ino_num], size);
+  pthread_rwlock_unlock(&fs->ilocks[ino_num]);
+  journal_end(fs);
+  return err;
+}
+
 /**
  * Change the size of a file.
  *
@@ -463,53 +786,7 @@ vsfs_utimens(const char* path, const struct timespec times[2])
 static int
 vsfs_truncate(const char* path, off_t size)
 {
-  fs_ctx* fs = get_fs();
-
-  (void)path;
-  (void)size;
-  (void)fs;
-
-  vsfs_blk_t block_size = div_round_up(size, VSFS_BLOCK_SIZE);
-
-  if (block_size > (VSFS_NUM_DIRECT) + (VSFS_BLOCK_SIZE / sizeof(vsfs_blk_t))) return -EFBIG;
-
-  vsfs_ino_t ino_num;
-	path_lookup(path, &ino_num);
-	vsfs_inode *ino = &fs->itable[ino_num];
-
-  if ((uint64_t) size == ino->i_size) return 0;
-
-  // zero out the uninitialized range
-  if ((uint64_t) size > ino->i_size) {
-    memset(get_address(ino, ino->i_size), 0, size - ino->i_size);
-  }
-
-  if (block_size > ino->i_blocks) { // allocate more blocks
-    uint32_t num_to_allocate = (block_size - ino->i_blocks) > VSFS_NUM_DIRECT ? VSFS_NUM_DIRECT : (block_size - ino->i_blocks);
-    for (uint32_t i = 0; i < num_to_allocate; i++) {
-      uint32_t block_num;
-      if (bitmap_alloc(fs->dbmap, fs->sb->num_blocks, &block_num) < 0) return -ENOSPC;
-      bitmap_set(fs->dbmap, fs->sb->num_blocks, block_num, true);
-      fs->sb->free_blocks--;
-    }
-  } else { // free blocks
-    // uint32_t block_i = fs->sb->num_blocks - 1;
-    uint32_t num_to_free = (ino->i_blocks - block_size) > VSFS_NUM_DIRECT ? VSFS_NUM_DIRECT : (ino->i_blocks - block_size);
-    for (uint32_t i = 0; i < num_to_free; i++) {
-      // while (!bitmap_isset(fs->dbmap, fs->sb->num_blocks, block_i)) block_i--;
-      bitmap_free(fs->dbmap, fs->sb->num_blocks, ino->i_direct[VSFS_NUM_DIRECT - 1 - i]);
-      fs->sb->free_blocks++;
-    }
-  }
-
-  // Set new file size
-  ino->i_size = size;
-  ino->i_blocks = block_size;
- 
-  clock_gettime(CLOCK_REALTIME, &(ino->i_mtime));
-
-  return 0;
-
+  return vsfs_ftruncate(path, size, NULL);
 }
 
 /**
@@ -517,19 +794,20 @@ vsfs_truncate(const char* path, off_t size)
  *
  * Implements the pread() system call. returns exactly the number of bytes
  * requested except on EOF (end of file). Reads from file ranges that have not
- * been written to return ranges filled with zeros.
+ * been written to return ranges filled with zeros. The byte range can span
+ * any number of blocks.
  *
  * Assumptions (already verified by FUSE using getattr() calls):
  *   "path" exists and is a file.
- *   the byte range from offset to offset + size is contained within a single block.
  *
- * Errors: none
+ * Errors:
+ *   EIO  reading the data from the image file failed (-o io=pread).
  *
  * @param path    path to the file to read from.
  * @param buf     pointer to the buffer that receives the data.
  * @param size    buffer size (number of bytes requested).
  * @param offset  offset from the beginning of the file to read from.
- * @param fi      unused.
+ * @param fi      open file info (see vsfs_open()).
  * @return        number of bytes read on success; 0 if offset is beyond EOF;
  *                -errno on error.
  */
@@ -540,21 +818,66 @@ vsfs_read(const char* path,
           off_t offset,
           struct fuse_file_info* fi)
 {
-  (void)fi; // unused
   fs_ctx* fs = get_fs();
 
   vsfs_ino_t ino;
-  path_lookup(path, &ino);
+  int err = file_lookup(path, fi, &ino);
+  if (err < 0) return err;
   vsfs_inode *inode = &(fs->itable[ino]);
 
-  if (inode->i_size < (uint64_t) offset) { return 0; }
+  // readers of the same file share the lock, so parallel reads don't contend
+  pthread_rwlock_rdlock(&fs->ilocks[ino]);
+  ssize_t res = inode_read(fs, inode, buf, size, offset);
+  if (fi != NULL && res > 0) {
+    readahead_read(fs, ino, &get_file(fi)->ra, offset, res);
+  }
+  pthread_rwlock_unlock(&fs->ilocks[ino]);
 
-  if (inode->i_size < (uint64_t) offset + (uint64_t) size) { size = inode->i_size - offset; }
+  return (int) res;
+}
+
+/**
+ * Read data from a file without copying it.
+ *
+ * Same as vsfs_read(), but the data is returned as buffers that refer to the
+ * image file, so FUSE can splice it to the kernel; see inode_read_buf().
+ *
+ * FUSE sends the reply after the inode lock has been released, and a
+ * truncate that runs in the meantime could hand the freed blocks to another
+ * file. With -o multithreaded the data is therefore copied under the lock
+ * (see fs_ctx.copy_reads); single-threaded mounts still splice it.
+ *
+ * Errors:
+ *   ENOMEM  not enough memory.
+ *   EIO     reading the data from the image file failed (-o io=pread).
+ *
+ * @param path    path to the file to read from.
+ * @param bufp    pointer to the variable that receives the buffer vector.
+ * @param size    number of bytes requested.
+ * @param offset  offset from the beginning of the file to read from.
+ * @param fi      open file info (see vsfs_open()).
+ * @return        0 on success; -errno on error.
+ */
+static int
+vsfs_read_buf(const char* path,
+              struct fuse_bufvec** bufp,
+              size_t size,
+              off_t offset,
+              struct fuse_file_info* fi)
+{
+  fs_ctx* fs = get_fs();
 
-  memcpy(buf, (char *) get_address(inode, offset), size);
+  vsfs_ino_t ino;
+  int err = file_lookup(path, fi, &ino);
+  if (err < 0) return err;
 
-  return (int) size;
-  
+  pthread_rwlock_rdlock(&fs->ilocks[ino]);
+  err = inode_read_buf(fs, &fs->itable[ino], size, offset, bufp);
+  if (fi != NULL && err == 0) {
+    readahead_read(fs, ino, &get_file(fi)->ra, offset, fuse_buf_size(*bufp));
+  }
+  pthread_rwlock_unlock(&fs->ilocks[ino]);
+  return err;
 }
 
 /**
@@ -563,22 +886,23 @@ vsfs_read(const char* path,
  * Implements the pwrite() system call. returns exactly the number of bytes
  * requested except on error. If the offset is beyond EOF (end of file), the
  * file is extended. If the write creates a hole of uninitialized data,
- * the new uninitialized range is filled with zeros.
+ * the new uninitialized range is filled with zeros. The byte range can span
+ * any number of blocks.
  *
  * Assumptions (already verified by FUSE using getattr() calls):
  *   "path" exists and is a file.
- *   the byte range from offset to offset + size is contained within a single block.
  *
  * Errors:
  *   ENOMEM  not enough memory (e.g. a malloc() call failed).
  *   ENOSPC  not enough free space in the file system.
  *   EFBIG   write would exceed the maximum file size
+ *   EIO     reading a partly overwritten block failed (-o io=pread).
  *
  * @param path    path to the file to write to.
  * @param buf     pointer to the buffer containing the data.
  * @param size    buffer size (number of bytes requested).
  * @param offset  offset from the beginning of the file to write to.
- * @param fi      unused.
+ * @param fi      open file info (see vsfs_open()).
  * @return        number of bytes written on success; -errno on error.
  */
 static int
@@ -588,40 +912,115 @@ vsfs_write(const char* path,
            off_t offset,
            struct fuse_file_info* fi)
 {
-  (void)fi; // unused
   fs_ctx* fs = get_fs();
 
-
   // get inode
   vsfs_ino_t ino;
-  path_lookup(path, &ino);
+  int err = file_lookup(path, fi, &ino);
+  if (err < 0) return err;
   vsfs_inode *inode = &(fs->itable[ino]);
 
-  if (inode->i_size < (uint64_t) offset) return -EFBIG;
-  
-  // truncate if needed
-  if (inode->i_size < (uint64_t) offset + (uint64_t) size) {
-    int res = vsfs_truncate(path, offset + size);
-    if (res < 0) return res;
-  } else {
-    // update inode
-    inode->i_size += size;
-    inode->i_blocks += div_round_up(size, VSFS_BLOCK_SIZE);
-  }
+  journal_begin(fs);
+  pthread_rwlock_wrlock(&fs->ilocks[ino]);
+  err = inode_write(fs, inode, buf, size, offset);
+  pthread_rwlock_unlock(&fs->ilocks[ino]);
+  journal_end(fs);
+
+  return (err < 0) ? err : (int) size;
+}
+
+/**
+ * Write data to a file without copying it.
+ *
+ * Same as vsfs_write(), but the data comes in FUSE buffers, which may still
+ * be in the FUSE pipe; it is then spliced into the image file. See
+ * inode_write_buf().
+ *
+ * @param path    path to the file to write to.
+ * @param buf     source buffers.
+ * @param offset  offset from the beginning of the file to write to.
+ * @param fi      open file info (see vsfs_open()).
+ * @return        number of bytes written on success; -errno on error.
+ */
+static int
+vsfs_write_buf(const char* path,
+               struct fuse_bufvec* buf,
+               off_t offset,
+               struct fuse_file_info* fi)
+{
+  fs_ctx* fs = get_fs();
+
+  vsfs_ino_t ino;
+  int err = file_lookup(path, fi, &ino);
+  if (err < 0) return err;
+
+  journal_begin(fs);
+  pthread_rwlock_wrlock(&fs->ilocks[ino]);
+  ssize_t res = inode_write_buf(fs, &fs->itable[ino], buf, offset);
+  pthread_rwlock_unlock(&fs->ilocks[ino]);
+  journal_end(fs);
+
+  return (int) res;
+}
+
+/**
+ * Write back a file to disk.
+ *
+ * Implements the fsync() and fdatasync() system calls. Only does anything
+ * with -o durability=fsync; in the other modes the data reaches the disk on
+ * its own (see flush.h). Inode metadata is written back even for
+ * fdatasync(), since the file's blocks can't be found without it. With a
+ * journal, all changes so far are committed, in a single commit with any
+ * concurrent fsync() calls (see journal_sync()).
+ *
+ * Errors:
+ *   EIO  writing back the image failed.
+ *
+ * @param path      path to the file.
+ * @param datasync  unused.
+ * @param fi        open file info (see vsfs_open()).
+ * @return          0 on success; -errno on error.
+ */
+static int
+vsfs_fsync(const char* path, int datasync, struct fuse_file_info* fi)
+{
+  (void)datasync; // unused
+  fs_ctx* fs = get_fs();
+  if (fs->durability != VSFS_DURABILITY_FSYNC) return 0;
+  if (fs->journal.enabled) return journal_sync(fs);
 
-  // do the write to the data block
-  memcpy((char *) get_address(inode, offset), buf, size);
+  vsfs_ino_t ino;
+  int err = file_lookup(path, fi, &ino);
+  if (err < 0) return err;
 
-  // update last modified time
-  clock_gettime(CLOCK_REALTIME, &(inode->i_mtime));
+  pthread_rwlock_rdlock(&fs->ilocks[ino]);
+  err = inode_sync(fs, ino);
+  pthread_rwlock_unlock(&fs->ilocks[ino]);
+  return err;
+}
 
-  return (int) size;
+/**
+ * Write back a directory to disk; see vsfs_fsync().
+ *
+ * @param path      path to the directory.
+ * @param datasync  unused.
+ * @param fi        unused; directories have no file handles.
+ * @return          0 on success; -errno on error.
+ */
+static int
+vsfs_fsyncdir(const char* path, int datasync, struct fuse_file_info* fi)
+{
+  (void)fi; // unused
+  return vsfs_fsync(path, datasync, NULL);
 }
 
 static struct fuse_operations vsfs_ops = {
+  .init = vsfs_conn_init,
   .destroy = vsfs_destroy,
   .statfs = vsfs_statfs,
+  .getxattr = vsfs_getxattr,
   .getattr = vsfs_getattr,
+  .fgetattr = vsfs_fgetattr,
   .readdir = vsfs_readdir,
   .mkdir = vsfs_mkdir,
   .rmdir = vsfs_rmdir,
@@ -629,14 +1028,21 @@ static struct fuse_operations vsfs_ops = {
   .unlink = vsfs_unlink,
   .utimens = vsfs_utimens,
   .truncate = vsfs_truncate,
+  .ftruncate = vsfs_ftruncate,
+  .open = vsfs_open,
+  .release = vsfs_release,
   .read = vsfs_read,
+  .read_buf = vsfs_read_buf,
   .write = vsfs_write,
+  .write_buf = vsfs_write_buf,
+  .fsync = vsfs_fsync,
+  .fsyncdir = vsfs_fsyncdir,
 };
 
 int
 main(int argc, char* argv[])
 {
-  vsfs_opts opts = { 0 }; // defaults are all 0
+  vsfs_opts opts = { 0 }; // defaults are set by vsfs_opt_parse()
   struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
   if (!vsfs_opt_parse(&args, &opts))
     return 1;
@@ -647,5 +1053,10 @@ main(int argc, char* argv[])
     return 1;
   }
 
+  if (opts.lowlevel && !opts.help) {
+    int ret = vsfs_ll_main(&args, &fs, &opts);
+    vsfs_destroy(&fs);
+    return ret;
+  }
   return fuse_main(args.argc, args.argv, &vsfs_ops, &fs);
 }
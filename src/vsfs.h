@@ -38,7 +38,8 @@ typedef uint32_t vsfs_ino_t;
  *   Block 1: inode bitmap
  *   Block 2: data bitmap
  *   Block 3: start of inode table
- *   First data block after inode table
+ *   Journal after inode table (only with VSFS_FEATURE_JOURNAL)
+ *   First data block after inode table (and journal)
  */
 
 #define VSFS_SB_BLKNUM 0
@@ -56,13 +57,54 @@ typedef struct vsfs_superblock
   uint32_t free_inodes;   /* Number of available inodes */
   vsfs_blk_t num_blocks;  /* File system size in blocks */
   vsfs_blk_t free_blocks; /* Number of available blocks in file system */
-  vsfs_blk_t data_region; /* First block after inode table */
+  vsfs_blk_t data_region; /* First block after inode table (and journal) */
+  uint32_t features;      /* VSFS_FEATURE_* flags (set by mkfs) */
+  vsfs_blk_t journal_blk; /* First block of the journal */
+  uint32_t journal_len;   /* Journal size in blocks */
 } vsfs_superblock;
 
+/** New files and directories use the extent-based inode format. */
+#define VSFS_FEATURE_EXTENTS 0x1
+/** Metadata updates go through the journal; see journal.h. */
+#define VSFS_FEATURE_JOURNAL 0x2
+
 // Superblock must fit into a single disk sector
 static_assert(sizeof(vsfs_superblock) <= VSFS_BLOCK_SIZE,
               "superblock is too large");
 
+/**
+ * A run of contiguous blocks of a file (extent-based inode format).
+ *
+ * Logical blocks e_lblk .. e_lblk + e_len - 1 of the file are stored in
+ * blocks e_start .. e_start + e_len - 1 of the file system.
+ */
+typedef struct vsfs_extent
+{
+  /** First logical block (block index within the file) of the run. */
+  vsfs_blk_t e_lblk;
+  /** First block of the run. */
+  vsfs_blk_t e_start;
+  /** Number of blocks in the run. */
+  uint32_t e_len;
+} vsfs_extent;
+
+/** Number of extents stored in the inode itself. */
+#define VSFS_INLINE_EXTENTS 1
+
+/** Number of extents in an extent block. */
+#define VSFS_EXTENTS_PER_BLOCK (VSFS_BLOCK_SIZE / sizeof(vsfs_extent))
+
+/** Number of extent blocks an extent index block can list. */
+#define VSFS_EXTENT_BLOCKS (VSFS_BLOCK_SIZE / sizeof(vsfs_blk_t))
+
+/** Maximum number of extents of a file. */
+#define VSFS_MAX_EXTENTS (VSFS_EXTENTS_PER_BLOCK * VSFS_EXTENT_BLOCKS)
+
+/** Inode flag: data is described by extents instead of block pointers. */
+#define VSFS_INODE_EXTENTS 0x1
+/** Inode flag: i_extent_blk is an extent index block; see vsfs_inode. */
+#define VSFS_INODE_EXTENT_INDEX 0x2
+
 /** vsfs inode. */
 typedef struct vsfs_inode
 {
@@ -82,6 +124,9 @@ typedef struct vsfs_inode
   /** File size in vsfs file system blocks */
   vsfs_blk_t i_blocks;
 
+  /** VSFS_INODE_* flags. */
+  uint32_t i_flags;
+
   /** File size in bytes. */
   uint64_t i_size;
 
@@ -94,14 +139,43 @@ typedef struct vsfs_inode
    */
   struct timespec i_mtime;
 
-  /** Data pointers. */
-  vsfs_blk_t i_direct[VSFS_NUM_DIRECT];
-  vsfs_blk_t i_indirect;
+  union
+  {
+    /** Data pointers (default format). */
+    struct
+    {
+      vsfs_blk_t i_direct[VSFS_NUM_DIRECT];
+      vsfs_blk_t i_indirect;
+    };
+
+    /**
+     * Extent list, sorted by e_lblk (VSFS_INODE_EXTENTS format).
+     *
+     * Up to VSFS_INLINE_EXTENTS extents are stored in i_extents. Longer lists
+     * are stored in block i_extent_blk, which is 0 while the list is inline.
+     * Lists longer than VSFS_EXTENTS_PER_BLOCK are split into extent blocks
+     * that are all full but the last; i_extent_blk is then an index block
+     * with their block numbers, and VSFS_INODE_EXTENT_INDEX is set.
+     */
+    struct
+    {
+      uint32_t i_nextents;
+      vsfs_blk_t i_extent_blk;
+      vsfs_extent i_extents[VSFS_INLINE_EXTENTS];
+    };
+  };
 } vsfs_inode;
 
 /** A single block must fit an integral number of inodes */
 static_assert(VSFS_BLOCK_SIZE % sizeof(vsfs_inode) == 0, "invalid inode size");
 
+/** Both data formats must share the same space in the inode */
+static_assert(sizeof(vsfs_inode) == 64, "inode layout changed");
+
+/** Maximum number of data blocks in a file: direct plus single indirect. */
+#define VSFS_MAX_FILE_BLOCKS                                                   \
+  (VSFS_NUM_DIRECT + VSFS_BLOCK_SIZE / sizeof(vsfs_blk_t))
+
 /**
  *  Since we only have 1 inode bitmap block, there can be at most
  *  VSFS_BLOCK_SIZE * bits_per_byte inodes in the file system.
@@ -123,6 +197,9 @@ static_assert(VSFS_ROOT_INO < (VSFS_BLOCK_SIZE / sizeof(vsfs_inode)),
  */
 #define VSFS_BLK_MAX VSFS_BLOCK_SIZE* CHAR_BIT
 
+/** Even a file with no two blocks adjacent must fit into an extent index. */
+static_assert(VSFS_MAX_EXTENTS >= VSFS_BLK_MAX, "extent index is too small");
+
 /**
  *  Since we have a fixed metadata layout, there must be at least
  *  5  blocks in the file system:
@@ -147,3 +224,40 @@ typedef struct vsfs_dentry
 } vsfs_dentry;
 
 static_assert(sizeof(vsfs_dentry) == 256, "invalid dentry size");
+
+/* The journal is a sequence of transactions, each made of one or more
+ * descriptor blocks, every one followed by copies of the blocks it lists,
+ * and a commit block. Block 0 of the journal is a header that holds the
+ * sequence number of the first transaction to replay, which starts at
+ * journal block 1. Transactions with other sequence numbers are left over
+ * from before the journal was last emptied and are ignored.
+ */
+
+/** Magic value of the journal header, descriptor and commit blocks. */
+#define VSFS_JOURNAL_MAGIC 0x4C4E524A53465356ul
+
+/** Journal block types. */
+#define VSFS_JOURNAL_HEADER 1
+#define VSFS_JOURNAL_DESC 2
+#define VSFS_JOURNAL_COMMIT 3
+
+/** Minimum journal size in blocks. */
+#define VSFS_JOURNAL_MIN 64
+
+/** Header of each journal block (other than copies of logged blocks). */
+typedef struct vsfs_journal_block
+{
+  uint64_t magic;    /* Must match VSFS_JOURNAL_MAGIC. */
+  uint64_t seq;      /* Transaction sequence number. */
+  uint32_t type;     /* VSFS_JOURNAL_* */
+  /* Descriptor: number of entries in blocks[]. Commit: number of blocks
+   * logged by the transaction. */
+  uint32_t count;
+  uint64_t checksum; /* Commit: checksum of the logged blocks. */
+  /* Descriptor: home block numbers of the copies that follow it. */
+  vsfs_blk_t blocks[];
+} vsfs_journal_block;
+
+/** Maximum number of block numbers in a descriptor block. */
+#define VSFS_JOURNAL_DESC_MAX                                                  \
+  ((VSFS_BLOCK_SIZE - sizeof(vsfs_journal_block)) / sizeof(vsfs_blk_t))
@@ -0,0 +1,614 @@
+/**
+ * vsfs low-level (inode-based) FUSE backend.
+ *
+ * Requests carry inode numbers instead of paths, so they map directly to
+ * fs->itable without any path resolution. FUSE reserves inode number 1
+ * (FUSE_ROOT_ID) for the root directory while vsfs uses 0, so FUSE inode
+ * numbers are vsfs inode numbers plus one.
+ *
+ * The kernel keeps a lookup count for every inode it knows about and drops
+ * it with forget requests. An inode that is unlinked while the kernel still
+ * holds references (e.g. a file that is still open) is only freed once the
+ * count drops to zero.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Using 2.9.x FUSE API
+#define FUSE_USE_VERSION 29
+#include <fuse_lowlevel.h>
+
+#include "bitmap.h"
+#include "cache.h"
+#include "dir.h"
+#include "flush.h"
+#include "fs_ctx.h"
+#include "inode.h"
+#include "journal.h"
+#include "readahead.h"
+#include "vsfs_ll.h"
+#include "writeback.h"
+
+/** Session user data. */
+typedef struct ll_ctx
+{
+  fs_ctx* fs;
+  const vsfs_opts* opts;
+} ll_ctx;
+
+/** Get file system context. */
+static fs_ctx*
+req_fs(fuse_req_t req)
+{
+  return ((ll_ctx*)fuse_req_userdata(req))->fs;
+}
+
+/** Get mount options. */
+static const vsfs_opts*
+req_opts(fuse_req_t req)
+{
+  return ((ll_ctx*)fuse_req_userdata(req))->opts;
+}
+
+/** Convert a FUSE inode number to a vsfs inode number. */
+static vsfs_ino_t
+to_vsfs(fuse_ino_t ino)
+{
+  return (vsfs_ino_t)(ino - FUSE_ROOT_ID) + VSFS_ROOT_INO;
+}
+
+/** Convert a vsfs inode number to a FUSE inode number. */
+static fuse_ino_t
+to_fuse(vsfs_ino_t ino)
+{
+  return (fuse_ino_t)(ino - VSFS_ROOT_INO) + FUSE_ROOT_ID;
+}
+
+/** Fill in the attributes of an inode for a reply. */
+static void
+ll_stat(fs_ctx* fs, vsfs_ino_t ino, struct stat* st)
+{
+  pthread_rwlock_rdlock(&fs->ilocks[ino]);
+  inode_stat(fs, ino, st);
+  pthread_rwlock_unlock(&fs->ilocks[ino]);
+  st->st_ino = to_fuse(ino);
+}
+
+/**
+ * Reply with a directory entry. The caller must have taken the lookup
+ * reference that the reply hands to the kernel (see ll_lookup()).
+ */
+static void
+reply_entry(fuse_req_t req, fs_ctx* fs, vsfs_ino_t ino,
+            struct fuse_file_info* fi)
+{
+  const vsfs_opts* opts = req_opts(req);
+  struct fuse_entry_param e;
+  memset(&e, 0, sizeof(e));
+  e.ino = to_fuse(ino);
+  e.attr_timeout = opts->attr_timeout;
+  e.entry_timeout = opts->entry_timeout;
+  ll_stat(fs, ino, &e.attr);
+
+  if (fi != NULL) {
+    fi->keep_cache = opts->kernel_cache;
+    fi->fh = (uintptr_t)calloc(1, sizeof(readahead_state));
+    fuse_reply_create(req, &e, fi);
+  } else {
+    fuse_reply_entry(req, &e);
+  }
+}
+
+/**
+ * Take a lookup reference to an inode. The caller must hold the lock of the
+ * directory the inode was found in, so that it can't be unlinked meanwhile.
+ */
+static void
+get_ref(fs_ctx* fs, vsfs_ino_t ino)
+{
+  __atomic_add_fetch(&fs->nlookup[ino], 1, __ATOMIC_ACQ_REL);
+}
+
+/** Drop n lookup references to an inode; frees it if it was unlinked. */
+static void
+put_ref(fs_ctx* fs, vsfs_ino_t ino, uint64_t n)
+{
+  journal_begin(fs);
+  pthread_rwlock_wrlock(&fs->ilocks[ino]);
+  assert(fs->nlookup[ino] >= n);
+  __atomic_sub_fetch(&fs->nlookup[ino], n, __ATOMIC_ACQ_REL);
+  inode_release(fs, ino);
+  pthread_rwlock_unlock(&fs->ilocks[ino]);
+  journal_end(fs);
+}
+
+/** Enable splicing of requests and replies if the kernel supports it. */
+static void
+ll_init(void* userdata, struct fuse_conn_info* conn)
+{
+  (void)userdata; // unused
+  conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_READ);
+}
+
+static void
+ll_lookup(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+  fs_ctx* fs = req_fs(req);
+  vsfs_ino_t dir = to_vsfs(parent);
+  size_t len = strlen(name);
+  if (len >= VSFS_NAME_MAX) {
+    fuse_reply_err(req, ENAMETOOLONG);
+    return;
+  }
+
+  pthread_rwlock_rdlock(&fs->ilocks[dir]);
+  vsfs_ino_t ino;
+  int err = dir_lookup(fs, dir, name, len, &ino, NULL);
+  if (err == 0) {
+    get_ref(fs, ino);
+  }
+  pthread_rwlock_unlock(&fs->ilocks[dir]);
+
+  // A zero inode number tells the kernel to cache the failed lookup
+  if (err == -ENOENT && req_opts(req)->negative_timeout > 0) {
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    e.entry_timeout = req_opts(req)->negative_timeout;
+    fuse_reply_entry(req, &e);
+    return;
+  }
+  if (err < 0) {
+    fuse_reply_err(req, -err);
+    return;
+  }
+  reply_entry(req, fs, ino, NULL);
+}
+
+static void
+ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+  put_ref(req_fs(req), to_vsfs(ino), nlookup);
+  fuse_reply_none(req);
+}
+
+static void
+ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data* forgets)
+{
+  fs_ctx* fs = req_fs(req);
+  for (size_t i = 0; i < count; i++) {
+    put_ref(fs, to_vsfs(forgets[i].ino), forgets[i].nlookup);
+  }
+  fuse_reply_none(req);
+}
+
+static void
+ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+  (void)fi; // unused
+  struct stat st;
+  ll_stat(req_fs(req), to_vsfs(ino), &st);
+  fuse_reply_attr(req, &st, req_opts(req)->attr_timeout);
+}
+
+static void
+ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr, int to_set,
+           struct fuse_file_info* fi)
+{
+  (void)fi; // unused
+  fs_ctx* fs = req_fs(req);
+  vsfs_ino_t i = to_vsfs(ino);
+  vsfs_inode* inode = &fs->itable[i];
+
+  // Same as the path-based backend: there is no chmod() or chown()
+  if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+    fuse_reply_err(req, ENOSYS);
+    return;
+  }
+
+  int err = 0;
+  journal_begin(fs);
+  pthread_rwlock_wrlock(&fs->ilocks[i]);
+  if (to_set & FUSE_SET_ATTR_SIZE) {
+    err = S_ISDIR(inode->i_mode) ? -EISDIR
+                                 : inode_truncate(fs, inode, attr->st_size);
+  }
+  if (err == 0 && (to_set & FUSE_SET_ATTR_MTIME_NOW)) {
+    clock_gettime(CLOCK_REALTIME, &inode->i_mtime);
+  } else if (err == 0 && (to_set & FUSE_SET_ATTR_MTIME)) {
+    inode->i_mtime = attr->st_mtim;
+  }
+  journal_dirty_meta(fs, inode, sizeof(*inode));
+  pthread_rwlock_unlock(&fs->ilocks[i]);
+  journal_end(fs);
+
+  if (err < 0) {
+    fuse_reply_err(req, -err);
+    return;
+  }
+  struct stat st;
+  ll_stat(fs, i, &st);
+  fuse_reply_attr(req, &st, req_opts(req)->attr_timeout);
+}
+
+/**
+ * Read a directory. The offset of an entry is its dentry position plus one,
+ * so a listing can be resumed from any entry.
+ */
+static void
+ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+           struct fuse_file_info* fi)
+{
+  (void)fi; // unused
+  fs_ctx* fs = req_fs(req);
+  vsfs_ino_t i = to_vsfs(ino);
+  vsfs_inode* dir = &fs->itable[i];
+
+  char* buf = malloc(size);
+  if (buf == NULL) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+
+  size_t used = 0;
+  pthread_rwlock_rdlock(&fs->ilocks[i]);
+  for (uint32_t pos = off; pos < dir_nentries(dir); pos++) {
+    vsfs_dentry* d = dir_get_entry(fs, dir, pos);
+    if (d->ino == VSFS_INO_MAX) continue;
+
+    // Only the inode number and the file type are used
+    struct stat st = { 0 };
+    st.st_ino = to_fuse(d->ino);
+    st.st_mode = fs->itable[d->ino].i_mode;
+    size_t n = fuse_add_direntry(req, buf + used, size - used, d->name, &st,
+                                 pos + 1);
+    if (n > size - used) break;
+    used += n;
+  }
+  pthread_rwlock_unlock(&fs->ilocks[i]);
+
+  fuse_reply_buf(req, buf, used);
+  free(buf);
+}
+
+/** Common part of mkdir and create. */
+static void
+ll_make(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode,
+        struct fuse_file_info* fi)
+{
+  fs_ctx* fs = req_fs(req);
+  vsfs_ino_t dir = to_vsfs(parent);
+  size_t len = strlen(name);
+  if (len >= VSFS_NAME_MAX) {
+    fuse_reply_err(req, ENAMETOOLONG);
+    return;
+  }
+
+  vsfs_ino_t ino;
+  journal_begin(fs);
+  pthread_rwlock_wrlock(&fs->ilocks[dir]);
+  int err = S_ISDIR(mode) ? dir_mkdir(fs, dir, name, len, mode, &ino)
+                          : dir_create(fs, dir, name, len, mode, &ino);
+  if (err == 0) {
+    get_ref(fs, ino);
+  }
+  pthread_rwlock_unlock(&fs->ilocks[dir]);
+  journal_end(fs);
+
+  if (err < 0) {
+    fuse_reply_err(req, -err);
+    return;
+  }
+  reply_entry(req, fs, ino, fi);
+}
+
+static void
+ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode)
+{
+  ll_make(req, parent, name, mode | S_IFDIR, NULL);
+}
+
+static void
+ll_create(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode,
+          struct fuse_file_info* fi)
+{
+  if (!S_ISREG(mode)) {
+    fuse_reply_err(req, EINVAL);
+    return;
+  }
+  ll_make(req, parent, name, mode, fi);
+}
+
+/** Common part of unlink and rmdir. */
+static void
+ll_remove(fuse_req_t req, fuse_ino_t parent, const char* name, bool is_dir)
+{
+  fs_ctx* fs = req_fs(req);
+  vsfs_ino_t dir = to_vsfs(parent);
+  size_t len = strlen(name);
+
+  journal_begin(fs);
+  pthread_rwlock_wrlock(&fs->ilocks[dir]);
+  int err = is_dir ? dir_rmdir(fs, dir, name, len)
+                   : dir_unlink(fs, dir, name, len);
+  pthread_rwlock_unlock(&fs->ilocks[dir]);
+  journal_end(fs);
+  fuse_reply_err(req, -err);
+}
+
+static void
+ll_unlink(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+  ll_remove(req, parent, name, false);
+}
+
+static void
+ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+  ll_remove(req, parent, name, true);
+}
+
+/** Get the readahead state of an open file; NULL if there is none. */
+static readahead_state*
+file_ra(struct fuse_file_info* fi)
+{
+  return (readahead_state*)(uintptr_t)fi->fh;
+}
+
+/**
+ * Open a file. The file handle (fi->fh) points to the readahead state of the
+ * open file (see readahead.h); without memory for it, the file is opened
+ * without readahead.
+ */
+static void
+ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+  (void)ino; // unused
+  fi->keep_cache = req_opts(req)->kernel_cache;
+  fi->fh = (uintptr_t)calloc(1, sizeof(readahead_state));
+  fuse_reply_open(req, fi);
+}
+
+static void
+ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+  (void)ino; // unused
+  free(file_ra(fi));
+  fuse_reply_err(req, 0);
+}
+
+/** Free a buffer vector returned by inode_read_buf(). */
+static void
+free_bufvec(struct fuse_bufvec* vec)
+{
+  for (size_t i = 0; i < vec->count; i++) {
+    free(vec->buf[i].mem);
+  }
+  free(vec);
+}
+
+/**
+ * Read data from a file. The data is spliced to the kernel from the image
+ * file (see inode_read_buf()); the reply is sent under the inode lock so that
+ * the blocks can't be freed before FUSE has moved the data.
+ */
+static void
+ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+        struct fuse_file_info* fi)
+{
+  fs_ctx* fs = req_fs(req);
+  vsfs_ino_t i = to_vsfs(ino);
+
+  struct fuse_bufvec* vec;
+  pthread_rwlock_rdlock(&fs->ilocks[i]);
+  int err = inode_read_buf(fs, &fs->itable[i], size, off, &vec);
+  if (err == 0) {
+    fuse_reply_data(req, vec, FUSE_BUF_SPLICE_MOVE);
+    if (file_ra(fi) != NULL) {
+      readahead_read(fs, i, file_ra(fi), off, fuse_buf_size(vec));
+    }
+  }
+  pthread_rwlock_unlock(&fs->ilocks[i]);
+
+  if (err < 0) {
+    fuse_reply_err(req, -err);
+    return;
+  }
+  free_bufvec(vec);
+}
+
+static void
+ll_write(fuse_req_t req, fuse_ino_t ino, const char* buf, size_t size,
+         off_t off, struct fuse_file_info* fi)
+{
+  (void)fi; // unused
+  fs_ctx* fs = req_fs(req);
+  vsfs_ino_t i = to_vsfs(ino);
+
+  journal_begin(fs);
+  pthread_rwlock_wrlock(&fs->ilocks[i]);
+  int err = inode_write(fs, &fs->itable[i], buf, size, off);
+  pthread_rwlock_unlock(&fs->ilocks[i]);
+  journal_end(fs);
+
+  if (err < 0) {
+    fuse_reply_err(req, -err);
+  } else {
+    fuse_reply_write(req, size);
+  }
+}
+
+static void
+ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec* bufv,
+             off_t off, struct fuse_file_info* fi)
+{
+  (void)fi; // unused
+  fs_ctx* fs = req_fs(req);
+  vsfs_ino_t i = to_vsfs(ino);
+
+  journal_begin(fs);
+  pthread_rwlock_wrlock(&fs->ilocks[i]);
+  ssize_t res = inode_write_buf(fs, &fs->itable[i], bufv, off);
+  pthread_rwlock_unlock(&fs->ilocks[i]);
+  journal_end(fs);
+
+  if (res < 0) {
+    fuse_reply_err(req, -res);
+  } else {
+    fuse_reply_write(req, res);
+  }
+}
+
+/** Write back a file or directory; see vsfs_fsync(). */
+static void
+ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+         struct fuse_file_info* fi)
+{
+  (void)datasync; // unused
+  (void)fi;       // unused
+  fs_ctx* fs = req_fs(req);
+  vsfs_ino_t i = to_vsfs(ino);
+
+  int err = 0;
+  if (fs->durability == VSFS_DURABILITY_FSYNC && fs->journal.enabled) {
+    err = journal_sync(fs);
+  } else if (fs->durability == VSFS_DURABILITY_FSYNC) {
+    pthread_rwlock_rdlock(&fs->ilocks[i]);
+    err = inode_sync(fs, i);
+    pthread_rwlock_unlock(&fs->ilocks[i]);
+  }
+  fuse_reply_err(req, -err);
+}
+
+static void
+ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+  (void)ino; // unused
+  struct statvfs st;
+  fs_ctx_statfs(req_fs(req), &st);
+  fuse_reply_statfs(req, &st);
+}
+
+static void
+ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char* name, size_t size)
+{
+  // Only the root directory has attributes: the cache and write-back
+  // counters
+  char value[32];
+  ssize_t len = -ENODATA;
+  if (ino == FUSE_ROOT_ID) {
+    len = cache_getxattr(req_fs(req), name, value, sizeof(value));
+    if (len == -ENODATA) {
+      len = writeback_getxattr(req_fs(req), name, value, sizeof(value));
+    }
+  }
+  if (len < 0) {
+    fuse_reply_err(req, -len);
+  } else if (size == 0) {
+    fuse_reply_xattr(req, len);
+  } else if (size < (size_t)len) {
+    fuse_reply_err(req, ERANGE);
+  } else {
+    fuse_reply_buf(req, value, len);
+  }
+}
+
+static struct fuse_lowlevel_ops vsfs_ll_ops = {
+  .init = ll_init,
+  .lookup = ll_lookup,
+  .forget = ll_forget,
+  .forget_multi = ll_forget_multi,
+  .getattr = ll_getattr,
+  .setattr = ll_setattr,
+  .readdir = ll_readdir,
+  .mkdir = ll_mkdir,
+  .rmdir = ll_rmdir,
+  .create = ll_create,
+  .unlink = ll_unlink,
+  .open = ll_open,
+  .release = ll_release,
+  .read = ll_read,
+  .write = ll_write,
+  .write_buf = ll_write_buf,
+  .statfs = ll_statfs,
+  .getxattr = ll_getxattr,
+  .fsync = ll_fsync,
+  .fsyncdir = ll_fsync,
+};
+
+/**
+ * Free inodes that were unlinked while the kernel still held references to
+ * them and that were not forgotten before the file system was unmounted.
+ * The commit and write-back threads are still running, so each inode is
+ * freed in an operation of its own, which also keeps every transaction
+ * within the journal.
+ */
+static void
+free_orphans(fs_ctx* fs)
+{
+  for (vsfs_ino_t i = 0; i < fs->sb->num_inodes; i++) {
+    if (!bitmap_isset(fs->ibmap, fs->sb->num_inodes, i) ||
+        fs->itable[i].i_nlink != 0) {
+      continue;
+    }
+    journal_begin(fs);
+    pthread_rwlock_wrlock(&fs->ilocks[i]);
+    inode_free(fs, i);
+    pthread_rwlock_unlock(&fs->ilocks[i]);
+    journal_end(fs);
+  }
+}
+
+int
+vsfs_ll_main(struct fuse_args* args, fs_ctx* fs, const vsfs_opts* opts)
+{
+  ll_ctx ctx = { .fs = fs, .opts = opts };
+  char* mountpoint = NULL;
+  int multithreaded;
+  int foreground;
+  int err = -1;
+
+  fs->nlookup = calloc(fs->sb->num_inodes, sizeof(uint64_t));
+  if (fs->nlookup == NULL) {
+    return 1;
+  }
+
+  if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) ==
+      -1) {
+    return 1;
+  }
+
+  struct fuse_chan* ch = fuse_mount(mountpoint, args);
+  if (ch != NULL) {
+    struct fuse_session* se =
+      fuse_lowlevel_new(args, &vsfs_ll_ops, sizeof(vsfs_ll_ops), &ctx);
+    if (se != NULL) {
+      if (fuse_set_signal_handlers(se) != -1) {
+        fuse_session_add_chan(se, ch);
+        fuse_daemonize(foreground);
+        if (!flush_start(fs)) {
+          fprintf(stderr, "Failed to start the write-back thread\n");
+        }
+        if (!readahead_start(fs)) {
+          fprintf(stderr, "Failed to start the readahead thread\n");
+        }
+        err = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+        // Orphans are freed below, so nothing may prefetch their blocks
+        readahead_stop(fs);
+        fuse_remove_signal_handlers(se);
+        fuse_session_remove_chan(ch);
+      }
+      fuse_session_destroy(se);
+    }
+    fuse_unmount(mountpoint, ch);
+  }
+  free(mountpoint);
+
+  free_orphans(fs);
+  return err ? 1 : 0;
+}
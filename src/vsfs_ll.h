@@ -0,0 +1,26 @@
+/**
+ * vsfs low-level (inode-based) FUSE backend header file.
+ */
+
+#pragma once
+
+#include <fuse_opt.h>
+
+#include "fs_ctx.h"
+#include "options.h"
+
+/**
+ * Mount the file system with the low-level FUSE API and serve requests
+ * until it is unmounted.
+ *
+ * Takes the place of fuse_main() when the file system is mounted with
+ * -o lowlevel. The caller still owns the file system context and must
+ * destroy it afterwards.
+ *
+ * @param args  FUSE command line arguments (mount point and options).
+ * @param fs    initialized file system context.
+ * @param opts  vsfs options; the cache timeouts are used in replies.
+ * @return      0 on success; 1 on failure.
+ */
+int
+vsfs_ll_main(struct fuse_args* args, fs_ctx* fs, const vsfs_opts* opts);
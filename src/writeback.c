@@ -0,0 +1,335 @@
+/**
+ * Dirty block tracking and background write-back implementation.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bdev.h"
+#include "writeback.h"
+#include "util.h"
+
+// Dirty and writing bits are ordered (see fs_writeback.writing), hence
+// seq_cst
+static bool
+test_bit(bitmap_t* bm, vsfs_blk_t blk)
+{
+  return __atomic_load_n(&bm[blk / BDEV_WORD_BITS], __ATOMIC_SEQ_CST) &
+         ((bitmap_t)1 << (blk % BDEV_WORD_BITS));
+}
+
+/** Set or clear the bits of a run of blocks; returns how many changed. */
+static uint32_t
+change_bits(bitmap_t* bm, vsfs_blk_t start, uint32_t n, bool set)
+{
+  uint32_t count = 0;
+  for (vsfs_blk_t b = start; b < start + n; b++) {
+    bitmap_t* w = &bm[b / BDEV_WORD_BITS];
+    bitmap_t bit = (bitmap_t)1 << (b % BDEV_WORD_BITS);
+    bitmap_t old = set ? __atomic_fetch_or(w, bit, __ATOMIC_SEQ_CST)
+                       : __atomic_fetch_and(w, ~bit, __ATOMIC_SEQ_CST);
+    count += set ? !(old & bit) : !!(old & bit);
+  }
+  return count;
+}
+
+/** Get the time a number of milliseconds from now, for timed waits. */
+static struct timespec
+deadline_after(uint64_t ms)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_REALTIME, &t);
+  t.tv_sec += ms / 1000;
+  t.tv_nsec += (long)(ms % 1000) * 1000000;
+  if (t.tv_nsec >= 1000000000) {
+    t.tv_sec++;
+    t.tv_nsec -= 1000000000;
+  }
+  return t;
+}
+
+bool
+writeback_init(fs_ctx* fs)
+{
+  fs_writeback* wb = &fs->writeback;
+  memset(wb, 0, sizeof(*wb));
+  if (fs->journal.enabled) return true;
+
+  wb->enabled = true;
+  pthread_mutex_init(&wb->lock, NULL);
+  pthread_cond_init(&wb->wake, NULL);
+
+  // Dirty blocks must not crowd out the rest of a limited cache
+  wb->threshold = (fs->cache.capacity > 0) ? fs->cache.capacity / 4
+                                           : VSFS_WRITEBACK_DIRTY_BLOCKS;
+
+  size_t words = div_round_up(fs->dev.nblocks, BDEV_WORD_BITS);
+  wb->dirty = calloc(words, sizeof(bitmap_t));
+  wb->writing = calloc(words, sizeof(bitmap_t));
+  return wb->dirty != NULL && wb->writing != NULL;
+}
+
+void
+writeback_destroy(fs_ctx* fs)
+{
+  fs_writeback* wb = &fs->writeback;
+  if (!wb->enabled) return;
+
+  free(wb->dirty);
+  free(wb->writing);
+  pthread_mutex_destroy(&wb->lock);
+  pthread_cond_destroy(&wb->wake);
+  memset(wb, 0, sizeof(*wb));
+}
+
+void
+writeback_kick(fs_ctx* fs)
+{
+  fs_writeback* wb = &fs->writeback;
+  pthread_mutex_lock(&wb->lock);
+  __atomic_store_n(&wb->kicked, true, __ATOMIC_RELAXED);
+  pthread_cond_signal(&wb->wake);
+  pthread_mutex_unlock(&wb->lock);
+}
+
+void
+writeback_dirty(fs_ctx* fs, const void* addr, size_t len)
+{
+  fs_writeback* wb = &fs->writeback;
+  if (!wb->enabled || len == 0) return;
+
+  size_t off = (const char*)addr - (const char*)fs->image;
+  vsfs_blk_t last = (off + len - 1) / VSFS_BLOCK_SIZE;
+  for (vsfs_blk_t b = off / VSFS_BLOCK_SIZE; b <= last; b++) {
+    bitmap_t* w = &wb->dirty[b / BDEV_WORD_BITS];
+    bitmap_t bit = (bitmap_t)1 << (b % BDEV_WORD_BITS);
+    // Blocks are usually dirtied many times before they are written back
+    if (__atomic_load_n(w, __ATOMIC_RELAXED) & bit) continue;
+    if (!(__atomic_fetch_or(w, bit, __ATOMIC_RELAXED) & bit)) {
+      __atomic_add_fetch(&wb->ndirty, 1, __ATOMIC_RELAXED);
+    }
+  }
+
+  // Once per write-back (kicked stays set if the thread isn't running)
+  if (__atomic_load_n(&wb->ndirty, __ATOMIC_RELAXED) >= wb->threshold &&
+      !__atomic_load_n(&wb->kicked, __ATOMIC_RELAXED)) {
+    writeback_kick(fs);
+  }
+}
+
+bool
+writeback_busy(fs_ctx* fs, vsfs_blk_t blk)
+{
+  fs_writeback* wb = &fs->writeback;
+  // In this order: the dirty bit is cleared after the writing bit is set
+  return test_bit(wb->dirty, blk) || test_bit(wb->writing, blk);
+}
+
+/**
+ * Wait until writing a number of bytes since a start time keeps to the rate
+ * limit. Returns false if the thread is stopped while waiting.
+ */
+static bool
+pace(fs_writeback* wb, const struct timespec* start, uint64_t bytes)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double elapsed = (double)(now.tv_sec - start->tv_sec) +
+                   (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+  double ahead = (double)bytes / (double)wb->rate - elapsed;
+  if (ahead <= 0) return true;
+
+  // A timed wait rather than a sleep, so that stopping isn't held up
+  struct timespec deadline = deadline_after((uint64_t)(ahead * 1000) + 1);
+  pthread_mutex_lock(&wb->lock);
+  int err = 0;
+  while (wb->running && err != ETIMEDOUT) {
+    err = pthread_cond_timedwait(&wb->wake, &wb->lock, &deadline);
+  }
+  bool running = wb->running;
+  pthread_mutex_unlock(&wb->lock);
+  return running;
+}
+
+/**
+ * Write back a batch of runs, marked as being written, and clear the marks.
+ * Runs that fail are marked dirty again.
+ */
+static int
+write_batch(fs_ctx* fs, const bdev_run* runs, uint32_t count)
+{
+  fs_writeback* wb = &fs->writeback;
+  int err = bdev_write(&fs->dev, runs, count);
+  for (uint32_t i = 0; i < count; i++) {
+    if (err < 0) {
+      // Some of the runs may have been written; it does no harm to redo them
+      uint32_t n = change_bits(wb->dirty, runs[i].start, runs[i].n, true);
+      __atomic_add_fetch(&wb->ndirty, n, __ATOMIC_RELAXED);
+    } else {
+      __atomic_add_fetch(&wb->written, runs[i].n, __ATOMIC_RELAXED);
+    }
+    change_bits(wb->writing, runs[i].start, runs[i].n, false);
+  }
+  return err;
+}
+
+/**
+ * Write back the dirty blocks of a range, one write per run of adjacent
+ * dirty blocks, handing the runs to the block device in batches. Keeps to
+ * the rate limit if paced (which needs one).
+ */
+static int
+write_dirty(fs_ctx* fs, vsfs_blk_t start, uint32_t n, bool paced)
+{
+  fs_writeback* wb = &fs->writeback;
+  vsfs_blk_t end = start + n;
+  bdev_run batch[VSFS_WRITEBACK_BATCH];
+  uint32_t count = 0;
+  struct timespec t0;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  uint64_t bytes = 0;
+  uint64_t paced_bytes = 0;
+  int err = 0;
+
+  // The bitmap is in block order, so the runs come out sorted
+  for (vsfs_blk_t b = start; b < end && err == 0;) {
+    if (b % BDEV_WORD_BITS == 0 && b + BDEV_WORD_BITS <= end &&
+        __atomic_load_n(&wb->dirty[b / BDEV_WORD_BITS],
+                        __ATOMIC_RELAXED) == 0) {
+      b += BDEV_WORD_BITS;
+      continue;
+    }
+    if (!test_bit(wb->dirty, b)) {
+      b++;
+      continue;
+    }
+    uint32_t len = 1;
+    while (b + len < end && len < VSFS_WRITEBACK_MAX_RUN &&
+           test_bit(wb->dirty, b + len)) {
+      len++;
+    }
+
+    // Marked as being written first, so that the blocks are not dropped from
+    // the cache; the dirty bits are cleared before the write, so that a
+    // change while the run is written marks it dirty again
+    change_bits(wb->writing, b, len, true);
+    uint32_t cleared = change_bits(wb->dirty, b, len, false);
+    __atomic_sub_fetch(&wb->ndirty, cleared, __ATOMIC_RELAXED);
+    batch[count++] = (bdev_run){ .start = b, .n = len };
+    b += len;
+    bytes += (uint64_t)len * VSFS_BLOCK_SIZE;
+
+    // Paced batches are kept to about a tenth of a second's worth, so that
+    // they don't overshoot the rate by much
+    if (count == VSFS_WRITEBACK_BATCH ||
+        (paced && bytes - paced_bytes >= wb->rate / 10)) {
+      err = write_batch(fs, batch, count);
+      count = 0;
+      paced_bytes = bytes;
+      if (paced && err == 0 && !pace(wb, &t0, bytes)) break;
+    }
+  }
+  if (count > 0) {
+    int e = write_batch(fs, batch, count);
+    err = (err == 0) ? e : err;
+  }
+  return err;
+}
+
+int
+writeback_flush(fs_ctx* fs, vsfs_blk_t start, uint32_t n, bool wait)
+{
+  int err = write_dirty(fs, start, n, false);
+  if (err == 0 && wait) {
+    err = bdev_sync(&fs->dev);
+  }
+  return err;
+}
+
+// Write-back thread: write back dirty blocks every interval ms, or earlier
+// when woken up by writeback_kick(), until writeback_stop() clears running
+static void*
+writeback_main(void* arg)
+{
+  fs_ctx* fs = (fs_ctx*)arg;
+  fs_writeback* wb = &fs->writeback;
+
+  pthread_mutex_lock(&wb->lock);
+  while (wb->running) {
+    struct timespec deadline = deadline_after(wb->interval);
+    int err = 0;
+    while (wb->running && !wb->kicked && err != ETIMEDOUT) {
+      err = pthread_cond_timedwait(&wb->wake, &wb->lock, &deadline);
+    }
+    if (!wb->running) break;
+    __atomic_store_n(&wb->kicked, false, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&wb->lock);
+    if (__atomic_load_n(&wb->ndirty, __ATOMIC_RELAXED) > 0) {
+      write_dirty(fs, 0, fs->dev.nblocks, wb->rate > 0);
+    }
+    pthread_mutex_lock(&wb->lock);
+  }
+  pthread_mutex_unlock(&wb->lock);
+  return NULL;
+}
+
+bool
+writeback_start(fs_ctx* fs)
+{
+  fs_writeback* wb = &fs->writeback;
+  if (!wb->enabled) return true;
+
+  wb->interval = (fs->writeback_interval > 0) ? fs->writeback_interval
+                                              : VSFS_WRITEBACK_INTERVAL;
+  wb->rate = (uint64_t)fs->writeback_rate * 1024 * 1024;
+
+  pthread_mutex_lock(&wb->lock);
+  wb->running = true;
+  if (pthread_create(&wb->thread, NULL, writeback_main, fs) != 0) {
+    wb->running = false;
+  }
+  bool running = wb->running;
+  pthread_mutex_unlock(&wb->lock);
+  return running;
+}
+
+void
+writeback_stop(fs_ctx* fs)
+{
+  fs_writeback* wb = &fs->writeback;
+  if (!wb->enabled) return;
+
+  pthread_mutex_lock(&wb->lock);
+  bool running = wb->running;
+  wb->running = false;
+  pthread_cond_signal(&wb->wake);
+  pthread_mutex_unlock(&wb->lock);
+  if (running) {
+    pthread_join(wb->thread, NULL);
+  }
+}
+
+ssize_t
+writeback_getxattr(fs_ctx* fs, const char* name, char* value, size_t size)
+{
+  fs_writeback* wb = &fs->writeback;
+  size_t prefix = strlen(VSFS_WRITEBACK_XATTR_PREFIX);
+  if (!wb->enabled ||
+      strncmp(name, VSFS_WRITEBACK_XATTR_PREFIX, prefix) != 0) {
+    return -ENODATA;
+  }
+  name += prefix;
+
+  uint64_t v;
+  if (strcmp(name, "dirty") == 0) {
+    v = __atomic_load_n(&wb->ndirty, __ATOMIC_RELAXED);
+  } else if (strcmp(name, "written") == 0) {
+    v = __atomic_load_n(&wb->written, __ATOMIC_RELAXED);
+  } else {
+    return -ENODATA;
+  }
+  return format_xattr(v, value, size);
+}
@@ -0,0 +1,154 @@
+/**
+ * Dirty block tracking and background write-back header file.
+ *
+ * Without a journal, vsfs records itself which blocks of the image have
+ * changed (see writeback_dirty(), called by journal_dirty_meta() and
+ * journal_dirty_data()) in a dirty bitmap alongside dbmap, and a background
+ * thread writes them back: every -o writeback_interval milliseconds, or as
+ * soon as enough blocks are dirty (a quarter of the block cache with a
+ * limit, VSFS_WRITEBACK_DIRTY_BLOCKS otherwise).
+ *
+ * The bitmap is scanned in block order, and adjacent dirty blocks are
+ * merged into runs of up to VSFS_WRITEBACK_MAX_RUN blocks, each written
+ * with one request: a pwrite() with the pread engine, io_uring requests
+ * that are all in flight at once with the uring engine, and with the mmap
+ * engine a sync_file_range() that starts writing the dirty pages of the
+ * run (msync(MS_ASYNC) does nothing on Linux). The thread can be rate
+ * limited (-o writeback_rate), so that write-back doesn't starve reads.
+ * Flushes (see flush.h) write back the same way, but are never rate
+ * limited.
+ *
+ * With the mmap engine the kernel may still write dirty pages back on its
+ * own before that; the thread just keeps it from having to, and writes in
+ * large sequential runs when it does.
+ *
+ * With a journal, commits write back all changes instead, and none of this
+ * is used.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "fs_ctx.h"
+
+/** Default period of the write-back thread in milliseconds. */
+#define VSFS_WRITEBACK_INTERVAL 5000
+
+/** Dirty blocks that wake up the write-back thread without a cache limit. */
+#define VSFS_WRITEBACK_DIRTY_BLOCKS 4096
+
+/** Most blocks written back with a single write. */
+#define VSFS_WRITEBACK_MAX_RUN 256
+
+/** Most runs handed to the block device at a time (see bdev_write()). */
+#define VSFS_WRITEBACK_BATCH 32
+
+/** Prefix of the names of the write-back counter extended attributes. */
+#define VSFS_WRITEBACK_XATTR_PREFIX "user.vsfs.writeback_"
+
+/**
+ * Set up dirty block tracking, unless the image has a journal. Called by
+ * fs_ctx_init() after the journal and the block cache have been set up.
+ *
+ * @param fs  file system context; dev, journal and cache must be set.
+ * @return    true on success; false on failure (out of memory).
+ */
+bool
+writeback_init(fs_ctx* fs);
+
+/**
+ * Release dirty block tracking. Changes that have not been written back
+ * are lost with the pread engine; see writeback_flush(). Called by
+ * fs_ctx_destroy().
+ *
+ * @param fs  file system context.
+ */
+void
+writeback_destroy(fs_ctx* fs);
+
+/**
+ * Start the write-back thread with the period and rate limit set in the
+ * context (writeback_interval, writeback_rate). Must be called after FUSE
+ * has daemonized, since threads don't survive fork(). Does nothing with a
+ * journal.
+ *
+ * @param fs  file system context.
+ * @return    true on success; false if the thread could not be started.
+ */
+bool
+writeback_start(fs_ctx* fs);
+
+/**
+ * Stop the write-back thread, if running, cutting short any rate limit
+ * wait. Changes that are not written back yet stay dirty.
+ *
+ * @param fs  file system context.
+ */
+void
+writeback_stop(fs_ctx* fs);
+
+/**
+ * Record a change to the image: the blocks that contain the byte range are
+ * written back by the write-back thread or the next flush. Does nothing
+ * with a journal.
+ *
+ * @param fs    file system context.
+ * @param addr  start of the changed range in the image.
+ * @param len   length of the range in bytes.
+ */
+void
+writeback_dirty(fs_ctx* fs, const void* addr, size_t len);
+
+/**
+ * Check if a block has changes that are not written back yet, or is being
+ * written back; such a block must stay in the block cache.
+ *
+ * @param fs   file system context.
+ * @param blk  block number.
+ * @return     true if the block is dirty or being written back.
+ */
+bool
+writeback_busy(fs_ctx* fs, vsfs_blk_t blk);
+
+/**
+ * Wake up the write-back thread before its period is over.
+ *
+ * @param fs  file system context.
+ */
+void
+writeback_kick(fs_ctx* fs);
+
+/**
+ * Write back the dirty blocks of a range now, merging adjacent blocks into
+ * single writes, without a rate limit.
+ *
+ * @param fs     file system context.
+ * @param start  first block number.
+ * @param n      number of blocks.
+ * @param wait   also wait for everything written so far to reach the disk.
+ * @return       0 on success; -errno on error, in which case the blocks
+ *               that were not written stay dirty.
+ */
+int
+writeback_flush(fs_ctx* fs, vsfs_blk_t start, uint32_t n, bool wait);
+
+/**
+ * Get the value of a write-back counter extended attribute of the root
+ * directory, with getxattr(2) semantics. The names are
+ * VSFS_WRITEBACK_XATTR_PREFIX followed by dirty (blocks not written back
+ * yet) or written (blocks written back so far); the values are decimal
+ * numbers.
+ *
+ * @param fs     file system context.
+ * @param name   attribute name.
+ * @param value  buffer for the value (not null-terminated).
+ * @param size   buffer size; 0 to only get the length of the value.
+ * @return       length of the value on success; -ENODATA if there is no
+ *               such attribute or a journal; -ERANGE if size is too small.
+ */
+ssize_t
+writeback_getxattr(fs_ctx* fs, const char* name, char* value, size_t size);
@@ -1,12 +1,17 @@
 import os
+import subprocess
+import time
+
 import pytest
 
 
 def pytest_addoption(parser):
-    """Add the mount_point, inode_count, and disk command line arguments."""
+    """Add the mount_point, inode_count, disk, vsfs and mkfs command line arguments."""
     parser.addoption('--mount_point', action='store', type=str)
     parser.addoption('--inode_count', action='store', type=int)
     parser.addoption('--disk', action='store', type=str)
+    parser.addoption('--vsfs', action='store', type=str)
+    parser.addoption('--mkfs', action='store', type=str)
 
 
 @pytest.fixture(scope='session')
@@ -48,3 +53,73 @@ def disk(request) -> str:
     if given_disk is None:
         pytest.skip()
     return os.path.basename(given_disk)
+
+
+@pytest.fixture(scope='session')
+def vsfs(request) -> str:
+    """Extract the vsfs argument from the command line: the path to the vsfs executable.
+
+    Tests that mount images of their own use it. If it was not given on the command line, then any tests that use
+    this as a parameter name will be skipped.
+    """
+    given_vsfs = request.config.option.vsfs
+    if given_vsfs is None:
+        pytest.skip()
+    return given_vsfs
+
+
+@pytest.fixture(scope='session')
+def mkfs(request) -> str:
+    """Extract the mkfs argument from the command line: the path to the mkfs.vsfs executable.
+
+    If it was not given on the command line, then any tests that use this as a parameter name will be skipped.
+    """
+    given_mkfs = request.config.option.mkfs
+    if given_mkfs is None:
+        pytest.skip()
+    return given_mkfs
+
+
+def _wait_for_mount(mount_point: str, mounted: bool) -> None:
+    for _ in range(100):
+        if os.path.ismount(mount_point) == mounted:
+            return
+        time.sleep(0.05)
+    raise TimeoutError(f'{mount_point} was not {"mounted" if mounted else "unmounted"}')
+
+
+@pytest.fixture(scope='session')
+def mount(vsfs):
+    """Return a function that mounts an image with vsfs and waits for the mount to appear.
+
+    The function takes the image, the mount point and any further vsfs command line arguments, e.g. '-o', 'lowlevel'.
+    """
+    def mount_image(image: str, mount_point: str, *options: str) -> None:
+        subprocess.run([vsfs, image, mount_point, *options], check=True)
+        _wait_for_mount(mount_point, True)
+    return mount_image
+
+
+@pytest.fixture(scope='session')
+def unmount():
+    """Return a function that unmounts a mount point with fusermount and waits for the mount to go away."""
+    def unmount_image(mount_point: str) -> None:
+        subprocess.run(['fusermount', '-u', mount_point], check=True)
+        _wait_for_mount(mount_point, False)
+    return unmount_image
+
+
+@pytest.fixture
+def make_image(mkfs, tmp_path):
+    """Return a function that creates an image file of the given size in tmp_path and formats it with mkfs.
+
+    The function takes the file name, the size in bytes and any further mkfs command line arguments, e.g. '-e', and
+    returns the path to the image.
+    """
+    def make(name: str, size: int, *options: str) -> str:
+        image = str(tmp_path / name)
+        with open(image, 'wb') as f:
+            f.truncate(size)
+        subprocess.run([mkfs, *options, image], check=True)
+        return image
+    return make
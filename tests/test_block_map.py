@@ -0,0 +1,61 @@
+import os
+
+BLOCK_SIZE = 4096
+IMAGE_SIZE = 16 * 1024 * 1024
+# Past the 5 direct pointers, so that reads go through the cached block map
+FILE_SIZE = 12 * BLOCK_SIZE + 100
+# More files than the 64 block maps that are cached at a time
+FILE_COUNT = 80
+
+
+def test_block_map_rebuilt(make_image, mount, unmount, tmp_path) -> None:
+    """Test that the cached block map of a pointer-format file follows its blocks as they are freed and added."""
+    image = make_image('bmap.disk', IMAGE_SIZE, '-i', '64')
+    mnt = str(tmp_path / 'mnt')
+    os.mkdir(mnt)
+
+    mount(image, mnt)
+    try:
+        path = os.path.join(mnt, 'test_block_map')
+        data = bytearray(os.urandom(FILE_SIZE))
+        with open(path, 'wb') as f:
+            f.write(data)
+        with open(path, 'rb') as f:
+            assert f.read() == data
+
+        # Down into the direct blocks and back up: the freed blocks read as zeroes
+        os.truncate(path, 2 * BLOCK_SIZE + 10)
+        os.truncate(path, FILE_SIZE)
+        data[2 * BLOCK_SIZE + 10:] = bytes(FILE_SIZE - (2 * BLOCK_SIZE + 10))
+        with open(path, 'rb') as f:
+            assert f.read() == data
+
+        patch = os.urandom(5 * BLOCK_SIZE)
+        with open(path, 'r+b') as f:
+            f.seek(4 * BLOCK_SIZE + 1)
+            f.write(patch)
+        data[4 * BLOCK_SIZE + 1:9 * BLOCK_SIZE + 1] = patch
+        with open(path, 'rb') as f:
+            assert f.read() == data
+    finally:
+        unmount(mnt)
+
+
+def test_block_map_evicted(make_image, mount, unmount, tmp_path) -> None:
+    """Test that files read back correctly once their block maps have been evicted from the cache."""
+    image = make_image('bmap.disk', IMAGE_SIZE, '-i', '128')
+    mnt = str(tmp_path / 'mnt')
+    os.mkdir(mnt)
+
+    mount(image, mnt)
+    try:
+        data = [os.urandom(FILE_SIZE) for _ in range(FILE_COUNT)]
+        for i, contents in enumerate(data):
+            with open(os.path.join(mnt, f'file{i}'), 'wb') as f:
+                f.write(contents)
+        for _ in range(2):
+            for i, contents in enumerate(data):
+                with open(os.path.join(mnt, f'file{i}'), 'rb') as f:
+                    assert f.read() == contents
+    finally:
+        unmount(mnt)
@@ -0,0 +1,34 @@
+import errno
+import os
+
+import pytest
+
+BLOCK_SIZE = 4096
+XATTR_PREFIX = 'user.vsfs.cache_'
+
+
+def cache_counter(mount_point: str, name: str) -> int:
+    """Return a block cache counter, skipping the test if the mount has no cache."""
+    try:
+        return int(os.getxattr(mount_point, XATTR_PREFIX + name))
+    except OSError as e:
+        if e.errno in (errno.ENODATA, errno.ENOTSUP):
+            pytest.skip('not mounted with -o io=pread or -o io=uring')
+        raise
+
+
+def test_cache_counters(mount_point: str) -> None:
+    """Test that the block cache counters of the root directory add up across I/O."""
+    hits = cache_counter(mount_point, 'hits')
+    misses = cache_counter(mount_point, 'misses')
+    path = os.path.join(mount_point, 'test_cache')
+    data = os.urandom(8 * BLOCK_SIZE + 100)
+    try:
+        with open(path, 'wb') as f:
+            f.write(data)
+        with open(path, 'rb') as f:
+            assert f.read() == data
+    finally:
+        os.remove(path)
+    # The partial last block is read in (or found) before it is written
+    assert cache_counter(mount_point, 'hits') + cache_counter(mount_point, 'misses') > hits + misses
@@ -0,0 +1,57 @@
+import os
+import shutil
+from concurrent.futures import ThreadPoolExecutor
+
+import pytest
+
+BLOCK_SIZE = 4096
+NUM_THREADS = 8
+
+
+@pytest.fixture()
+def root(mount_point: str):
+    """Return a scratch directory under mount_point and remove it afterwards."""
+    path = os.path.join(mount_point, 'test_concurrency')
+    os.mkdir(path)
+    yield path
+    shutil.rmtree(path, ignore_errors=True)
+
+
+def test_parallel_files(root: str) -> None:
+    """Test that threads writing and reading their own files see only their own data."""
+    def worker(i: int) -> bool:
+        subdir = os.path.join(root, f'd{i}')
+        os.mkdir(subdir)
+        path = os.path.join(subdir, 'data')
+        data = bytes([i]) * (3 * BLOCK_SIZE + i)
+        for _ in range(20):
+            with open(path, 'wb') as f:
+                f.write(data)
+            with open(path, 'rb') as f:
+                if f.read() != data:
+                    return False
+        os.unlink(path)
+        os.rmdir(subdir)
+        return True
+
+    with ThreadPoolExecutor(NUM_THREADS) as pool:
+        assert all(pool.map(worker, range(NUM_THREADS)))
+
+
+def test_parallel_create_unlink_same_directory(root: str) -> None:
+    """Test that concurrent creates and unlinks in one directory leave it consistent."""
+    def worker(i: int) -> None:
+        for j in range(16):
+            path = os.path.join(root, f'f{i}_{j}')
+            with open(path, 'wb') as f:
+                f.write(b'x')
+            if j % 4 != 0:
+                os.unlink(path)
+
+    before = os.statvfs(root)
+    with ThreadPoolExecutor(NUM_THREADS) as pool:
+        list(pool.map(worker, range(NUM_THREADS)))
+
+    expected = {f'f{i}_{j}' for i in range(NUM_THREADS) for j in range(0, 16, 4)}
+    assert set(os.listdir(root)) == expected
+    assert os.statvfs(root).f_ffree == before.f_ffree - len(expected)
@@ -0,0 +1,38 @@
+import os
+
+BLOCK_SIZE = 4096
+IMAGE_SIZE = 16 * 1024 * 1024
+# More blocks than the 341 extents that fit into a single extent block
+FILE_BLOCKS = 640
+
+
+def test_interleaved_appends(make_image, mount, unmount, tmp_path) -> None:
+    """Test that two files appended to in turn, a block at a time, grow past a single extent block."""
+    image = make_image('extents.disk', IMAGE_SIZE, '-i', '64', '-e')
+    mnt = str(tmp_path / 'mnt')
+    os.mkdir(mnt)
+    names = ['first', 'second']
+    data = {name: os.urandom(FILE_BLOCKS * BLOCK_SIZE) for name in names}
+
+    mount(image, mnt)
+    try:
+        fds = [os.open(os.path.join(mnt, name), os.O_WRONLY | os.O_CREAT | os.O_APPEND) for name in names]
+        try:
+            for i in range(0, FILE_BLOCKS * BLOCK_SIZE, BLOCK_SIZE):
+                for fd, name in zip(fds, names):
+                    assert os.write(fd, data[name][i:i + BLOCK_SIZE]) == BLOCK_SIZE
+        finally:
+            for fd in fds:
+                os.close(fd)
+    finally:
+        unmount(mnt)
+
+    mount(image, mnt)
+    try:
+        for name in names:
+            path = os.path.join(mnt, name)
+            assert os.stat(path).st_size == len(data[name])
+            with open(path, 'rb') as f:
+                assert f.read() == data[name]
+    finally:
+        unmount(mnt)
@@ -0,0 +1,47 @@
+import os
+import threading
+
+BLOCK_SIZE = 4096
+IMAGE_SIZE = 16 * 1024 * 1024
+THREADS = 8
+WRITES = 20
+
+
+def test_group_commit(make_image, mount, unmount, tmp_path) -> None:
+    """Test that fsync() calls from many threads at once, which share commits, all reach the image."""
+    image = make_image('group.disk', IMAGE_SIZE, '-i', '64', '-j', '64')
+    mnt = str(tmp_path / 'mnt')
+    os.mkdir(mnt)
+    data = {f'file{t}': [os.urandom(BLOCK_SIZE) for _ in range(WRITES)] for t in range(THREADS)}
+    errors = []
+
+    def writer(name: str) -> None:
+        try:
+            fd = os.open(os.path.join(mnt, name), os.O_WRONLY | os.O_CREAT)
+            try:
+                for block in data[name]:
+                    os.write(fd, block)
+                    os.fsync(fd)
+            finally:
+                os.close(fd)
+        except OSError as e:
+            errors.append(e)
+
+    mount(image, mnt, '-o', 'multithreaded,durability=fsync,commit_interval=50,commit_blocks=4')
+    try:
+        threads = [threading.Thread(target=writer, args=(name,)) for name in data]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        assert not errors
+    finally:
+        unmount(mnt)
+
+    mount(image, mnt)
+    try:
+        for name, blocks in data.items():
+            with open(os.path.join(mnt, name), 'rb') as f:
+                assert f.read() == b''.join(blocks)
+    finally:
+        unmount(mnt)
@@ -0,0 +1,20 @@
+import os
+
+BLOCK_SIZE = 4096
+
+
+def test_freed_blocks_reused(mount_point: str) -> None:
+    """Test that blocks of a deleted file, whose pages get -o free_hint, keep new data once reused."""
+    path = os.path.join(mount_point, 'test_hints')
+    for _ in range(3):
+        data = os.urandom(64 * BLOCK_SIZE)
+        with open(path, 'wb') as f:
+            f.write(data)
+        os.remove(path)
+        with open(path, 'wb') as f:
+            f.write(data)
+        try:
+            with open(path, 'rb') as f:
+                assert f.read() == data
+        finally:
+            os.remove(path)
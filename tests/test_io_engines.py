@@ -0,0 +1,54 @@
+import os
+import subprocess
+
+import pytest
+
+BLOCK_SIZE = 4096
+IMAGE_SIZE = 16 * 1024 * 1024
+
+
+def mount_engine(mount, image: str, mount_point: str, engine: str) -> None:
+    """Mount an image with an I/O engine, skipping the test if the kernel has no io_uring for the uring engine."""
+    try:
+        mount(image, mount_point, '-o', f'io={engine}')
+    except subprocess.CalledProcessError:
+        if engine == 'uring':
+            pytest.skip('io_uring is not available')
+        raise
+
+
+@pytest.mark.parametrize('engine', ['pread', 'uring'])
+@pytest.mark.parametrize('journal', [False, True], ids=['plain', 'journal'])
+def test_engine_round_trip(engine: str, journal: bool, make_image, mount, unmount, tmp_path) -> None:
+    """Test that data written through an I/O engine reads back unchanged, before and after a remount."""
+    options = ['-i', '64'] + (['-j', '64'] if journal else [])
+    image = make_image('engine.disk', IMAGE_SIZE, *options)
+    mnt = str(tmp_path / 'mnt')
+    os.mkdir(mnt)
+    data = bytearray(os.urandom(10 * BLOCK_SIZE + 123))
+    patch = os.urandom(2 * BLOCK_SIZE)
+    offset = BLOCK_SIZE - 7
+
+    mount_engine(mount, image, mnt, engine)
+    try:
+        os.mkdir(os.path.join(mnt, 'dir'))
+        path = os.path.join(mnt, 'dir', 'test_io_engines')
+        with open(path, 'wb') as f:
+            f.write(data)
+        with open(path, 'r+b') as f:
+            f.seek(offset)
+            f.write(patch)
+        data[offset:offset + len(patch)] = patch
+        with open(path, 'rb') as f:
+            assert f.read() == data
+    finally:
+        unmount(mnt)
+
+    mount_engine(mount, image, mnt, engine)
+    try:
+        path = os.path.join(mnt, 'dir', 'test_io_engines')
+        assert os.stat(path).st_size == len(data)
+        with open(path, 'rb') as f:
+            assert f.read() == data
+    finally:
+        unmount(mnt)
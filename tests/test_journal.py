@@ -0,0 +1,108 @@
+import os
+import shutil
+import struct
+
+BLOCK_SIZE = 4096
+IMAGE_SIZE = 16 * 1024 * 1024
+
+# On-disk format; see vsfs.h
+SUPERBLOCK = struct.Struct('<QQIIIIIIII')
+JOURNAL_BLOCK = struct.Struct('<QQIIQ')
+JOURNAL_MAGIC = 0x4C4E524A53465356
+JOURNAL_HEADER = 1
+JOURNAL_DESC = 2
+JOURNAL_COMMIT = 3
+DESC_MAX = (BLOCK_SIZE - JOURNAL_BLOCK.size) // 4
+CHECKSUM_SEED = 0xcbf29ce484222325
+MASK = (1 << 64) - 1
+
+
+def checksum(total: int, data: bytes) -> int:
+    """Add data to a transaction checksum like journal.c does: FNV-1a over 8-byte little-endian words."""
+    for i in range(0, len(data), 8):
+        word = int.from_bytes(data[i:i + 8], 'little')
+        total = ((total ^ word) * 0x100000001b3) & MASK
+    return total
+
+
+def read_blocks(path: str) -> list:
+    with open(path, 'rb') as f:
+        data = f.read()
+    return [data[i:i + BLOCK_SIZE] for i in range(0, len(data), BLOCK_SIZE)]
+
+
+def journal_location(blocks: list) -> tuple:
+    """Return the first block and the length of the journal of an image."""
+    sb = SUPERBLOCK.unpack_from(blocks[0])
+    return sb[8], sb[9]
+
+
+def log_transaction(path: str, home: dict) -> None:
+    """Append one committed transaction to the (empty) journal of an image, logging the given home blocks."""
+    blocks = read_blocks(path)
+    start, length = journal_location(blocks)
+    magic, seq, kind, _, _ = JOURNAL_BLOCK.unpack_from(blocks[start])
+    assert magic == JOURNAL_MAGIC and kind == JOURNAL_HEADER
+
+    numbers = sorted(home)
+    log = []
+    total = CHECKSUM_SEED
+    for i in range(0, len(numbers), DESC_MAX):
+        chunk = numbers[i:i + DESC_MAX]
+        listed = struct.pack(f'<{len(chunk)}I', *chunk)
+        desc = JOURNAL_BLOCK.pack(JOURNAL_MAGIC, seq, JOURNAL_DESC, len(chunk), 0) + listed
+        log.append(desc.ljust(BLOCK_SIZE, b'\0'))
+        copies = [home[n] for n in chunk]
+        log.extend(copies)
+        total = checksum(total, listed)
+        total = checksum(total, b''.join(copies))
+    commit = JOURNAL_BLOCK.pack(JOURNAL_MAGIC, seq, JOURNAL_COMMIT, len(numbers), total)
+    log.append(commit.ljust(BLOCK_SIZE, b'\0'))
+    assert len(log) <= length - 1, 'transaction does not fit in the journal'
+
+    with open(path, 'r+b') as f:
+        f.seek((start + 1) * BLOCK_SIZE)
+        f.write(b''.join(log))
+
+
+def test_journal_replay(make_image, mount, unmount, tmp_path) -> None:
+    """Test that a transaction that was committed but not written home is replayed on mount."""
+    base = make_image('base.disk', IMAGE_SIZE, '-i', '64', '-j', '64')
+    done = str(tmp_path / 'done.disk')
+    crashed = str(tmp_path / 'crashed.disk')
+    mnt = str(tmp_path / 'mnt')
+    os.mkdir(mnt)
+
+    # The changes of a few operations, as the blocks they leave behind
+    shutil.copy(base, done)
+    data = os.urandom(3 * BLOCK_SIZE + 10)
+    mount(done, mnt)
+    try:
+        os.mkdir(os.path.join(mnt, 'dir'))
+        with open(os.path.join(mnt, 'dir', 'replayed'), 'wb') as f:
+            f.write(data)
+        expected = os.statvfs(mnt)
+    finally:
+        unmount(mnt)
+
+    # A crash right after the commit: logged, but not written home
+    old = read_blocks(base)
+    new = read_blocks(done)
+    start, length = journal_location(old)
+    home = {n: new[n] for n in range(len(old))
+            if not start <= n < start + length and old[n] != new[n]}
+    assert home
+    shutil.copy(base, crashed)
+    log_transaction(crashed, home)
+
+    mount(crashed, mnt)
+    try:
+        with open(os.path.join(mnt, 'dir', 'replayed'), 'rb') as f:
+            assert f.read() == data
+        stat = os.statvfs(mnt)
+        assert (stat.f_bfree, stat.f_ffree) == (expected.f_bfree, expected.f_ffree)
+    finally:
+        unmount(mnt)
+    # The replayed blocks are home, and the journal is empty again
+    replayed = read_blocks(crashed)
+    assert all(replayed[n] == block for n, block in home.items())
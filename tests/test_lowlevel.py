@@ -0,0 +1,39 @@
+import os
+
+BLOCK_SIZE = 4096
+IMAGE_SIZE = 16 * 1024 * 1024
+
+
+def test_unlinked_while_open(make_image, mount, unmount, tmp_path) -> None:
+    """Test that with -o lowlevel a file unlinked while open stays readable until closed, and is freed after."""
+    image = make_image('lowlevel.disk', IMAGE_SIZE, '-i', '64')
+    mnt = str(tmp_path / 'mnt')
+    os.mkdir(mnt)
+    data = os.urandom(8 * BLOCK_SIZE + 10)
+
+    mount(image, mnt, '-o', 'lowlevel')
+    try:
+        before = os.statvfs(mnt)
+        path = os.path.join(mnt, 'test_lowlevel')
+        with open(path, 'wb') as f:
+            f.write(data)
+
+        fd = os.open(path, os.O_RDONLY)
+        try:
+            os.unlink(path)
+            assert not os.path.exists(path)
+            assert os.pread(fd, len(data), 0) == data
+            assert os.fstat(fd).st_size == len(data)
+        finally:
+            os.close(fd)
+    finally:
+        unmount(mnt)
+
+    # Freed on the last forget, or as an orphan at unmount at the latest
+    mount(image, mnt, '-o', 'lowlevel')
+    try:
+        assert os.listdir(mnt) == []
+        after = os.statvfs(mnt)
+        assert (after.f_bfree, after.f_ffree) == (before.f_bfree, before.f_ffree)
+    finally:
+        unmount(mnt)
@@ -0,0 +1,65 @@
+import errno
+import os
+import stat
+
+import pytest
+
+
+@pytest.fixture()
+def tree(mount_point: str):
+    """Create a/b/c under mount_point and remove everything below a afterwards."""
+    top = os.path.join(mount_point, 'test_mkdir.a')
+    deepest = os.path.join(top, 'b', 'c')
+    os.makedirs(deepest)
+    yield top
+    for root, dirs, files in os.walk(top, topdown=False):
+        for name in files:
+            os.unlink(os.path.join(root, name))
+        for name in dirs:
+            os.rmdir(os.path.join(root, name))
+    os.rmdir(top)
+
+
+def test_nested_directories(tree: str) -> None:
+    """Test that every level of a nested directory is a directory with the expected link count."""
+    top_stats = os.stat(tree)
+    assert stat.S_ISDIR(top_stats.st_mode)
+    assert top_stats.st_nlink == 3
+
+    deepest_stats = os.stat(os.path.join(tree, 'b', 'c'))
+    assert stat.S_ISDIR(deepest_stats.st_mode)
+    assert deepest_stats.st_nlink == 2
+
+
+def test_files_in_subdirectory(tree: str) -> None:
+    """Test that a subdirectory can hold more entries than fit into a single block."""
+    deepest = os.path.join(tree, 'b', 'c')
+    names = [f'file.{i:03}' for i in range(40)]
+    for name in names:
+        open(os.path.join(deepest, name), 'w').close()
+
+    assert sorted(os.listdir(deepest)) == names
+    for name in names:
+        assert stat.S_ISREG(os.stat(os.path.join(deepest, name)).st_mode)
+
+
+def test_not_a_directory(tree: str) -> None:
+    """Test that a path through a regular file fails with ENOTDIR."""
+    path = os.path.join(tree, 'file')
+    open(path, 'w').close()
+
+    with pytest.raises(OSError) as e:
+        os.stat(os.path.join(path, 'child'))
+    assert e.value.errno == errno.ENOTDIR
+
+
+def test_rmdir_not_empty(tree: str) -> None:
+    """Test that a directory can only be removed once it is empty."""
+    middle = os.path.join(tree, 'b')
+    with pytest.raises(OSError) as e:
+        os.rmdir(middle)
+    assert e.value.errno == errno.ENOTEMPTY
+
+    os.rmdir(os.path.join(middle, 'c'))
+    os.rmdir(middle)
+    assert not os.path.exists(middle)
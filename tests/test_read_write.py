@@ -0,0 +1,84 @@
+import os
+
+import pytest
+
+BLOCK_SIZE = 4096
+
+
+@pytest.fixture()
+def path(mount_point: str):
+    """Return the path of a scratch file under mount_point and remove it afterwards."""
+    path = os.path.join(mount_point, 'test_read_write.dat')
+    yield path
+    if os.path.exists(path):
+        os.unlink(path)
+
+
+def test_multi_block_round_trip(path: str) -> None:
+    """Test that data spanning many blocks, including the indirect ones, reads back unchanged."""
+    data = os.urandom(10 * BLOCK_SIZE + 123)
+    with open(path, 'wb') as f:
+        f.write(data)
+
+    assert os.stat(path).st_size == len(data)
+    with open(path, 'rb') as f:
+        assert f.read() == data
+
+
+def test_unaligned_overwrite(path: str) -> None:
+    """Test that a write straddling block boundaries only changes the bytes it covers."""
+    data = bytearray(os.urandom(4 * BLOCK_SIZE))
+    with open(path, 'wb') as f:
+        f.write(data)
+
+    patch = os.urandom(2 * BLOCK_SIZE)
+    offset = BLOCK_SIZE - 7
+    with open(path, 'r+b') as f:
+        f.seek(offset)
+        f.write(patch)
+    data[offset:offset + len(patch)] = patch
+
+    assert os.stat(path).st_size == len(data)
+    with open(path, 'rb') as f:
+        assert f.read() == bytes(data)
+
+
+def test_write_past_eof_fills_hole(path: str) -> None:
+    """Test that writing past EOF extends the file and the gap reads back as zeros."""
+    with open(path, 'wb') as f:
+        f.write(b'head')
+        f.seek(3 * BLOCK_SIZE)
+        f.write(b'tail')
+
+    with open(path, 'rb') as f:
+        contents = f.read()
+    assert contents == b'head' + bytes(3 * BLOCK_SIZE - 4) + b'tail'
+
+
+def test_open_handle_io(path: str) -> None:
+    """Test reads, writes, ftruncate and fstat through one open descriptor."""
+    fd = os.open(path, os.O_RDWR | os.O_CREAT, 0o644)
+    try:
+        for i in range(64):
+            assert os.pwrite(fd, bytes([i]) * 100, i * 100) == 100
+        for i in range(64):
+            assert os.pread(fd, 100, i * 100) == bytes([i]) * 100
+
+        os.ftruncate(fd, 150)
+        assert os.fstat(fd).st_size == 150
+        assert os.pread(fd, 1000, 0) == bytes(100) + bytes([1]) * 50
+    finally:
+        os.close(fd)
+
+
+def test_fsync(path: str) -> None:
+    """Test that fsync and fdatasync succeed in any durability mode and leave the data intact."""
+    data = os.urandom(3 * BLOCK_SIZE)
+    fd = os.open(path, os.O_RDWR | os.O_CREAT, 0o644)
+    try:
+        os.write(fd, data)
+        os.fsync(fd)
+        os.fdatasync(fd)
+        assert os.pread(fd, len(data), 0) == data
+    finally:
+        os.close(fd)
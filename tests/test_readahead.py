@@ -0,0 +1,29 @@
+import os
+import random
+
+BLOCK_SIZE = 4096
+
+
+def test_readahead_sequential_and_random(mount_point: str) -> None:
+    """Test that reads return the right data whether or not they are sequential."""
+    path = os.path.join(mount_point, 'test_readahead')
+    data = os.urandom(512 * BLOCK_SIZE + 123)
+    try:
+        with open(path, 'wb') as f:
+            f.write(data)
+        with open(path, 'rb', buffering=0) as f:
+            # Sequential reads grow the prefetch window up to the limit
+            chunks = []
+            while chunk := f.read(3 * BLOCK_SIZE):
+                chunks.append(chunk)
+            assert b''.join(chunks) == data
+            # Random reads start over; sequential ones after them again
+            rng = random.Random(24)
+            for _ in range(100):
+                offset = rng.randrange(len(data))
+                size = rng.randrange(1, 4 * BLOCK_SIZE)
+                assert os.pread(f.fileno(), size, offset) == data[offset:offset + size]
+            for offset in range(100 * BLOCK_SIZE, 200 * BLOCK_SIZE, BLOCK_SIZE):
+                assert os.pread(f.fileno(), BLOCK_SIZE, offset) == data[offset:offset + BLOCK_SIZE]
+    finally:
+        os.remove(path)
@@ -0,0 +1,34 @@
+import os
+
+BLOCK_SIZE = 4096
+IMAGE_SIZE = 16 * 1024 * 1024
+XATTR_PREFIX = 'user.vsfs.writeback_'
+
+
+def writeback_counter(mount_point: str, name: str) -> int:
+    return int(os.getxattr(mount_point, XATTR_PREFIX + name))
+
+
+def test_writeback_counters(make_image, mount, unmount, tmp_path) -> None:
+    """Test that written blocks are tracked as dirty until an fsync() writes them back.
+
+    The image has no journal, and is mounted with -o durability=fsync, so that fsync() writes the blocks back
+    rather than leaving them to the write-back thread.
+    """
+    image = make_image('writeback.disk', IMAGE_SIZE, '-i', '64')
+    mnt = str(tmp_path / 'mnt')
+    os.mkdir(mnt)
+
+    mount(image, mnt, '-o', 'durability=fsync')
+    try:
+        written = writeback_counter(mnt, 'written')
+        path = os.path.join(mnt, 'test_writeback')
+        with open(path, 'wb') as f:
+            f.write(os.urandom(4 * BLOCK_SIZE))
+            f.flush()
+            assert writeback_counter(mnt, 'dirty') + writeback_counter(mnt, 'written') > written
+            os.fsync(f.fileno())
+        assert writeback_counter(mnt, 'written') > written
+        os.remove(path)
+    finally:
+        unmount(mnt)